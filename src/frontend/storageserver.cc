@@ -1,460 +1,1508 @@
+#include <atomic>
 #include <chrono>
+#include <cstring>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <list>
 #include <map>
+#include <mutex>
+#include <optional>
 #include <set>
+#include <signal.h>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 
 #include "nat/peer.hh"
 #include "storage/clienthandler.hh"
+#include "storage/hash_ring.hh"
 #include "storage/message.hh"
+#include "storage/remote_cache.hh"
+#include "util/histogram.hh"
+#include "util/log.hh"
+#include "util/signalfd.hh"
+#include "util/timerfd.hh"
+
+class StorageServer;
+
+// what the storage servers of one process share. there is one server per event loop thread: each has its own
+// listener (the kernel spreads clients across them with SO_REUSEPORT) and runs some of the peer connections.
+struct ServerGroup
+{
+  std::shared_ptr<SharedArena> arena;
+  ConcurrentLocalStorage storage;
+  RemoteCache remote_cache; // which objects in the storage are copies fetched from peers
+  std::vector<StorageServer*> servers {};       // by event loop
+  std::map<int, StorageServer*> peer_owners {}; // the server running each peer connection
+  HashRing placement {};                        // which node (this one or a peer) each key lives on
+  std::optional<int> self {};                   // this node's id on the ring
+
+  // setting up the connections to the peers, which all happens at once
+  size_t peers_expected {};
+  std::atomic<size_t> peers_settled { 0 }; // connected, or given up on
+  std::atomic<size_t> peers_connected { 0 };
+  uint64_t connect_started {};
+  std::function<void()> mesh_ready {}; // called (on some server's loop) once every peer has settled
+
+  // where the servers dump their stats, one JSON object per line (standard error if not set)
+  std::unique_ptr<std::ofstream> stats_file {};
+  std::mutex stats_mutex {};
+
+  ServerGroup( size_t size, const std::optional<std::string>& spill_directory = {} )
+    // leave room for size-class rounding and each shard's partially used slab regions on top of `size`
+    : arena( std::make_shared<SharedArena>(
+      2 * size + 2 * ConcurrentLocalStorage::DEFAULT_SHARDS * SlabAllocator::DEFAULT_REGION_SIZE ) )
+    , storage( size, ConcurrentLocalStorage::DEFAULT_SHARDS, [this] {
+      return std::make_unique<SlabAllocator>( arena );
+    } )
+    // copies of remote objects may take up to half the storage
+    , remote_cache( storage, size / 2 )
+  {
+    // cold objects go to disk when the storage is full
+    if ( spill_directory.has_value() ) {
+      storage.enable_spill( spill_directory.value() );
+    }
+  }
+};
 
 class StorageServer
 {
 private:
-  LocalStorage my_storage_;
+  static constexpr int TAGS_PER_SERVER = 1000; // concurrent requests to peers; more are answered with an error
+  static constexpr auto CONNECT_TICK = std::chrono::milliseconds( 10 );
+  static constexpr uint64_t CONNECT_TIMEOUT = 1'000'000'000;      // per attempt, in ns
+  static constexpr uint64_t MAX_CONNECT_BACKOFF = 1'000'000'000; // ns
+  static constexpr unsigned MAX_CONNECT_ATTEMPTS = 60;
+
+  ServerGroup& group_;
+  const size_t index_; // of this server's loop
+  std::shared_ptr<SharedArena> arena_;
+  ConcurrentLocalStorage& my_storage_;
   std::vector<EventLoop::RuleHandle> rules_ {};
   TCPSocket ready_socket_ {};
   TCPSocket listener_socket_ {};
   std::list<ClientHandler> clients_ {};
+  // the clients still connected, by id: answers from peers (handed over by tasks from other loops) may arrive
+  // after the client that asked for them has gone
+  std::unordered_map<uint64_t, ClientHandler*> live_clients_ {};
+  uint64_t next_client_id_ { 0 };
   // must not use unordered_map because we are going to need the iterator to persist in our event loop lambda
   // declarations!
   std::map<int, ClientHandler> connections_ {};
   MessageHandler message_handler_ {};
+  // tags come from this server's own range, so they are unique across the group
   UniqueTagGenerator tag_generator_;
-  std::unordered_map<int, ClientHandler*> outstanding_remote_requests_ {};
+  // a request sent to a peer over one of this server's connections, and whoever is waiting for its answer
+  struct RemoteRequest
+  {
+    enum class Kind
+    {
+      OTHER,
+      LOOKUP, // others can join it, and its answer is cached
+      DELETE, // its answer invalidates the cached copy
+      PUT     // a refusal invalidates the copy kept here
+    };
+
+    // the server and client (by id) that asked, and the place in line of the client's answer (more than one for
+    // a lookup that others joined). the first one sent the request, under a tag of its own.
+    std::vector<std::tuple<StorageServer*, uint64_t, uint64_t>> waiters {};
+    Kind kind {};
+    std::pair<int, std::string> object {}; // the (peer, name) a lookup or delete is about
+    uint8_t opcode {};                      // of the request itself
+    uint64_t sent_ns {};
+    EventLoop::TimerHandle timeout {}; // gives up on the answer (see expire_remote_request)
+  };
+  // by the tag it went out with
+  std::unordered_map<int, RemoteRequest> outstanding_remote_requests_ {};
+  // single flight: the tag of the lookup already on its way to each (peer, name)
+  std::map<std::pair<int, std::string>, int> lookups_in_flight_ {};
+  // requests that timed out, by tag: whose tag it is, and when to stop expecting a late answer. the peer may still
+  // answer, so the tag is not reused until it has (or has stopped being expected to).
+  std::unordered_map<int, std::pair<StorageServer*, EventLoop::TimerHandle>> expired_remote_requests_ {};
+  bool zerocopy_; // send large blobs to peers with MSG_ZEROCOPY
+  const uint64_t remote_timeout_ns_;
+  EventLoop* event_loop_ { nullptr }; // the one install_rules was given
+
+  // a peer connection that is still being set up. both ends connect to each other from the same port (a
+  // simultaneous open, which also gets through NATs), so attempts are refused until the other end has bound it:
+  // failed and timed out attempts are retried with exponential backoff. requests to the peer queue up meanwhile.
+  struct PeerConnect
+  {
+    Address address;
+    EventLoop* event_loop;
+    unsigned attempts {};
+    std::optional<EventLoop::RuleHandle> attempt {}; // the connect in progress, if any
+    uint64_t attempt_started {};
+    uint64_t next_attempt {};
+  };
+  std::map<int, PeerConnect> connecting_ {};
+  std::map<int, std::vector<EventLoop::RuleHandle>> peer_rules_ {}; // a peer's non-fd rules, cancelled when it dies
+  TimerFD connect_timer_ {}; // drives the retries and timeouts while anything is connecting
+
+  // where the time goes, kept by each server for its own loop
+  struct Stats
+  {
+    std::map<char, LatencyHistogram> local {};     // client requests until answered, by local opcode
+    std::map<uint8_t, LatencyHistogram> served {}; // handling a message from a peer, by remote opcode
+    std::map<uint8_t, LatencyHistogram> remote {}; // requests to peers until answered, by remote opcode
+    // the client requests still waiting for their answer to be handed over, by client and place in line:
+    // (opcode, arrival)
+    std::map<std::pair<const ClientHandler*, uint64_t>, std::pair<char, uint64_t>> waiting {};
+    uint64_t remote_timeouts {}; // requests to peers given up on
+  };
+  Stats stats_ {};
+
+  void handle_peer_message( ClientHandler& conn, const Frame& frame );
+  void handle_local_message( ClientHandler& client, const Frame& frame );
+  // where the payload of an incoming store lands: straight in a new object, or nowhere if it can't be created.
+  // the object is pinned, so that nothing (a delete, a spill, an eviction) can free it before it is committed.
+  std::optional<BlobHandle> allocate_payload( std::string name, size_t size );
+  // one coalesced answer to a multi get: a header with every size, then the objects that were found
+  std::vector<OutboundMessage> multi_get_response( const std::vector<std::optional<BlobHandle>>& objects );
+
+  // runs `task` on `server`'s loop: right away if that is this one, otherwise through its task queue
+  void run_on( StorageServer* server, std::function<void()>&& task );
+  // sends `request`, tagged `tag`, to peer `id` from whichever server runs that connection; its answer comes back
+  // to `client` in turn. a lookup of `name` that is already on its way to that peer is not sent again, it just
+  // waits for the answer (and `tag` is given back)
+  void send_remote_request( int id,
+                            int tag,
+                            ClientHandler& client,
+                            std::vector<OutboundMessage>&& request,
+                            RemoteRequest::Kind kind = RemoteRequest::Kind::OTHER,
+                            std::string name = {} );
+  void send_remote_request( int id,
+                            int tag,
+                            ClientHandler& client,
+                            std::string&& request,
+                            RemoteRequest::Kind kind = RemoteRequest::Kind::OTHER,
+                            std::string name = {} );
+  // hands the answer to request `tag` to every client waiting for it, on that client's loop
+  void deliver_remote_response( int tag, std::vector<OutboundMessage>&& response );
+  // buffers an answer for client `id` of this server, if it is still there, to go out in turn
+  void hand_answer( uint64_t id, uint64_t answer, std::vector<OutboundMessage>&& response );
+  // gives up on request `tag`: everyone waiting for it is told so, and its tag is reclaimed once it is safe to
+  void expire_remote_request( int tag );
+  // no answer to the expired request `tag` is expected any more
+  void forget_expired_request( int tag );
+  // a tag for a request to a peer, or nothing, with an error answer to `client`, if they are all in use
+  std::optional<int> peer_tag( ClientHandler& client );
+  // this server's `tag` is done with: back to tag_generator_ it goes
+  void release_tag( int tag );
+  // queues an answer to `client` that is ready now, behind the answers it is still waiting for from peers
+  void answer_in_order( ClientHandler& client, std::vector<OutboundMessage>&& response );
+  // same, but straight to the client when it is not waiting for anything
+  void respond( ClientHandler& client, std::vector<OutboundMessage>&& response );
+
+  // an object as the answer to a client's lookup of `name`, or an error if it is too large for one message
+  std::vector<OutboundMessage> object_response( const std::string& name, const BlobHandle& object );
+  // the answers to requests for objects kept here
+  std::vector<OutboundMessage> lookup_response( const std::string& name );
+  OutboundMessage store_response( bool stored );
+  OutboundMessage delete_response( const std::string& name );
+  // requests for objects kept by peer `id`, answered once the peer has
+  void remote_lookup( ClientHandler& client, int id, const std::string& name );
+  void remote_delete( ClientHandler& client, int id, const std::string& name );
+  // sends the object `name`, just stored here, to be kept by the peer. the copy here stays as a cached one.
+  void remote_put( ClientHandler& client, int id, const std::string& name );
+  // the peer `name` lives on, according to the placement ring, or nothing if it lives here
+  std::optional<int> home_of( std::string_view name );
 
 public:
-  StorageServer( size_t size );
+  static constexpr uint64_t DEFAULT_REMOTE_TIMEOUT = 5'000'000'000; // ns, for a peer to answer a request
+
+  StorageServer( ServerGroup& group,
+                 size_t index,
+                 bool zerocopy = false,
+                 uint64_t remote_timeout_ns = DEFAULT_REMOTE_TIMEOUT );
   void connect_lambda( std::string coordinator_ip,
                        uint16_t coordinator_port,
                        uint32_t thread_id,
                        uint32_t block_dim,
-                       EventLoop& event_loop );
-  void connect( std::map<size_t, std::string>& ips, EventLoop& event_loop );
+                       const std::vector<EventLoop*>& event_loops );
+  // spreads the peer connections over the group's servers, the i-th server running on event_loops[i]
+  void connect( std::map<size_t, std::string>& ips, const std::vector<EventLoop*>& event_loops );
+  // starts connecting to peer `id` on `event_loop`, without waiting for it
+  void connect_peer( int id, std::string ip, EventLoop& event_loop );
   void install_rules( EventLoop& event_loop );
+
+  StorageServer( const StorageServer& ) = delete;
+  StorageServer& operator=( const StorageServer& ) = delete;
+
+  // writes this server's stats (see Stats) as one line of JSON
+  void dump_stats();
+  // has every server in the group dump its stats, each on its own loop
+  void dump_group_stats();
+
+private:
+  void start_connect( int id );
+  void connect_succeeded( int id );
+  void connect_failed( int id );
+  // starts the attempts that are due, and gives up on the ones that take too long
+  void retry_connects();
+  // one more peer connected or given up on
+  void peer_settled( bool connected );
+  // the connection to peer `id` broke: its keys go to the other nodes, and what was asked of it fails now
+  void peer_died( int id );
 };
 
-StorageServer::StorageServer( size_t size )
-  : my_storage_( size )
+StorageServer::StorageServer( ServerGroup& group, size_t index, bool zerocopy, uint64_t remote_timeout_ns )
+  : group_( group )
+  , index_( index )
+  , arena_( group.arena )
+  , my_storage_( group.storage )
   , rules_ {}
   , listener_socket_( [&] {
     TCPSocket listener_socket;
     listener_socket.set_blocking( false );
     listener_socket.set_reuseaddr();
+    listener_socket.set_reuseport();
     listener_socket.bind( { "127.0.0.1", 8080 } );
     listener_socket.listen();
     return listener_socket;
   }() )
-  , tag_generator_( 1000 ) // supports 1000 concurrent tags, should be more than enough
+  , tag_generator_( index * TAGS_PER_SERVER, TAGS_PER_SERVER )
+  , zerocopy_( zerocopy )
+  , remote_timeout_ns_( remote_timeout_ns )
 {}
 
 void StorageServer::connect_lambda( std::string coordinator_ip,
                                     uint16_t coordinator_port,
                                     uint32_t thread_id,
                                     uint32_t block_dim,
-                                    EventLoop& event_loop )
+                                    const std::vector<EventLoop*>& event_loops )
 {
   std::ofstream fout { "/tmp/out" };
   std::map<size_t, std::string> peer_addresses
     = get_peer_addresses( thread_id, coordinator_ip, coordinator_port, block_dim, fout );
-  this->connect( peer_addresses, event_loop );
+  group_.self = thread_id;
+  group_.placement.add_node( thread_id );
   ready_socket_.set_blocking( false );
   ready_socket_.set_reuseaddr();
   ready_socket_.bind( { "127.0.0.1", 8079 } );
-  ready_socket_.listen();
+  // ready once connected to everyone
+  group_.mesh_ready = [this] { ready_socket_.listen(); };
+  this->connect( peer_addresses, event_loops );
 }
 
-void StorageServer::connect( std::map<size_t, std::string>& ips, EventLoop& event_loop )
+void StorageServer::connect( std::map<size_t, std::string>& ips, const std::vector<EventLoop*>& event_loops )
 {
+  group_.peers_expected = ips.size();
+  group_.connect_started = Timer::timestamp_ns();
+  if ( ips.empty() and group_.mesh_ready ) {
+    group_.mesh_ready();
+  }
+
+  size_t next = 0;
   for ( auto& it : ips ) {
-    int id = it.first;
-    std::string ip = it.second;
-    Address address { ip, static_cast<uint16_t>( 8000 ) };
-    TCPSocket socket;
-    socket.set_reuseaddr();
+    group_.placement.add_node( it.first );
+    const size_t loop = next++ % group_.servers.size();
+    group_.servers[loop]->connect_peer( it.first, it.second, *event_loops[loop] );
+  }
+}
+
+void StorageServer::connect_peer( int id, std::string ip, EventLoop& event_loop )
+{
+  Address address { ip, static_cast<uint16_t>( 8000 ) };
+  // the socket is replaced by each connect attempt
+  auto r = connections_.emplace( id, ClientHandler { TCPSocket {}, RingBuffer( 4096 ), RingBuffer( 4096 ) } );
+  if ( !r.second ) {
+    assert( false );
+  }
+  auto conn_it = r.first;
+  conn_it->second.store_header_length_
+    = [&]( std::string_view header ) { return message_handler_.remote_store_header_length( header ); };
+  conn_it->second.allocate_payload_ = [&]( std::string_view header, size_t size ) {
+    std::vector<PayloadPart> parts;
+    if ( PackedHeader::decode( header )->opcode != MessageHandler::MULTI_STORE ) {
+      const std::string name = std::get<0>( message_handler_.parse_remote_store( header ) );
+      parts.push_back( { size, allocate_payload( name, size ) } );
+      return parts;
+    }
+    // an object of a multi store each, in the order they arrive
+    const auto entries = std::get<0>( message_handler_.parse_remote_multi_store( header ) );
+    for ( const auto& [key, part_size] : entries ) {
+      if ( part_size != MessageHandler::NOT_FOUND ) {
+        parts.push_back( { part_size, allocate_payload( std::string { key }, part_size ) } );
+      }
+    }
+    return parts;
+  };
+  conn_it->second.handle_frame_
+    = [&, conn_it]( const Frame& frame ) { handle_peer_message( conn_it->second, frame ); };
+
+  group_.peer_owners.insert( { id, this } );
+  LOG( Info ) << "opening up connection to remote socket at " << ip;
+
+  conn_it->second.interest_group_ = event_loop.make_interest_group();
+  peer_rules_[id].push_back( event_loop.add_rule(
+    "receive messages-peer",
+    [&, conn_it] { conn_it->second.parse(); },
+    [&, conn_it] { return conn_it->second.can_parse(); } ) );
+  conn_it->second.interest_group_.add( peer_rules_[id].back() );
+
+  peer_rules_[id].push_back( event_loop.add_rule(
+    "write responses",
+    [&, conn_it] { conn_it->second.produce(); },
+    [&, conn_it] { return conn_it->second.can_produce(); } ) );
+  conn_it->second.interest_group_.add( peer_rules_[id].back() );
+
+  if ( connecting_.empty() ) {
+    connect_timer_.set( CONNECT_TICK, CONNECT_TICK );
+  }
+  connecting_.insert( { id, { address, &event_loop } } );
+  start_connect( id );
+}
+
+void StorageServer::start_connect( int id )
+{
+  PeerConnect& pending = connecting_.at( id );
+  ClientHandler& conn = connections_.at( id );
+  pending.attempts++;
+  pending.attempt_started = Timer::timestamp_ns();
+
+  TCPSocket socket;
+  socket.set_blocking( false );
+  socket.set_reuseaddr();
+  try {
     socket.bind( { "0", static_cast<uint16_t>( 8000 ) } );
-    // socket.set_blocking( false );
-    socket.connect( address );
-    auto r = connections_.emplace(
-      id, ClientHandler { std::move( socket ), RingBuffer( 4096 ), RingBuffer( 4096 ), {}, 4, 0, {}, {} } );
-    if ( !r.second ) {
-      assert( false );
-    }
-    auto conn_it = r.first;
-
-    std::cout << "opening up connection to remote socket at " << ip << std::endl;
-
-    event_loop.add_rule(
-      "http-peer",
-      conn_it->second.socket_,
-      [&, conn_it] {
-        conn_it->second.read_buffer_.read_from( conn_it->second.socket_ );
-        std::cout << conn_it->second.read_buffer_.readable_region().length() << std::endl;
-      },
-      [&, conn_it] { return not conn_it->second.read_buffer_.writable_region().empty(); },
-      [&, conn_it] { conn_it->second.send_buffer_.write_to( conn_it->second.socket_ ); },
-      [&, conn_it] { return not conn_it->second.send_buffer_.readable_region().empty(); },
-      [&, conn_it] {
-        std::cout << "died" << std::endl;
-        conn_it->second.socket_.close();
-        connections_.erase( conn_it );
-      } );
-
-    event_loop.add_rule(
-      "receive messages-peer",
-      [&, conn_it] { conn_it->second.parse(); },
-      [&, conn_it] {
-        return conn_it->second.temp_inbound_message_.length() > 0
-               or not conn_it->second.read_buffer_.readable_region().empty();
-      } );
-
-    event_loop.add_rule(
-      "pop messages",
-      [&, conn_it] {
-        std::string msg = conn_it->second.inbound_messages_.front();
-        conn_it->second.inbound_messages_.pop_front();
-        std::cout << "message recevid " << msg << std::endl;
-
-        int opcode = stoi( msg.substr( 0, 1 ) );
-        switch ( opcode ) {
-
-            // new object creation in localstorage, returns the pointer value as a string
-            // currently useless without shared memory, but will be useful when shared memory is implemented.
-            // look up an object in localstorage and stream out its contents to the output socket
-
-          case 1: {
-            auto result = message_handler_.parse_remote_lookup( msg );
-            std::string name = std::get<0>( result );
-            int tag = std::get<1>( result );
-            std::cout << "looking up:" << name << ";" << std::endl;
-            auto a = my_storage_.locate( name );
-            if ( a.has_value() ) {
-              // we are actually going to just send a opcode 2 response right back to the one who sent the request.
-              std::string remote_request = message_handler_.generate_remote_store_header( tag, name, a.value().size );
-              OutboundMessage response_header = { plaintext, { {}, std::move( remote_request ) } };
-              conn_it->second.outbound_messages_.emplace_back( std::move( response_header ) );
-              OutboundMessage response = { pointer, { { a.value().ptr, a.value().size }, {} } };
-              conn_it->second.outbound_messages_.emplace_back( std::move( response ) );
-            } else {
-              std::string message = message_handler_.generate_remote_error( tag, "can't find object" );
-              OutboundMessage response = { plaintext, { {}, std::move( message ) } };
-              conn_it->second.outbound_messages_.emplace_back( std::move( response ) );
-            }
-            break;
-          }
-          // remote store request from this connection, must have been initiated by a remote lookup request sent from
-          // here
-          case 2: {
-            auto result = message_handler_.parse_remote_store( msg );
-            std::string name = std::get<0>( result );
-            int size = std::get<1>( result );
-            int tag = std::get<2>( result );
-
-            auto success = my_storage_.new_object_from_string( name, std::move( msg.substr( 9 + size ) ) );
-            if ( success == 0 ) {
-              auto requesting_client = outstanding_remote_requests_.find( tag );
-              if ( requesting_client == outstanding_remote_requests_.end() ) {
-                std::cout << "received remote object that nobody has asked for, storing it locally" << std::endl;
-              } else {
-                auto a = my_storage_.locate( name ).value();
-                OutboundMessage response_header
-                  = { plaintext, { {}, message_handler_.generate_local_object_header( name, a.size ) } };
-                OutboundMessage response = { pointer, { { a.ptr, a.size }, {} } };
-                requesting_client->second->buffered_remote_responses_[tag] = { response_header, response };
-              }
+    socket.connect( pending.address );
+  } catch ( const unix_error& e ) {
+    LOG( Warn ) << "connecting to peer " << id << " failed: " << e.what();
+    connect_failed( id );
+    return;
+  }
+  conn.socket_ = std::move( socket );
 
-            } else {
-              auto requesting_client = outstanding_remote_requests_.find( tag );
-              if ( requesting_client == outstanding_remote_requests_.end() ) {
-                std::cout << "received remote object nobody asked for, couldn't store it" << std::endl;
-              } else {
-                auto a = my_storage_.locate( name );
-                if ( a.has_value() ) {
-                  auto b = a.value();
-                  OutboundMessage response_header
-                    = { plaintext, { {}, message_handler_.generate_local_object_header( name, b.size ) } };
-                  OutboundMessage response = { pointer, { { b.ptr, b.size }, {} } };
-                  requesting_client->second->buffered_remote_responses_[tag] = { response_header, response };
-                } else {
-                  OutboundMessage response
-                    = { plaintext,
-                        { {},
-                          message_handler_.generate_local_error( "can't create new local object with ptr, object also "
-                                                                 "not in storage (could it be too big?)" ) } };
-                  requesting_client->second->buffered_remote_responses_[tag] = { response };
-                }
-              }
-            }
-            // reallow this tag.
-            tag_generator_.allow( tag );
-            break;
+  // each attempt gets its own rule on its own socket; a rule for an attempt that is over (timed out) does nothing.
+  // the socket turns writable once connected. a refusal (the peer hasn't bound its end yet) comes as an error,
+  // which ends the rule: while connecting, that means trying again, and afterwards that the peer died.
+  const int fd = conn.socket_.fd_num();
+  auto mine = [&conn, fd] { return conn.socket_.fd_num() == fd; };
+  auto connecting = [this, id] { return connecting_.count( id ) > 0; };
+  // edge-triggered, so a bulk transfer takes one wakeup for as much as the socket has, not one per buffer's worth
+  pending.attempt = pending.event_loop->add_rule(
+    "http-peer",
+    EventLoop::EdgeTriggered,
+    conn.socket_,
+    [&conn] {
+      conn.receive_all();
+      LOG( Debug ) << conn.read_buffer_.readable_region().length();
+    },
+    [&conn, mine, connecting] { return mine() and not connecting() and conn.wants_to_receive(); },
+    [this, id, &conn, connecting] {
+      if ( connecting() ) {
+        connect_succeeded( id );
+      }
+      conn.send_all();
+    },
+    [&conn, mine, connecting] { return mine() and ( connecting() or conn.wants_to_send() ); },
+    [this, id, mine, connecting] {
+      if ( not mine() ) {
+        return;
+      }
+      if ( connecting() ) {
+        connect_failed( id );
+      } else {
+        peer_died( id );
+      }
+    },
+    [&conn] { conn.complete_zerocopy(); } );
+  conn.interest_group_.add( pending.attempt.value() );
+}
+
+void StorageServer::connect_succeeded( int id )
+{
+  PeerConnect& pending = connecting_.at( id );
+  ClientHandler& conn = connections_.at( id );
+  LOG( Info ) << "connected to peer " << id << " after " << pending.attempts << " attempt(s)";
+  connecting_.erase( id );
+  if ( connecting_.empty() ) {
+    connect_timer_.disarm();
+  }
+
+  // replies are written as runs of small writes; don't let them wait on delayed acks
+  conn.socket_.set_nodelay();
+  if ( zerocopy_ ) {
+    conn.socket_.set_zerocopy();
+    conn.zerocopy_ = true;
+  }
+
+  peer_settled( true );
+}
+
+void StorageServer::connect_failed( int id )
+{
+  PeerConnect& pending = connecting_.at( id );
+  // its rule is grouped, so it wouldn't notice by itself that its socket is no longer the connection's
+  if ( pending.attempt.has_value() ) {
+    pending.attempt->cancel();
+  }
+  pending.attempt.reset();
+  if ( pending.attempts >= MAX_CONNECT_ATTEMPTS ) {
+    LOG( Warn ) << "giving up on peer " << id << " after " << pending.attempts << " attempts";
+    // its keys go to the other nodes. requests that name it stay queued.
+    group_.placement.remove_node( id );
+    connecting_.erase( id );
+    if ( connecting_.empty() ) {
+      connect_timer_.disarm();
+    }
+    peer_settled( false );
+    return;
+  }
+  const uint64_t backoff = std::min( MAX_CONNECT_BACKOFF, uint64_t { 5'000'000 } << std::min( pending.attempts, 10u ) );
+  pending.next_attempt = Timer::timestamp_ns() + backoff;
+}
+
+void StorageServer::retry_connects()
+{
+  const uint64_t now = Timer::timestamp_ns();
+  std::vector<int> timed_out, due;
+  for ( auto& [id, pending] : connecting_ ) {
+    if ( pending.attempt.has_value() and now - pending.attempt_started > CONNECT_TIMEOUT ) {
+      timed_out.push_back( id );
+    } else if ( not pending.attempt.has_value() and now >= pending.next_attempt ) {
+      due.push_back( id );
+    }
+  }
+  for ( const int id : timed_out ) {
+    // no answer at all (e.g. the SYNs are being dropped): try again later
+    connecting_.at( id ).attempt->cancel();
+    connect_failed( id );
+  }
+  for ( const int id : due ) {
+    start_connect( id );
+  }
+}
+
+void StorageServer::peer_settled( bool connected )
+{
+  if ( connected ) {
+    group_.peers_connected++;
+  }
+  if ( ++group_.peers_settled == group_.peers_expected ) {
+    LOG( Info ) << "connected to " << group_.peers_connected.load() << " of " << group_.peers_expected
+                << " peers in " << ( Timer::timestamp_ns() - group_.connect_started ) / 1000000.0 << " ms";
+    if ( group_.mesh_ready ) {
+      group_.mesh_ready();
+    }
+  }
+}
+
+void StorageServer::peer_died( int id )
+{
+  LOG( Warn ) << "peer " << id << " died";
+  for ( auto& rule : peer_rules_.at( id ) ) {
+    rule.cancel();
+  }
+  peer_rules_.erase( id );
+  connections_.at( id ).socket_.close();
+  connections_.erase( id );
+  group_.placement.remove_node( id );
+
+  // nothing more will come from it, not even a late answer, so the tags can go straight back
+  std::vector<int> unanswered;
+  for ( const auto& [tag, request] : outstanding_remote_requests_ ) {
+    if ( request.object.first != id ) {
+      continue;
+    }
+    unanswered.push_back( tag );
+    // as if it had refused: a copy put or deleted there may not match what it has
+    if ( request.kind == RemoteRequest::Kind::PUT or request.kind == RemoteRequest::Kind::DELETE ) {
+      group_.remote_cache.invalidate( id, request.object.second );
+    }
+  }
+  for ( const int tag : unanswered ) {
+    deliver_remote_response( tag, { { plaintext, { {}, message_handler_.generate_local_error( "peer died" ) } } } );
+  }
+}
+
+void StorageServer::handle_peer_message( ClientHandler& conn, const Frame& frame )
+{
+  std::string_view msg = frame.header;
+  LOG( Debug ) << "message recevid " << msg;
+
+  auto header = PackedHeader::decode( msg );
+  if ( not header.has_value() ) {
+    LOG( Warn ) << "dropping peer message that is too short or from another protocol version";
+    return;
+  }
+  const uint64_t arrived = Timer::timestamp_ns();
+  switch ( header->opcode ) {
+
+      // look up an object in localstorage and stream out its contents to the output socket
+
+    case MessageHandler::LOOKUP: {
+      auto result = message_handler_.parse_remote_lookup( msg );
+      std::string name = std::get<0>( result );
+      int tag = std::get<1>( result );
+      LOG( Debug ) << "looking up:" << name << ";";
+      auto a = my_storage_.acquire( name );
+      if ( a.has_value() ) {
+        // we are actually going to just send a opcode 2 response right back to the one who sent the request.
+        std::string remote_request = message_handler_.generate_remote_store_header( tag, name, a->blob.size );
+        OutboundMessage response_header = { plaintext, { {}, std::move( remote_request ) } };
+        conn.outbound_messages_.emplace_back( std::move( response_header ) );
+        for ( auto& response : blob_messages( a.value() ) ) {
+          conn.outbound_messages_.emplace_back( std::move( response ) );
+        }
+      } else {
+        std::string message = message_handler_.generate_remote_error( tag, "can't find object" );
+        OutboundMessage response = { plaintext, { {}, std::move( message ) } };
+        conn.outbound_messages_.emplace_back( std::move( response ) );
+      }
+      break;
+    }
+    // remote store request from this connection, must have been initiated by a remote lookup request sent from
+    // here
+    case MessageHandler::STORE: {
+      // the payload has already been received into its object (see allocate_payload)
+      auto result = message_handler_.parse_remote_store( msg );
+      std::string name = std::get<0>( result );
+      int tag = std::get<2>( result );
+
+      if ( frame.payload_stored ) {
+        my_storage_.commit( name );
+        LOG( Debug ) << "received " << frame.payload.size() << " bytes from peer " << conn.socket_.peer_address().ip()
+                     << ", " << conn.payload_bytes_ << " bytes so far at " << conn.payload_gbps() << " GB/s ("
+                     << conn.direct_payload_bytes_ << " read straight into storage)";
+      }
+      // if it couldn't be stored, we may still have an older copy
+      auto a = my_storage_.acquire( name );
+      if ( a.has_value() ) {
+        auto request = outstanding_remote_requests_.find( tag );
+        if ( frame.payload_stored and request != outstanding_remote_requests_.end()
+             and request->second.kind == RemoteRequest::Kind::LOOKUP ) {
+          // later lookups of it are answered from this copy
+          group_.remote_cache.insert( request->second.object.first, name, a->blob.size );
+        }
+        deliver_remote_response( tag, object_response( name, a.value() ) );
+      } else {
+        OutboundMessage response
+          = { plaintext,
+              { {},
+                message_handler_.generate_local_error( "can't create new local object with ptr, object also "
+                                                       "not in storage (could it be too big?)" ) } };
+        deliver_remote_response( tag, { response } );
+      }
+      break;
+    }
+    // an object the peer wants kept here
+    case MessageHandler::PUT: {
+      // the payload has already been received into its object (see allocate_payload)
+      auto result = message_handler_.parse_remote_store( msg );
+      std::string name = std::get<0>( result );
+      int tag = std::get<2>( result );
+      std::string message;
+      if ( frame.payload_stored ) {
+        my_storage_.commit( name );
+        message = message_handler_.generate_remote_success( tag, "stored " + name );
+      } else {
+        message = message_handler_.generate_remote_error( tag, "can't store " + name );
+      }
+      conn.outbound_messages_.push_back( { plaintext, { {}, std::move( message ) } } );
+      break;
+    }
+    // delete
+    case MessageHandler::DELETE: {
+      // parse remote delete and parse remote lookup should be the same.
+      auto result = message_handler_.parse_remote_lookup( msg );
+      std::string name = std::get<0>( result );
+      int tag = std::get<1>( result );
+      LOG( Debug ) << "deleting:" << name << ";";
+      int a = my_storage_.delete_object( name );
+      if ( a == 0 ) {
+        group_.remote_cache.forget( name );
+        OutboundMessage response
+          = { plaintext, { {}, message_handler_.generate_remote_success( tag, "deleted " + name ) } };
+        conn.outbound_messages_.emplace_back( std::move( response ) );
+      } else {
+        OutboundMessage response
+          = { plaintext, { {}, message_handler_.generate_remote_error( tag, "failed to delete " + name ) } };
+        conn.outbound_messages_.emplace_back( std::move( response ) );
+      }
+      break;
+    }
+
+    // a batch of lookups, answered with one multi store holding every object that was found
+    case MessageHandler::MULTI_LOOKUP: {
+      auto request = message_handler_.parse_remote_multi_lookup( msg );
+      const std::vector<std::string_view>& keys = std::get<0>( request );
+      int tag = std::get<1>( request );
+
+      std::vector<uint64_t> sizes;
+      std::vector<BlobHandle> found;
+      sizes.reserve( keys.size() );
+      for ( const auto key : keys ) {
+        auto a = my_storage_.acquire( key );
+        sizes.push_back( a.has_value() ? a->blob.size : MessageHandler::NOT_FOUND );
+        if ( a.has_value() ) {
+          found.push_back( std::move( a.value() ) );
+        }
+      }
+
+      OutboundMessage response_header
+        = { plaintext, { {}, message_handler_.generate_remote_multi_store_header( tag, keys, sizes ) } };
+      conn.outbound_messages_.emplace_back( std::move( response_header ) );
+      for ( const auto& b : found ) {
+        for ( auto& response : blob_messages( b ) ) {
+          conn.outbound_messages_.emplace_back( std::move( response ) );
+        }
+      }
+      break;
+    }
+    // the answer to a multi lookup sent from here: store what came back, then hand it all to the client at once
+    case MessageHandler::MULTI_STORE: {
+      // the objects have already been received into theirs (see allocate_payload), unless the table was too
+      // large to receive on its own and they came along in the frame
+      auto result = message_handler_.parse_remote_multi_store( msg );
+      const auto& entries = std::get<0>( result );
+      std::string_view objects = std::get<1>( result );
+      int tag = std::get<2>( result );
+
+      std::vector<std::optional<BlobHandle>> stored;
+      stored.reserve( entries.size() );
+      size_t part = 0;
+      for ( const auto& [key, size] : entries ) {
+        if ( size == MessageHandler::NOT_FOUND ) {
+          stored.push_back( {} );
+          continue;
+        }
+        std::string name { key };
+        if ( not objects.empty() ) {
+          if ( const auto dest = allocate_payload( name, size ) ) {
+            memcpy( dest->blob.ptr, objects.data(), size );
+            my_storage_.commit( name );
           }
-          // delete
-          case 3: {
-            // parse remote delete and parse remote lookup should be the same.
-            auto result = message_handler_.parse_remote_lookup( msg );
-            std::string name = std::get<0>( result );
-            int tag = std::get<1>( result );
-            std::cout << "looking up:" << name << ";" << std::endl;
-            int a = my_storage_.delete_object( name );
-            if ( a == 0 ) {
-              OutboundMessage response
-                = { plaintext, { {}, message_handler_.generate_remote_success( tag, "deleted " + name ) } };
-              conn_it->second.outbound_messages_.emplace_back( std::move( response ) );
-            } else {
-              OutboundMessage response
-                = { plaintext, { {}, message_handler_.generate_remote_error( tag, "failed to delete " + name ) } };
-              conn_it->second.outbound_messages_.emplace_back( std::move( response ) );
+          objects.remove_prefix( size );
+        } else if ( frame.parts_stored.at( part++ ) ) {
+          my_storage_.commit( name );
+        }
+        // as with a single store, fall back to a copy we already have
+        stored.push_back( my_storage_.acquire( name ) );
+      }
+
+      deliver_remote_response( tag, multi_get_response( stored ) );
+      break;
+    }
+
+    // got an opcode with an error code related to a remote request likely
+
+    // currently remote success and remote failure get handled the same way
+    case MessageHandler::SUCCESS:
+    case MessageHandler::ERROR: {
+      auto error = message_handler_.parse_remote_error( msg );
+      int tag = std::get<1>( error );
+      auto request = outstanding_remote_requests_.find( tag );
+      if ( request != outstanding_remote_requests_.end() ) {
+        const auto& [id, name] = request->second.object;
+        if ( request->second.kind == RemoteRequest::Kind::DELETE ) {
+          // whatever the answer, the peer has no such object now: a copy fetched before the delete (even one
+          // that only just arrived) is stale
+          group_.remote_cache.invalidate( id, name );
+        } else if ( request->second.kind == RemoteRequest::Kind::PUT
+                    and header->opcode == MessageHandler::ERROR ) {
+          group_.remote_cache.invalidate( id, name );
+        } else if ( request->second.kind == RemoteRequest::Kind::LOOKUP
+                    and header->opcode == MessageHandler::ERROR ) {
+          // the only error a lookup gets is that the peer has no such object: remember that for a while
+          group_.remote_cache.insert_missing( id, name );
+        }
+      }
+      std::string message = header->opcode == MessageHandler::SUCCESS
+                              ? message_handler_.generate_local_success( std::get<0>( error ) )
+                              : message_handler_.generate_local_error( std::get<0>( error ) );
+      OutboundMessage response = { plaintext, { {}, std::move( message ) } };
+      deliver_remote_response( tag, { response } );
+      break;
+    }
+    default: {
+      OutboundMessage response
+        = { plaintext, { {}, message_handler_.generate_remote_error( header->tag, "unidentified opcode" ) } };
+      conn.outbound_messages_.emplace_back( response );
+      break;
+    }
+  }
+  stats_.served[header->opcode].record( Timer::timestamp_ns() - arrived );
+}
+
+void StorageServer::handle_local_message( ClientHandler& client, const Frame& frame )
+{
+  std::string_view message = frame.header;
+  LOG( Debug ) << "message recevid " << message;
+  const uint64_t arrived = Timer::timestamp_ns();
+  const uint64_t waiting = client.next_answer_;
+
+  switch ( message[0] ) {
+
+      // new object creation in localstorage, returns the object's offset in the shared arena
+      // (see opcode 4 for how to map it)
+
+    case '0': {
+      int size = *reinterpret_cast<const int*>( message.data() + 1 );
+      LOG( Debug ) << "size " << size << ";";
+      std::string name { message.substr( 5 ) };
+      LOG( Debug ) << "storing:" << name << ";";
+      auto a = my_storage_.new_object( name, size );
+      if ( a.has_value() ) {
+        OutboundMessage response
+          = { plaintext, { {}, message_handler_.generate_local_offset( arena_->offset_of( a.value() ) ) } };
+        client.outbound_messages_.emplace_back( std::move( response ) );
+      } else {
+        OutboundMessage response
+          = { plaintext, { {}, message_handler_.generate_local_error( "new object creation failed" ) } };
+        client.outbound_messages_.emplace_back( std::move( response ) );
+      }
+      break;
+    }
+
+      // look up an object in localstorage and stream out its contents to the output socket
+
+    case '1': {
+      std::string name = message_handler_.parse_local_lookup( message );
+      LOG( Debug ) << "looking up:" << name << ";";
+      for ( auto& response : lookup_response( name ) ) {
+        client.outbound_messages_.emplace_back( std::move( response ) );
+      }
+      break;
+    }
+
+      // stores a new object by string into the localstorage
+
+    case '2': {
+      // the payload has already been received into its object (see allocate_payload)
+      if ( frame.payload_stored ) {
+        // complete, so it may be spilled from now on
+        my_storage_.commit( message_handler_.parse_local_store( message ) );
+      }
+      client.outbound_messages_.emplace_back( store_response( frame.payload_stored ) );
+      break;
+    }
+
+    // tells the storage server to send a get request to a remote server
+    case '3': {
+      auto result = message_handler_.parse_local_remote_lookup( message );
+      remote_lookup( client, std::get<1>( result ), std::get<0>( result ) );
+      break;
+    }
+
+    // where to map the shared arena from, for clients on the same machine
+    case '4': {
+      OutboundMessage response = {
+        plaintext, { {}, message_handler_.generate_local_arena_info( arena_->path(), arena_->capacity() ) }
+      };
+      client.outbound_messages_.emplace_back( std::move( response ) );
+      break;
+    }
+
+    // look up an object and hand out its location in the shared arena instead of its bytes. the object is
+    // pinned until the client releases the returned reference with opcode 9
+    case '8': {
+      std::string name = message_handler_.parse_local_lookup( message );
+      auto a = my_storage_.acquire( name );
+      if ( a.has_value() and a->blob.segmented() ) {
+        // has no single offset to hand out
+        OutboundMessage response = {
+          plaintext, { {}, message_handler_.generate_local_error( "object is segmented, commit it coalesced" ) }
+        };
+        client.outbound_messages_.emplace_back( std::move( response ) );
+      } else if ( a.has_value() ) {
+        int ref = client.next_shared_ref_++;
+        client.shared_refs_.insert( { ref, a.value() } );
+        OutboundMessage response
+          = { plaintext,
+              { {},
+                message_handler_.generate_local_shared_object(
+                  arena_->offset_of( a->blob.ptr ), a->blob.size, ref ) } };
+        client.outbound_messages_.emplace_back( std::move( response ) );
+      } else {
+        OutboundMessage response
+          = { plaintext, { {}, message_handler_.generate_local_error( "can't find object" ) } };
+        client.outbound_messages_.emplace_back( std::move( response ) );
+      }
+      break;
+    }
+
+    case '9': {
+      int ref = message_handler_.parse_local_release( message );
+      auto got = client.shared_refs_.find( ref );
+      if ( got != client.shared_refs_.end() ) {
+        client.shared_refs_.erase( got );
+        OutboundMessage response
+          = { plaintext, { {}, message_handler_.generate_local_success( "released reference" ) } };
+        client.outbound_messages_.emplace_back( std::move( response ) );
+      } else {
+        OutboundMessage response
+          = { plaintext, { {}, message_handler_.generate_local_error( "unknown reference" ) } };
+        client.outbound_messages_.emplace_back( std::move( response ) );
+      }
+      break;
+    }
+
+    case '6': {
+      client.outbound_messages_.emplace_back( delete_response( message_handler_.parse_local_lookup( message ) ) );
+      break;
+    }
+
+    case '7': {
+      auto result = message_handler_.parse_local_remote_lookup( message );
+      remote_delete( client, std::get<1>( result ), std::get<0>( result ) );
+      break;
+    }
+
+    // get, put and delete without naming the node: the placement ring decides whether the object is kept here
+    // or by a peer. laid out like 1, 2 and 6.
+    case 'G': {
+      std::string name = message_handler_.parse_local_lookup( message );
+      if ( auto id = home_of( name ); id.has_value() ) {
+        remote_lookup( client, id.value(), name );
+      } else {
+        respond( client, lookup_response( name ) );
+      }
+      break;
+    }
+
+    case 'P': {
+      // the payload has already been received into an object here (see allocate_payload), wherever it belongs
+      std::string name = message_handler_.parse_local_store( message );
+      auto id = home_of( name );
+      if ( frame.payload_stored and id.has_value() ) {
+        remote_put( client, id.value(), name );
+        break;
+      }
+      if ( frame.payload_stored ) {
+        my_storage_.commit( name );
+      }
+      respond( client, { store_response( frame.payload_stored ) } );
+      break;
+    }
+
+    case 'D': {
+      std::string name = message_handler_.parse_local_lookup( message );
+      if ( auto id = home_of( name ); id.has_value() ) {
+        remote_delete( client, id.value(), name );
+      } else {
+        respond( client, { delete_response( name ) } );
+      }
+      break;
+    }
+
+    // re-homes a key (e.g. a hot one) to the node `id`, laid out like 3. only changes where it is looked for
+    // from here on: moving the object is up to the client.
+    case 'H': {
+      auto [name, id] = message_handler_.parse_local_remote_lookup( message );
+      std::string text;
+      if ( id == group_.self or group_.peer_owners.count( id ) ) {
+        group_.placement.rehome( name, id );
+        text = message_handler_.generate_local_success( "re-homed " + name + " to " + std::to_string( id ) );
+      } else {
+        text = message_handler_.generate_local_error( "no node " + std::to_string( id ) );
+      }
+      respond( client, { { plaintext, { {}, std::move( text ) } } } );
+      break;
+    }
+
+    // batches: look up many objects at once, answered with one coalesced message
+    case 'g': {
+      std::vector<std::optional<BlobHandle>> objects;
+      for ( const auto key : message_handler_.parse_local_multi_get( message ) ) {
+        objects.push_back( my_storage_.acquire( key ) );
+      }
+      for ( auto& response : multi_get_response( objects ) ) {
+        client.outbound_messages_.emplace_back( std::move( response ) );
+      }
+      break;
+    }
+
+    // store many objects at once, with a status per object
+    case 'p': {
+      std::vector<bool> stored;
+      for ( const auto& [key, object] : message_handler_.parse_local_multi_put( message ) ) {
+        const auto dest = allocate_payload( std::string { key }, object.size() );
+        if ( dest ) {
+          memcpy( dest->blob.ptr, object.data(), object.size() );
+          my_storage_.commit( key );
+        }
+        stored.push_back( dest.has_value() );
+      }
+      OutboundMessage response
+        = { plaintext, { {}, message_handler_.generate_local_multi_put_result( stored ) } };
+      client.outbound_messages_.emplace_back( std::move( response ) );
+      break;
+    }
+
+    // fetch many objects from one peer with a single request and a single tag, answered like 'g'
+    case 'r': {
+      auto result = message_handler_.parse_local_remote_multi_get( message );
+      int id = std::get<1>( result );
+      const auto tag = peer_tag( client );
+      if ( not tag.has_value() ) {
+        break;
+      }
+      std::string remote_request = message_handler_.generate_remote_multi_lookup( *tag, std::get<0>( result ) );
+      send_remote_request( id, *tag, client, std::move( remote_request ) );
+      break;
+    }
+
+    default: {
+      OutboundMessage response
+        = { plaintext, { {}, message_handler_.generate_local_error( "unidentified opcode" ) } };
+      client.outbound_messages_.emplace_back( std::move( response ) );
+      break;
+    }
+  }
+
+  // answered now, or once its turn comes (see "buffer to responses")
+  if ( client.next_answer_ > waiting ) {
+    stats_.waiting[{ &client, client.ordered_answers.back() }] = { message[0], arrived };
+  } else {
+    stats_.local[message[0]].record( Timer::timestamp_ns() - arrived );
+  }
+}
+
+std::vector<OutboundMessage> StorageServer::multi_get_response( const std::vector<std::optional<BlobHandle>>& objects )
+{
+  std::vector<uint64_t> sizes;
+  sizes.reserve( objects.size() );
+  for ( const auto& object : objects ) {
+    sizes.push_back( object.has_value() ? object->blob.size : MessageHandler::NOT_FOUND );
+  }
+
+  auto header = message_handler_.generate_local_multi_get_header( sizes );
+  if ( not header.has_value() ) {
+    return { { plaintext, { {}, message_handler_.generate_local_error( "objects too large to send together" ) } } };
+  }
+  std::vector<OutboundMessage> response;
+  response.reserve( objects.size() + 1 );
+  response.push_back( { plaintext, { {}, std::move( header.value() ) } } );
+  for ( const auto& object : objects ) {
+    if ( object.has_value() ) {
+      for ( auto& message : blob_messages( object.value() ) ) {
+        response.push_back( std::move( message ) );
+      }
+    }
+  }
+  return response;
+}
+
+void StorageServer::run_on( StorageServer* server, std::function<void()>&& task )
+{
+  if ( server == this ) {
+    task();
+  } else {
+    server->event_loop_->post( std::move( task ) );
+  }
+}
+
+void StorageServer::send_remote_request( int id,
+                                         int tag,
+                                         ClientHandler& client,
+                                         std::string&& request,
+                                         RemoteRequest::Kind kind,
+                                         std::string name )
+{
+  send_remote_request( id, tag, client, { { plaintext, { {}, std::move( request ) } } }, kind, std::move( name ) );
+}
+
+void StorageServer::send_remote_request( int id,
+                                         int tag,
+                                         ClientHandler& client,
+                                         std::vector<OutboundMessage>&& request,
+                                         RemoteRequest::Kind kind,
+                                         std::string name )
+{
+  auto known = group_.peer_owners.find( id );
+  if ( known == group_.peer_owners.end() ) {
+    release_tag( tag );
+    respond( client,
+             { { plaintext, { {}, message_handler_.generate_local_error( "no peer " + std::to_string( id ) ) } } } );
+    return;
+  }
+  StorageServer* owner = known->second;
+  const uint64_t answer = client.await_answer();
+  run_on( owner,
+          [owner,
+           origin = this,
+           id,
+           tag,
+           client = client.id_,
+           answer,
+           request = std::move( request ),
+           kind,
+           name = std::move( name )]() mutable {
+            auto conn = owner->connections_.find( id );
+            if ( conn == owner->connections_.end() ) {
+              owner->run_on( origin, [origin, tag, client, answer] {
+                origin->release_tag( tag );
+                origin->hand_answer(
+                  client,
+                  answer,
+                  { { plaintext, { {}, origin->message_handler_.generate_local_error( "peer died" ) } } } );
+              } );
+              return;
             }
-            tag_generator_.allow( tag );
-            break;
-          }
 
-          // got an opcode with an error code related to a remote request likely
-
-          // currently remote success and remote failure get handled the same way
-          case 0:
-          case 5: {
-            auto error = message_handler_.parse_remote_error( msg );
-            int tag = std::get<1>( error );
-            std::string message = std::get<0>( error );
-            auto requesting_client = outstanding_remote_requests_.find( tag );
-            if ( requesting_client == outstanding_remote_requests_.end() ) {
-              std::cout << "received a remote message with a wierd tag, something's wrong" << std::endl;
-            } else {
-              OutboundMessage response = { plaintext, { {}, std::move( message ) } };
-              requesting_client->second->buffered_remote_responses_[tag] = { response };
+            std::pair<int, std::string> key { id, name };
+            if ( kind == RemoteRequest::Kind::LOOKUP ) {
+              auto in_flight = owner->lookups_in_flight_.find( key );
+              if ( in_flight != owner->lookups_in_flight_.end() ) {
+                auto& leader = owner->outstanding_remote_requests_.at( in_flight->second );
+                leader.waiters.emplace_back( origin, client, answer );
+                // the answer comes under the leader's tag
+                owner->run_on( origin, [origin, tag] { origin->release_tag( tag ); } );
+                return;
+              }
+              owner->lookups_in_flight_.insert( { key, tag } );
             }
-            break;
-          }
-          default: {
-            OutboundMessage response
-              = { plaintext, { {}, message_handler_.generate_local_error( "unidentified opcode" ) } };
-            conn_it->second.outbound_messages_.emplace_back( response );
-            break;
-          }
-        }
-      },
-      [&, conn_it] { return conn_it->second.inbound_messages_.size() > 0; } );
 
-    event_loop.add_rule(
-      "write responses",
-      [&, conn_it] { conn_it->second.produce(); },
-      [&, conn_it] {
-        return conn_it->second.outbound_messages_.size() > 0
-               and not conn_it->second.send_buffer_.writable_region().empty();
-      } );
+            const uint8_t opcode = PackedHeader::decode( ClientHandler::view( request.front() ).substr( 4 ) )->opcode;
+            const uint64_t now = Timer::timestamp_ns();
+            auto& sent = owner->outstanding_remote_requests_
+                           .insert( { tag, { { { origin, client, answer } }, kind, key, opcode, now } } )
+                           .first->second;
+            sent.timeout = owner->event_loop_->add_timer( now + owner->remote_timeout_ns_,
+                                                          [owner, tag] { owner->expire_remote_request( tag ); } );
+            conn->second.outbound_messages_.insert( conn->second.outbound_messages_.end(),
+                                                    std::make_move_iterator( request.begin() ),
+                                                    std::make_move_iterator( request.end() ) );
+            conn->second.interest_group_.notify();
+          } );
+}
+
+void StorageServer::deliver_remote_response( int tag, std::vector<OutboundMessage>&& response )
+{
+  auto request = outstanding_remote_requests_.find( tag );
+  if ( request == outstanding_remote_requests_.end() ) {
+    auto expired = expired_remote_requests_.find( tag );
+    if ( expired != expired_remote_requests_.end() ) {
+      LOG( Info ) << "late answer to request " << tag << " dropped";
+      expired->second.second.cancel();
+      forget_expired_request( tag );
+      return;
+    }
+    LOG( Warn ) << "received a remote message with a wierd tag, something's wrong";
+    return;
+  }
+  RemoteRequest answered = std::move( request->second );
+  outstanding_remote_requests_.erase( request );
+  answered.timeout.cancel();
+  stats_.remote[answered.opcode].record( Timer::timestamp_ns() - answered.sent_ns );
+  if ( answered.kind == RemoteRequest::Kind::LOOKUP ) {
+    lookups_in_flight_.erase( answered.object );
+  }
+  // the peer is done with the tag
+  StorageServer* tag_owner = std::get<0>( answered.waiters.front() );
+  run_on( tag_owner, [tag_owner, tag] { tag_owner->release_tag( tag ); } );
+
+  // everyone who asked gets the same messages, all reading the one copy now in storage
+  for ( auto [origin, client, answer] : answered.waiters ) {
+    run_on( origin, [origin = origin, client = client, answer = answer, response]() mutable {
+      origin->hand_answer( client, answer, std::move( response ) );
+    } );
+  }
+}
+
+void StorageServer::hand_answer( uint64_t id, uint64_t answer, std::vector<OutboundMessage>&& response )
+{
+  auto client = live_clients_.find( id );
+  if ( client == live_clients_.end() ) {
+    return;
+  }
+  client->second->buffered_remote_responses_[answer] = std::move( response );
+  client->second->interest_group_.notify();
+}
+
+void StorageServer::expire_remote_request( int tag )
+{
+  auto request = outstanding_remote_requests_.find( tag );
+  if ( request == outstanding_remote_requests_.end() ) {
+    return;
+  }
+  RemoteRequest expired = std::move( request->second );
+  outstanding_remote_requests_.erase( request );
+  stats_.remote_timeouts++;
+  if ( expired.kind == RemoteRequest::Kind::LOOKUP ) {
+    lookups_in_flight_.erase( expired.object );
+  }
+  LOG( Warn ) << "request " << tag << " to peer " << expired.object.first << " timed out";
+
+  // the tag went out to the peer, which may still answer it: until it does, or for another timeout, the tag stays
+  // out of use
+  StorageServer* tag_owner = std::get<0>( expired.waiters.front() );
+  expired_remote_requests_.insert(
+    { tag,
+      { tag_owner,
+        event_loop_->add_timer( Timer::timestamp_ns() + remote_timeout_ns_,
+                                [this, tag] { forget_expired_request( tag ); } ) } } );
+
+  const OutboundMessage response
+    = { plaintext, { {}, message_handler_.generate_local_error( "timed out waiting for peer" ) } };
+  for ( auto [origin, client, answer] : expired.waiters ) {
+    run_on( origin, [origin = origin, client = client, answer = answer, response] {
+      origin->hand_answer( client, answer, { response } );
+    } );
+  }
+}
+
+void StorageServer::forget_expired_request( int tag )
+{
+  auto expired = expired_remote_requests_.find( tag );
+  if ( expired == expired_remote_requests_.end() ) {
+    return;
+  }
+  StorageServer* tag_owner = expired->second.first;
+  expired_remote_requests_.erase( expired );
+  run_on( tag_owner, [tag_owner, tag] { tag_owner->release_tag( tag ); } );
+}
+
+std::optional<int> StorageServer::peer_tag( ClientHandler& client )
+{
+  auto tag = tag_generator_.emit();
+  if ( not tag.has_value() ) {
+    LOG( Warn ) << "out of tags for requests to peers";
+    respond( client,
+             { { plaintext, { {}, message_handler_.generate_local_error( "too many requests to peers" ) } } } );
+  }
+  return tag;
+}
+
+void StorageServer::release_tag( int tag )
+{
+  tag_generator_.allow( tag );
+}
+
+void StorageServer::answer_in_order( ClientHandler& client, std::vector<OutboundMessage>&& response )
+{
+  client.buffered_remote_responses_[client.await_answer()] = std::move( response );
+}
+
+void StorageServer::respond( ClientHandler& client, std::vector<OutboundMessage>&& response )
+{
+  if ( not client.ordered_answers.empty() ) {
+    answer_in_order( client, std::move( response ) );
+    return;
+  }
+  for ( auto& message : response ) {
+    client.outbound_messages_.emplace_back( std::move( message ) );
+  }
+}
+
+std::vector<OutboundMessage> StorageServer::lookup_response( const std::string& name )
+{
+  auto a = my_storage_.acquire( name );
+  if ( not a.has_value() ) {
+    return { { plaintext, { {}, message_handler_.generate_local_error( "can't find object" ) } } };
+  }
+  return object_response( name, a.value() );
+}
+
+std::vector<OutboundMessage> StorageServer::object_response( const std::string& name, const BlobHandle& object )
+{
+  auto header = message_handler_.generate_local_object_header( name, object.blob.size );
+  if ( not header.has_value() ) {
+    return { { plaintext, { {}, message_handler_.generate_local_error( "object too large to send" ) } } };
+  }
+  std::vector<OutboundMessage> response = blob_messages( object );
+  response.insert( response.begin(), OutboundMessage { plaintext, { {}, std::move( header.value() ) } } );
+  return response;
+}
+
+OutboundMessage StorageServer::store_response( bool stored )
+{
+  if ( stored ) {
+    return { plaintext, { {}, message_handler_.generate_local_success( "made new object with pointer" ) } };
+  }
+  return { plaintext, { {}, message_handler_.generate_local_error( "can't create new object with ptr" ) } };
+}
+
+OutboundMessage StorageServer::delete_response( const std::string& name )
+{
+  if ( my_storage_.delete_object( name ) != 0 ) {
+    return { plaintext, { {}, message_handler_.generate_local_error( "failed to delete " + name ) } };
+  }
+  group_.remote_cache.forget( name );
+  return { plaintext, { {}, message_handler_.generate_local_success( "deleted " + name ) } };
+}
+
+void StorageServer::remote_lookup( ClientHandler& client, int id, const std::string& name )
+{
+  // fetched before, or known not to be there
+  if ( auto cached = group_.remote_cache.find( id, name ); cached.has_value() ) {
+    answer_in_order( client, object_response( name, cached.value() ) );
+    return;
+  }
+  if ( group_.remote_cache.known_missing( id, name ) ) {
+    OutboundMessage response = { plaintext, { {}, message_handler_.generate_local_error( "can't find object" ) } };
+    answer_in_order( client, { response } );
+    return;
+  }
+
+  // generate a unique tag for this local request which will be used to identify it
+  const auto tag = peer_tag( client );
+  if ( not tag.has_value() ) {
+    return;
+  }
+  std::string remote_request = message_handler_.generate_remote_lookup( *tag, name );
+
+  LOG( Debug ) << remote_request;
+  LOG( Debug ) << id;
+  send_remote_request( id, *tag, client, std::move( remote_request ), RemoteRequest::Kind::LOOKUP, name );
+}
+
+void StorageServer::remote_delete( ClientHandler& client, int id, const std::string& name )
+{
+  const auto tag = peer_tag( client );
+  if ( not tag.has_value() ) {
+    return;
+  }
+  std::string remote_request = message_handler_.generate_remote_delete( *tag, name );
+
+  LOG( Debug ) << id;
+  send_remote_request( id, *tag, client, std::move( remote_request ), RemoteRequest::Kind::DELETE, name );
+}
+
+void StorageServer::remote_put( ClientHandler& client, int id, const std::string& name )
+{
+  const auto tag = peer_tag( client );
+  if ( not tag.has_value() ) {
+    // not going anywhere, so not to be kept here either
+    my_storage_.delete_object( name );
+    return;
+  }
+  my_storage_.commit( name );
+  auto a = my_storage_.acquire( name );
+  if ( not a.has_value() ) {
+    release_tag( *tag );
+    respond( client, { store_response( false ) } );
+    return;
+  }
+  // later gets are answered from this copy, as if it had been fetched from the peer
+  group_.remote_cache.insert( id, name, a->blob.size );
+
+  OutboundMessage request_header
+    = { plaintext, { {}, message_handler_.generate_remote_put_header( *tag, name, a->blob.size ) } };
+  std::vector<OutboundMessage> request = blob_messages( a.value() );
+  request.insert( request.begin(), std::move( request_header ) );
+  send_remote_request( id, *tag, client, std::move( request ), RemoteRequest::Kind::PUT, name );
+}
+
+std::optional<int> StorageServer::home_of( std::string_view name )
+{
+  auto owner = group_.placement.owner( name );
+  if ( not owner.has_value() or owner == group_.self ) {
+    return {};
+  }
+  return owner;
+}
+
+std::optional<BlobHandle> StorageServer::allocate_payload( std::string name, size_t size )
+{
+  auto ptr = my_storage_.new_object( name, size );
+  // copies of remote objects make way before a new object is refused for lack of room
+  if ( not ptr.has_value() and not my_storage_.contains( name ) and group_.remote_cache.evict( size ) ) {
+    ptr = my_storage_.new_object( name, size );
+  }
+  if ( not ptr.has_value() ) {
+    return {};
+  }
+  auto handle = my_storage_.acquire( name );
+  // deleted (and perhaps made again) by another thread in between: it is not ours to fill any more
+  if ( not handle.has_value() or handle->blob.ptr != ptr.value() ) {
+    return {};
+  }
+  return handle;
+}
+
+void StorageServer::dump_stats()
+{
+  static constexpr const char* remote_opcodes[]
+    = { "SUCCESS", "LOOKUP", "STORE", "DELETE", "MULTI_LOOKUP", "ERROR", "MULTI_STORE", "PUT" };
+  auto remote_opcode = []( const uint8_t opcode ) {
+    return opcode < std::size( remote_opcodes ) ? std::string { remote_opcodes[opcode] } : std::to_string( opcode );
+  };
+  auto histograms = []( std::ostream& out, const auto& by_opcode, auto name ) {
+    out << "{";
+    bool first = true;
+    for ( const auto& [opcode, histogram] : by_opcode ) {
+      out << ( first ? "" : "," ) << "\"" << name( opcode ) << "\":" << histogram.json();
+      first = false;
+    }
+    out << "}";
+  };
+  auto connection = []( std::ostream& out, const ClientHandler& conn ) {
+    out << "\"bytes_in\":" << conn.bytes_in_ << ",\"bytes_out\":" << conn.bytes_out_
+        << ",\"outbound_messages\":" << conn.outbound_messages_.size()
+        << ",\"waiting_answers\":" << conn.ordered_answers.size()
+        << ",\"buffered_answers\":" << conn.buffered_remote_responses_.size() << "}";
+  };
+
+  // latencies are in ns
+  std::ostringstream out;
+  out << "{\"server\":" << index_ << ",\"time_ns\":" << Timer::timestamp_ns() << ",\"local\":";
+  histograms( out, stats_.local, []( const char opcode ) { return std::string( 1, opcode ); } );
+  out << ",\"served\":";
+  histograms( out, stats_.served, remote_opcode );
+  out << ",\"remote\":";
+  histograms( out, stats_.remote, remote_opcode );
+
+  out << ",\"clients\":[";
+  for ( auto it = clients_.begin(); it != clients_.end(); it++ ) {
+    out << ( it == clients_.begin() ? "" : "," ) << "{\"fd\":" << it->socket_.fd_num() << ",";
+    connection( out, *it );
+  }
+  out << "],\"peers\":[";
+  for ( auto it = connections_.begin(); it != connections_.end(); it++ ) {
+    out << ( it == connections_.begin() ? "" : "," ) << "{\"id\":" << it->first
+        << ",\"connected\":" << ( connecting_.count( it->first ) ? "false" : "true" ) << ",";
+    connection( out, it->second );
+  }
+  out << "],\"queues\":{\"tasks\":" << event_loop_->posted_tasks()
+      << ",\"outstanding_remote_requests\":" << outstanding_remote_requests_.size()
+      << ",\"lookups_in_flight\":" << lookups_in_flight_.size()
+      << ",\"expired_remote_requests\":" << expired_remote_requests_.size() << "}";
+  out << ",\"tags\":{\"in_use\":" << TAGS_PER_SERVER - tag_generator_.available()
+      << ",\"capacity\":" << TAGS_PER_SERVER << ",\"timed_out\":" << stats_.remote_timeouts << "}";
+
+  // the storage and the copies of remote objects are shared by the group, so every server reports the same
+  const StorageStats storage = my_storage_.stats();
+  const RemoteCacheStats cache = group_.remote_cache.stats();
+  out << ",\"storage\":{\"bytes\":" << my_storage_.get_total_size() << ",\"hits\":" << storage.hits
+      << ",\"misses\":" << storage.misses << ",\"spills\":" << storage.spills
+      << ",\"spilled_bytes\":" << storage.spilled_bytes << "}";
+  out << ",\"remote_cache\":{\"hits\":" << cache.hits << ",\"negative_hits\":" << cache.negative_hits
+      << ",\"misses\":" << cache.misses << ",\"evictions\":" << cache.evictions
+      << ",\"invalidations\":" << cache.invalidations << ",\"cached_bytes\":" << cache.cached_bytes << "}}\n";
+
+  std::lock_guard<std::mutex> lock { group_.stats_mutex };
+  std::ostream& stats_out = group_.stats_file ? *group_.stats_file : std::cerr;
+  stats_out << out.str() << std::flush;
+}
+
+void StorageServer::dump_group_stats()
+{
+  for ( StorageServer* server : group_.servers ) {
+    run_on( server, [server] { server->dump_stats(); } );
   }
 }
 
 void StorageServer::install_rules( EventLoop& event_loop )
 {
+  event_loop_ = &event_loop;
+
+  event_loop.add_rule(
+    "peer connect retries",
+    Direction::In,
+    connect_timer_,
+    [&] {
+      connect_timer_.read_event();
+      retry_connects();
+    },
+    [&] { return not connecting_.empty(); } );
 
   event_loop.add_rule(
     "Listener",
     Direction::In,
     listener_socket_,
     [&] {
-      ClientHandler new_client(
-        { std::move( listener_socket_.accept() ), RingBuffer( 4096 ), RingBuffer( 4096 ), {}, 4, 0, {}, {} } );
+      ClientHandler new_client( { std::move( listener_socket_.accept() ), RingBuffer( 4096 ), RingBuffer( 4096 ) } );
       clients_.emplace_back( std::move( new_client ) );
       auto client_it = prev( clients_.end() );
+      client_it->id_ = next_client_id_++;
+      live_clients_.emplace( client_it->id_, &*client_it );
 
       client_it->socket_.set_blocking( false );
-      std::cout << "accepted connection" << std::endl;
+      client_it->socket_.set_nodelay();
+      client_it->store_header_length_
+        = [&]( std::string_view header ) { return message_handler_.local_store_header_length( header ); };
+      client_it->allocate_payload_ = [&]( std::string_view header, size_t size ) {
+        const std::string name = message_handler_.parse_local_store( header );
+        return std::vector<PayloadPart> { { size, allocate_payload( name, size ) } };
+      };
+      client_it->handle_frame_ = [&, client_it]( const Frame& frame ) { handle_local_message( *client_it, frame ); };
+      LOG( Info ) << "accepted connection";
 
-      event_loop.add_rule(
-        "http",
-        client_it->socket_,
-        [&, client_it] {
-          std::cout << "http read " << std::endl;
-          client_it->read_buffer_.read_from( client_it->socket_ );
-          std::cout << client_it->read_buffer_.readable_region().length() << std::endl;
-        },
-        [&, client_it] {
-          std::cout << "http read " << std::endl;
-          return not client_it->read_buffer_.writable_region().empty();
-        },
-        [&, client_it] {
-          std::cout << "http write " << std::endl;
-          client_it->send_buffer_.write_to( client_it->socket_ );
-        },
-        [&, client_it] {
-          std::cout << "http write " << std::endl;
-          return not client_it->send_buffer_.readable_region().empty();
-        },
-        [&, client_it] {
-          std::cout << "died" << std::endl;
-          std::cout << "remove all references of this client in outstanding_remote_request not implemented yet"
-                    << std::endl;
-          client_it->socket_.close();
-          clients_.erase( client_it );
-        } );
-
-      event_loop.add_rule(
+      client_it->interest_group_ = event_loop.make_interest_group();
+      auto parse_rule = event_loop.add_rule(
         "receive messages",
         [&, client_it] { client_it->parse(); },
-        [&, client_it] {
-          return client_it->temp_inbound_message_.length() > 0 or not client_it->read_buffer_.readable_region().empty();
-        } );
+        [&, client_it] { return client_it->can_parse(); } );
 
-      event_loop.add_rule(
-        "pop messages",
+      auto responses_rule = event_loop.add_rule(
+        "buffer to responses",
         [&, client_it] {
-          std::string message = client_it->inbound_messages_.front();
-          client_it->inbound_messages_.pop_front();
-          std::cout << "message recevid " << message << std::endl;
-
-          int opcode = stoi( message.substr( 0, 1 ) );
-          switch ( opcode ) {
-
-              // new object creation in localstorage, returns the pointer value as a string
-              // currently useless without shared memory, but will be useful when shared memory is implemented.
-
-            case 0: {
-              int size = *reinterpret_cast<const int*>( message.c_str() + 1 );
-              std::cout << "size " << size << ";" << std::endl;
-              std::string name = message.substr( 5 );
-              std::cout << "storing:" << name << ";" << std::endl;
-              auto a = my_storage_.new_object( name, size );
-              if ( a.has_value() ) {
-                std::stringstream result;
-                result << a.value();
-                OutboundMessage response = { plaintext, { {}, std::move( result.str() ) } };
-                client_it->outbound_messages_.emplace_back( std::move( response ) );
-              } else {
-                OutboundMessage response
-                  = { plaintext, { {}, message_handler_.generate_local_error( "new object creation failed" ) } };
-                client_it->outbound_messages_.emplace_back( std::move( response ) );
-              }
+          // hand over every answer that is next in line
+          while ( not client_it->ordered_answers.empty() ) {
+            const uint64_t next = client_it->ordered_answers.front();
+            auto ready = client_it->buffered_remote_responses_.find( next );
+            if ( ready == client_it->buffered_remote_responses_.end() ) {
               break;
             }
-
-              // look up an object in localstorage and stream out its contents to the output socket
-
-            case 1: {
-              std::string name = message_handler_.parse_local_lookup( message );
-              std::cout << "looking up:" << name << ";" << std::endl;
-              auto a = my_storage_.locate( name );
-              if ( a.has_value() ) {
-                OutboundMessage response_header
-                  = { plaintext, { {}, message_handler_.generate_local_object_header( name, a.value().size ) } };
-                OutboundMessage response = { pointer, { { a.value().ptr, a.value().size }, {} } };
-                client_it->outbound_messages_.emplace_back( std::move( response_header ) );
-                client_it->outbound_messages_.emplace_back( std::move( response ) );
-              } else {
-                OutboundMessage response
-                  = { plaintext, { {}, message_handler_.generate_local_error( "can't find object" ) } };
-                client_it->outbound_messages_.emplace_back( std::move( response ) );
-              }
-              break;
+            for ( auto& it : ready->second ) {
+              client_it->outbound_messages_.emplace_back( std::move( it ) );
             }
-
-              // stores a new object by string into the localstorage
-
-            case 2: {
-              int size = *reinterpret_cast<const int*>( message.c_str() + 1 );
-              std::cout << "size " << size << ";" << std::endl;
-              std::string name = message.substr( 5, size );
-              auto success = my_storage_.new_object_from_string( name, std::move( message.substr( 5 + size ) ) );
-              if ( success == 0 ) {
-                OutboundMessage response = { plaintext, { {}, std::move( "made new object with pointer" ) } };
-                client_it->outbound_messages_.emplace_back( std::move( response ) );
-              } else {
-                OutboundMessage response
-                  = { plaintext, { {}, message_handler_.generate_local_error( "can't create new object with ptr" ) } };
-                client_it->outbound_messages_.emplace_back( std::move( response ) );
-              }
-              break;
-            }
-
-            // tells the storage server to send a get request to a remote server
-            case 3: {
-              auto result = message_handler_.parse_local_remote_lookup( message );
-              std::string name = std::get<0>( result );
-              int id = std::get<1>( result );
-
-              // generate a unique tag for this local request which will be used to identify it
-              int tag = tag_generator_.emit();
-              std::string remote_request = message_handler_.generate_remote_lookup( tag, name );
-              // we need to remember which client who made this request
-              outstanding_remote_requests_.insert( { tag, &*client_it } );
-              // push the tag into local FIFO queue to maintain response order
-              client_it->ordered_tags.push( tag );
-
-              std::cout << remote_request << std::endl;
-              OutboundMessage response = { plaintext, { {}, remote_request } };
-              std::cout << id << std::endl;
-              connections_.at( id ).outbound_messages_.emplace_back( std::move( response ) );
-              break;
-            }
-
-            case 6: {
-              std::string name = message_handler_.parse_local_lookup( message );
-              int result = my_storage_.delete_object( name );
-              if ( result == 0 ) {
-                OutboundMessage response
-                  = { plaintext, { {}, message_handler_.generate_local_success( "deleted " + name ) } };
-                client_it->outbound_messages_.emplace_back( std::move( response ) );
-              } else {
-                OutboundMessage response
-                  = { plaintext, { {}, message_handler_.generate_local_error( "failed to delete " + name ) } };
-                client_it->outbound_messages_.emplace_back( std::move( response ) );
-              }
-              break;
-            }
-
-            case 7: {
-              auto result = message_handler_.parse_local_remote_lookup( message );
-              std::string name = std::get<0>( result );
-              int id = std::get<1>( result );
-              int tag = tag_generator_.emit();
-              std::string remote_request = message_handler_.generate_remote_delete( tag, name );
-              outstanding_remote_requests_.insert( { tag, &*client_it } );
-              client_it->ordered_tags.push( tag );
-
-              OutboundMessage response = { plaintext, { {}, remote_request } };
-              std::cout << id << std::endl;
-              connections_.at( id ).outbound_messages_.emplace_back( std::move( response ) );
-              break;
-            }
-
-            default: {
-              OutboundMessage response
-                = { plaintext, { {}, message_handler_.generate_local_error( "unidentified opcode" ) } };
-              client_it->outbound_messages_.emplace_back( std::move( response ) );
-              break;
+            client_it->buffered_remote_responses_.erase( ready );
+            client_it->ordered_answers.pop();
+            auto asked = stats_.waiting.find( { &*client_it, next } );
+            if ( asked != stats_.waiting.end() ) {
+              stats_.local[asked->second.first].record( Timer::timestamp_ns() - asked->second.second );
+              stats_.waiting.erase( asked );
             }
           }
         },
-        [&, client_it] { return client_it->inbound_messages_.size() > 0; } );
-
-      event_loop.add_rule(
-        "buffer to responses",
         [&, client_it] {
-          for ( auto it : client_it->buffered_remote_responses_.find( client_it->ordered_tags.front() )->second ) {
-            client_it->outbound_messages_.emplace_back(
-              it ); // better call the copy constructor here, we will remove the thing later.
-          }
-          client_it->buffered_remote_responses_.erase( client_it->ordered_tags.front() );
-          client_it->ordered_tags.pop();
-        },
-        [&, client_it] {
-          return client_it->buffered_remote_responses_.find( client_it->ordered_tags.front() )
-                 != client_it->buffered_remote_responses_.end();
+          return not client_it->ordered_answers.empty()
+                 and client_it->buffered_remote_responses_.find( client_it->ordered_answers.front() )
+                       != client_it->buffered_remote_responses_.end();
         } );
 
-      event_loop.add_rule(
+      auto produce_rule = event_loop.add_rule(
         "write responses",
         [&, client_it] { client_it->produce(); },
-        [&, client_it] {
-          return client_it->outbound_messages_.size() > 0 and not client_it->send_buffer_.writable_region().empty();
+        [&, client_it] { return client_it->can_produce(); } );
+
+      // the loop reads and writes for it (see EventLoop::LoopIO), straight into and out of its buffers
+      event_loop.register_buffer( client_it->read_buffer_.mapped_region() );
+      event_loop.register_buffer( client_it->send_buffer_.mapped_region() );
+      auto http_rule = event_loop.add_rule(
+        "http",
+        EventLoop::LoopIO,
+        client_it->socket_,
+        [&, client_it] { return client_it->receive_target(); },
+        [&, client_it]( size_t n ) {
+          client_it->received( n );
+          LOG( Debug ) << "http read " << n;
+        },
+        [&, client_it] { return client_it->wants_to_receive(); },
+        [&, client_it]( std::vector<std::string_view>& sources ) { client_it->send_sources( sources ); },
+        [&, client_it]( size_t n ) {
+          client_it->sent( n );
+          LOG( Debug ) << "http write " << n;
+        },
+        [&, client_it] { return client_it->wants_to_send(); },
+        [&, client_it, parse_rule, responses_rule, produce_rule]() mutable {
+          LOG( Info ) << "died";
+          // the rules that only look at this client must not outlive it
+          parse_rule.cancel();
+          responses_rule.cancel();
+          produce_rule.cancel();
+          // the answers it was still waiting for hold no tags (those go back as the peers answer), only stats
+          stats_.waiting.erase( stats_.waiting.lower_bound( { &*client_it, 0 } ),
+                                stats_.waiting.upper_bound( { &*client_it, UINT64_MAX } ) );
+          // answers still on their way to it find it gone (see hand_answer)
+          live_clients_.erase( client_it->id_ );
+          event_loop.unregister_buffer( client_it->read_buffer_.mapped_region() );
+          event_loop.unregister_buffer( client_it->send_buffer_.mapped_region() );
+          client_it->socket_.close();
+          clients_.erase( client_it );
         } );
+
+      for ( const auto& rule : { parse_rule, responses_rule, produce_rule, http_rule } ) {
+        client_it->interest_group_.add( rule );
+      }
     },
     [&] { return true; } );
 }
@@ -466,16 +1514,82 @@ int main( int argc, char* argv[] )
     return EXIT_FAILURE;
   }
 
-  EventLoop loop;
-  StorageServer echo( 200 );
-  echo.install_rules( loop );
+  // one event loop per thread, each with its own server; they share the storage
+  const size_t threads = std::max( 1, atoi( safe_getenv_or( "STORAGE_THREADS", "1" ).c_str() ) );
+  const bool zerocopy = safe_getenv_or( "STORAGE_ZEROCOPY", "0" ) == "1";
+  const bool io_uring = safe_getenv_or( "STORAGE_IO_URING", "0" ) == "1";
+  // how long to wait for a peer's answer before giving up, in ms
+  const std::string remote_timeout_ms = safe_getenv_or( "STORAGE_REMOTE_TIMEOUT", "" );
+  // a directory to spill cold objects to once memory is full, instead of failing new stores
+  const std::string spill_directory = safe_getenv_or( "STORAGE_SPILL", "" );
+
+  ServerGroup group( 200, spill_directory.empty() ? std::optional<std::string> {} : spill_directory );
+  std::vector<std::unique_ptr<EventLoop>> loops;
+  std::vector<std::unique_ptr<StorageServer>> servers;
+  std::vector<EventLoop*> event_loops;
+  for ( size_t i = 0; i < threads; i++ ) {
+    loops.push_back(
+      std::make_unique<EventLoop>( io_uring ? EventLoop::Backend::IoUring : EventLoop::Backend::Epoll ) );
+    servers.push_back( std::make_unique<StorageServer>(
+      group,
+      i,
+      zerocopy,
+      remote_timeout_ms.empty() ? StorageServer::DEFAULT_REMOTE_TIMEOUT : stoull( remote_timeout_ms ) * 1'000'000 ) );
+    group.servers.push_back( servers.back().get() );
+    event_loops.push_back( loops.back().get() );
+    servers.back()->install_rules( *loops.back() );
+    loops.back()->set_fd_failure_callback( [] {} );
+  }
+
+  // stats (see StorageServer::dump_stats) are dumped on SIGUSR1, and every STORAGE_STATS_INTERVAL ms if that is
+  // set, appended to the file STORAGE_STATS or else to standard error
+  const std::string stats_path = safe_getenv_or( "STORAGE_STATS", "" );
+  if ( not stats_path.empty() ) {
+    group.stats_file = std::make_unique<std::ofstream>( stats_path, std::ios::app );
+  }
+  // blocked before any other thread starts, so that they all inherit the mask and it only comes through here
+  const SignalMask stats_signal { SIGUSR1 };
+  stats_signal.set_as_mask();
+  SignalFD stats_signals { stats_signal };
+  loops[0]->add_rule(
+    "dump stats",
+    Direction::In,
+    stats_signals,
+    [&] {
+      stats_signals.read_signal();
+      servers[0]->dump_group_stats();
+    },
+    [] { return true; } );
+  TimerFD stats_timer {};
+  const int stats_interval = atoi( safe_getenv_or( "STORAGE_STATS_INTERVAL", "0" ).c_str() );
+  if ( stats_interval > 0 ) {
+    stats_timer.set( std::chrono::milliseconds( stats_interval ), std::chrono::milliseconds( stats_interval ) );
+  }
+  loops[0]->add_rule(
+    "dump stats periodically",
+    Direction::In,
+    stats_timer,
+    [&] {
+      stats_timer.read_event();
+      servers[0]->dump_group_stats();
+    },
+    [&] { return stats_timer.armed(); } );
   // std::map<size_t, std::string> input {{0,argv[1]}};
-  // echo.connect(input, loop);
-  echo.connect_lambda( argv[1], atoi( argv[2] ), atoi( argv[3] ), atoi( argv[4] ), loop );
+  // servers[0]->connect(input, event_loops);
+  servers[0]->connect_lambda( argv[1], atoi( argv[2] ), atoi( argv[3] ), atoi( argv[4] ), event_loops );
 
-  loop.set_fd_failure_callback( [] {} );
-  while ( loop.wait_next_event( -1 ) != EventLoop::Result::Exit )
+  std::vector<std::thread> workers;
+  for ( size_t i = 1; i < threads; i++ ) {
+    workers.emplace_back( [&loop = *loops[i]] {
+      while ( loop.wait_next_event( -1 ) != EventLoop::Result::Exit )
+        ;
+    } );
+  }
+  while ( loops[0]->wait_next_event( -1 ) != EventLoop::Result::Exit )
     ;
+  for ( auto& worker : workers ) {
+    worker.join();
+  }
 
   return EXIT_SUCCESS;
 }
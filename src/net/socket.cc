@@ -3,7 +3,10 @@
 #include "util/exception.hh"
 
 #include <cstddef>
+#include <linux/errqueue.h>
+#include <netinet/tcp.h>
 #include <stdexcept>
+#include <sys/uio.h>
 #include <unistd.h>
 
 using namespace std;
@@ -164,6 +167,73 @@ TCPSocket TCPSocket::accept()
   return TCPSocket( FileDescriptor( CheckSystemCall( "accept", ::accept( fd_num(), nullptr, nullptr ) ) ) );
 }
 
+void TCPSocket::set_nodelay()
+{
+  setsockopt( IPPROTO_TCP, TCP_NODELAY, int( true ) );
+}
+
+void TCPSocket::set_zerocopy()
+{
+  setsockopt( SOL_SOCKET, SO_ZEROCOPY, int( true ) );
+}
+
+size_t TCPSocket::send_zerocopy( const vector<string_view>& buffers )
+{
+  vector<iovec> iovecs;
+  iovecs.reserve( buffers.size() );
+  for ( const auto x : buffers ) {
+    iovecs.push_back( { const_cast<char*>( x.data() ), x.size() } );
+  }
+
+  msghdr message {};
+  message.msg_iov = iovecs.data();
+  message.msg_iovlen = iovecs.size();
+
+  ssize_t ret = ::sendmsg( fd_num(), &message, MSG_ZEROCOPY );
+  if ( ret < 0 and errno == ENOBUFS ) {
+    // over the optmem limit with notifications the error queue has yet to give back
+    copied_sends_++;
+    ret = ::sendmsg( fd_num(), &message, 0 );
+  }
+  if ( ret < 0 and would_block() ) {
+    register_blocked_write();
+    return 0;
+  }
+  const ssize_t bytes_written = CheckSystemCall( "sendmsg", ret );
+  register_write();
+
+  return bytes_written;
+}
+
+optional<TCPSocket::ZeroCopyCompletion> TCPSocket::recv_zerocopy_completion()
+{
+  char control[CMSG_SPACE( sizeof( sock_extended_err ) )];
+  msghdr message {};
+  message.msg_control = control;
+  message.msg_controllen = sizeof( control );
+
+  const ssize_t ret = ::recvmsg( fd_num(), &message, MSG_ERRQUEUE );
+  if ( ret < 0 ) {
+    if ( errno == EAGAIN ) {
+      return {};
+    }
+    throw unix_error( "recvmsg (error queue)" );
+  }
+
+  for ( cmsghdr* cm = CMSG_FIRSTHDR( &message ); cm != nullptr; cm = CMSG_NXTHDR( &message, cm ) ) {
+    if ( ( cm->cmsg_level == SOL_IP and cm->cmsg_type == IP_RECVERR )
+         or ( cm->cmsg_level == SOL_IPV6 and cm->cmsg_type == IPV6_RECVERR ) ) {
+      const sock_extended_err* err = reinterpret_cast<const sock_extended_err*>( CMSG_DATA( cm ) );
+      if ( err->ee_origin != SO_EE_ORIGIN_ZEROCOPY ) {
+        throw runtime_error( "unexpected message on socket error queue" );
+      }
+      return ZeroCopyCompletion { err->ee_info, err->ee_data, ( err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED ) != 0 };
+    }
+  }
+
+  throw runtime_error( "error queue message without a zerocopy notification" );
+}
+
 // get socket option
 template<typename option_type>
 socklen_t Socket::getsockopt( const int level, const int option, option_type& option_value ) const
@@ -191,6 +261,11 @@ void Socket::set_reuseaddr()
   setsockopt( SOL_SOCKET, SO_REUSEADDR, int( true ) );
 }
 
+void Socket::set_reuseport()
+{
+  setsockopt( SOL_SOCKET, SO_REUSEPORT, int( true ) );
+}
+
 void Socket::throw_if_error() const
 {
   int socket_error = 0;
@@ -2,8 +2,10 @@
 
 #include <cstdint>
 #include <functional>
+#include <optional>
 #include <string>
 #include <sys/socket.h>
+#include <vector>
 
 #include "address.hh"
 #include "util/file_descriptor.hh"
@@ -55,6 +57,10 @@ public:
   //! man7::socket)
   void set_reuseaddr();
 
+  //! Let several sockets bind the same address and have the kernel spread incoming connections
+  //! among them via [SO_REUSEPORT](\ref man7::socket)
+  void set_reuseport();
+
   //! Check for errors (will be seen on non-blocking sockets)
   void throw_if_error() const;
 };
@@ -102,6 +108,8 @@ public:
 class TCPSocket : public Socket
 {
 private:
+  uint64_t copied_sends_ { 0 }; //!< send_zerocopy() calls that fell back to copying
+
   //! \brief Construct from FileDescriptor (used by accept())
   //! \param[in] fd is the FileDescriptor from which to construct
   explicit TCPSocket( FileDescriptor&& fd )
@@ -120,6 +128,35 @@ public:
   //! Accept a new incoming connection
   TCPSocket accept();
 
+  //! Send small segments right away instead of waiting for outstanding data to be acknowledged
+  //! (disables Nagle's algorithm, see [tcp(7)](\ref man7::tcp))
+  void set_nodelay();
+
+  //! Allow transmits that skip the copy into kernel buffers via [SO_ZEROCOPY](\ref man7::socket)
+  void set_zerocopy();
+
+  //! \brief Send a list of buffers with `MSG_ZEROCOPY`
+  //! \details The buffers must stay untouched until the kernel reports the send complete on the
+  //! error queue. Each call that writes something consumes the next send id, starting at 0 -- except when the
+  //! socket is out of memory for notifications (`ENOBUFS`): then the buffers are sent the ordinary way, copied,
+  //! the call consumes no send id, and copied_sends() goes up.
+  //! \returns number of bytes written
+  size_t send_zerocopy( const std::vector<std::string_view>& buffers );
+
+  //! Calls to send_zerocopy() that copied instead
+  uint64_t copied_sends() const { return copied_sends_; }
+
+  //! A range of `MSG_ZEROCOPY` sends that the kernel is done with
+  struct ZeroCopyCompletion
+  {
+    uint32_t first_id;
+    uint32_t last_id;
+    bool copied; //!< the kernel fell back to copying (e.g. on loopback)
+  };
+
+  //! Read one completion notification from the error queue, if there is one
+  std::optional<ZeroCopyCompletion> recv_zerocopy_completion();
+
   template<class Duration>
   void set_write_timeout( const Duration& d )
   {
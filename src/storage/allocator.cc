@@ -0,0 +1,189 @@
+#include "allocator.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+size_t page_span( const size_t size )
+{
+  const size_t page_size = sysconf( _SC_PAGESIZE );
+  return ( size + page_size - 1 ) / page_size * page_size;
+}
+
+}
+
+void* MallocAllocator::allocate( const size_t size )
+{
+  return malloc( size );
+}
+
+void MallocAllocator::deallocate( void* ptr, const size_t )
+{
+  free( ptr );
+}
+
+void* MallocAllocator::reallocate( void* ptr, const size_t, const size_t new_size )
+{
+  return realloc( ptr, new_size );
+}
+
+SlabAllocator::SlabAllocator( const size_t region_size )
+  : SlabAllocator( nullptr, region_size )
+{}
+
+SlabAllocator::SlabAllocator( shared_ptr<SharedArena> arena, const size_t region_size )
+  : region_size_( region_size )
+  , arena_( move( arena ) )
+{
+  if ( region_size_ < MAX_CLASS_SIZE ) {
+    throw runtime_error( "SlabAllocator region must hold at least one block of the largest class" );
+  }
+}
+
+size_t SlabAllocator::size_class( const size_t size )
+{
+  size_t c = 0;
+  while ( class_size( c ) < size ) {
+    c++;
+  }
+  return c;
+}
+
+char* SlabAllocator::carve( const size_t size )
+{
+  if ( static_cast<size_t>( bump_end_ - bump_ ) < size ) {
+    // the tail of the old region is abandoned; it is smaller than the block we need
+    if ( arena_ ) {
+      char* region = arena_->carve( region_size_ );
+      if ( region == nullptr ) {
+        return nullptr;
+      }
+      bump_ = region;
+    } else {
+      regions_.emplace_back( nullptr, region_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1 );
+      bump_ = regions_.back().addr();
+    }
+    bump_end_ = bump_ + region_size_;
+  }
+
+  char* block = bump_;
+  bump_ += size;
+  return block;
+}
+
+void* SlabAllocator::allocate_large( const size_t size )
+{
+  if ( not arena_ ) {
+    MMap_Region region { nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1 };
+    void* ptr = region.addr();
+    large_objects_.emplace( ptr, move( region ) );
+    return ptr;
+  }
+
+  const size_t span = page_span( size );
+  const auto fit = free_spans_.lower_bound( { span, nullptr } );
+  if ( fit == free_spans_.end() ) {
+    return arena_->carve( span );
+  }
+
+  const auto [fit_size, ptr] = *fit;
+  remove_free_span( free_spans_by_address_.find( ptr ) );
+  if ( fit_size > span ) {
+    add_free_span( ptr + span, fit_size - span );
+  }
+  return ptr;
+}
+
+void SlabAllocator::deallocate_large( void* ptr, const size_t size )
+{
+  if ( not arena_ ) {
+    large_objects_.erase( ptr );
+    return;
+  }
+
+  const size_t span = page_span( size );
+  arena_->release( static_cast<char*>( ptr ), span );
+  add_free_span( static_cast<char*>( ptr ), span );
+}
+
+void SlabAllocator::add_free_span( char* ptr, size_t size )
+{
+  // merged with the free spans on either side, so that churn doesn't leave the arena in pieces too small to use
+  auto next = free_spans_by_address_.lower_bound( ptr );
+  if ( next != free_spans_by_address_.end() and next->first == ptr + size ) {
+    size += next->second;
+    next = remove_free_span( next );
+  }
+  if ( next != free_spans_by_address_.begin() ) {
+    const auto previous = prev( next );
+    if ( previous->first + previous->second == ptr ) {
+      ptr = previous->first;
+      size += previous->second;
+      remove_free_span( previous );
+    }
+  }
+
+  free_spans_by_address_.emplace( ptr, size );
+  free_spans_.emplace( size, ptr );
+}
+
+map<char*, size_t>::iterator SlabAllocator::remove_free_span( const map<char*, size_t>::iterator span )
+{
+  free_spans_.erase( { span->second, span->first } );
+  return free_spans_by_address_.erase( span );
+}
+
+void* SlabAllocator::allocate( const size_t size )
+{
+  if ( size > MAX_CLASS_SIZE ) {
+    return allocate_large( size );
+  }
+
+  const size_t c = size_class( size );
+  FreeBlock* block = free_lists_[c];
+  if ( block ) {
+    free_lists_[c] = block->next;
+    return block;
+  }
+
+  return carve( class_size( c ) );
+}
+
+void SlabAllocator::deallocate( void* ptr, const size_t size )
+{
+  if ( ptr == nullptr ) {
+    return;
+  }
+
+  if ( size > MAX_CLASS_SIZE ) {
+    deallocate_large( ptr, size );
+    return;
+  }
+
+  const size_t c = size_class( size );
+  FreeBlock* block = static_cast<FreeBlock*>( ptr );
+  block->next = free_lists_[c];
+  free_lists_[c] = block;
+}
+
+void* SlabAllocator::reallocate( void* ptr, const size_t old_size, const size_t new_size )
+{
+  if ( old_size <= MAX_CLASS_SIZE and new_size <= MAX_CLASS_SIZE
+       and size_class( old_size ) == size_class( new_size ) ) {
+    return ptr;
+  }
+
+  void* new_ptr = allocate( new_size );
+  if ( new_ptr == nullptr ) {
+    return nullptr;
+  }
+  memcpy( new_ptr, ptr, min( old_size, new_size ) );
+  deallocate( ptr, old_size );
+  return new_ptr;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "storage/shared_arena.hh"
+#include "util/ring_buffer.hh"
+
+//! Backing memory for LocalStorage objects.
+//! \details Callers always pass back the exact size they asked for, so an allocator never
+//! needs to keep per-object headers.
+class Allocator
+{
+public:
+  virtual ~Allocator() = default;
+
+  virtual void* allocate( const size_t size ) = 0;
+  virtual void deallocate( void* ptr, const size_t size ) = 0;
+  virtual void* reallocate( void* ptr, const size_t old_size, const size_t new_size ) = 0;
+
+  virtual std::string name() const = 0;
+};
+
+//! Plain malloc/free, one heap allocation per object.
+class MallocAllocator : public Allocator
+{
+public:
+  void* allocate( const size_t size ) override;
+  void deallocate( void* ptr, const size_t size ) override;
+  void* reallocate( void* ptr, const size_t old_size, const size_t new_size ) override;
+
+  std::string name() const override { return "malloc"; }
+};
+
+//! Size-classed slabs carved out of large preallocated regions.
+//! \details Objects up to `MAX_CLASS_SIZE` are rounded up to a power-of-two size class and
+//! served from a per-class free list; a fresh block is bump-allocated from the current region
+//! when the free list is empty. Freed blocks go back on their class's free list (the list is
+//! threaded through the freed blocks themselves). Larger objects get a dedicated mapping.
+//!
+//! When given a SharedArena, regions and large objects are carved out of the arena instead,
+//! so every object can be named by its offset. Freed large spans are then kept for reuse,
+//! merged with any free neighbours, and their pages returned to the kernel.
+class SlabAllocator : public Allocator
+{
+public:
+  static constexpr size_t MIN_CLASS_SIZE = 64;
+  static constexpr size_t MAX_CLASS_SIZE = 1024 * 1024;
+  static constexpr size_t DEFAULT_REGION_SIZE = 16 * 1024 * 1024;
+
+private:
+  static constexpr size_t NUM_CLASSES = 15; // 64 B ... 1 MiB
+
+  struct FreeBlock
+  {
+    FreeBlock* next;
+  };
+
+  const size_t region_size_;
+  const std::shared_ptr<SharedArena> arena_;
+
+  std::vector<MMap_Region> regions_ {};
+  char* bump_ { nullptr };
+  char* bump_end_ { nullptr };
+
+  std::array<FreeBlock*, NUM_CLASSES> free_lists_ {};
+  std::unordered_map<void*, MMap_Region> large_objects_ {};
+  // spans freed by large objects in the arena, by size (for best fit) and by address (to merge neighbours)
+  std::set<std::pair<size_t, char*>> free_spans_ {};
+  std::map<char*, size_t> free_spans_by_address_ {};
+
+  static size_t size_class( const size_t size );
+  static size_t class_size( const size_t size_class ) { return MIN_CLASS_SIZE << size_class; }
+
+  char* carve( const size_t size );
+  void* allocate_large( const size_t size );
+  void deallocate_large( void* ptr, const size_t size );
+  void add_free_span( char* ptr, size_t size );
+  std::map<char*, size_t>::iterator remove_free_span( std::map<char*, size_t>::iterator span );
+
+public:
+  SlabAllocator( const size_t region_size = DEFAULT_REGION_SIZE );
+  SlabAllocator( std::shared_ptr<SharedArena> arena, const size_t region_size = DEFAULT_REGION_SIZE );
+
+  void* allocate( const size_t size ) override;
+  void deallocate( void* ptr, const size_t size ) override;
+  void* reallocate( void* ptr, const size_t old_size, const size_t new_size ) override;
+
+  std::string name() const override { return arena_ ? "slab (shared arena)" : "slab"; }
+
+  const std::shared_ptr<SharedArena>& arena() const { return arena_; }
+
+  SlabAllocator( const SlabAllocator& ) = delete;
+  SlabAllocator& operator=( const SlabAllocator& ) = delete;
+};
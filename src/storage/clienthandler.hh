@@ -1,10 +1,19 @@
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <queue>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include "net/socket.hh"
 #include "storage/local_storage.hh"
 #include "util/eventloop.hh"
 #include "util/ring_buffer.hh"
 #include "util/split.hh"
+#include "util/timer.hh"
 #include "util/timerfd.hh"
 
 enum MessageType
@@ -19,90 +28,481 @@ struct Message
   std::string plain {};
 };
 
+// one decoded message. for a store, header is everything before the payload, and the payload has already been
+// received into wherever allocate_payload_ pointed it; otherwise header is the whole message
+struct Frame
+{
+  std::string_view header {};
+  std::string_view payload {};
+  bool payload_stored {};           // every part of it
+  std::vector<bool> parts_stored {}; // which of the parts were
+};
+
+// where a stretch of a store's payload goes: a store of several objects has a part for each, back to back
+struct PayloadPart
+{
+  size_t size {};
+  std::optional<BlobHandle> dest {}; // nothing to drop the part
+};
+
 struct OutboundMessage
 {
   MessageType message_type_ {};
   Message message {};
+  // keeps the blob a pointer message reads from alive and in place until it has been sent
+  std::shared_ptr<const void> hold_ {};
 };
 
+// the messages that send a blob: one per chunk of a segmented blob, which the sender gathers into a single
+// writev, each holding the blob until it is sent
+inline std::vector<OutboundMessage> blob_messages( const BlobHandle& handle )
+{
+  if ( not handle.blob.segmented() ) {
+    return { { pointer, { { handle.blob.ptr, handle.blob.size }, {} }, handle.pin } };
+  }
+
+  std::vector<OutboundMessage> messages;
+  for ( const auto& chunk : handle.blob.chunks ) {
+    if ( chunk.size > 0 ) {
+      messages.push_back( { pointer, { { chunk.ptr, chunk.size }, {} }, handle.pin } );
+    }
+  }
+  return messages;
+}
+
 struct ClientHandler
 {
+  static constexpr size_t SMALL_MESSAGE_SIZE = 512;
+  static constexpr size_t MAX_IOVECS = 64;
+  static constexpr size_t ZEROCOPY_THRESHOLD = 64 * 1024;
+  static constexpr size_t STORE_HEADER_PEEK = 20; // enough of a message to tell whether, and where, it has a payload
+
   TCPSocket socket_ {};
   RingBuffer send_buffer_ { 4096 };
   RingBuffer read_buffer_ { 4096 };
 
-  std::string temp_inbound_message_ {};
-  size_t expected_length { 4 };
-  int receive_state { 0 };
-  std::list<std::string> inbound_messages_ {};
+  // tells the server's clients apart, for as long as it runs: tasks from other loops find a client by it, and
+  // find nothing once it is gone
+  uint64_t id_ { 0 };
+
   std::list<OutboundMessage> outbound_messages_ {};
+  size_t outbound_offset_ { 0 }; // bytes of outbound_messages_.front() already on the wire
+  bool sending_ { false };        // between send_sources() and sent()
+  size_t sending_from_buffer_ { 0 };
+
+  // answers are handed over in the order the requests came in: each one that can't go out right away (it comes
+  // from a peer, or has to wait behind one that does) takes the next sequence number, and is buffered until its
+  // turn comes
+  std::unordered_map<uint64_t, std::vector<OutboundMessage>> buffered_remote_responses_ {};
+  std::queue<uint64_t> ordered_answers {};
+  uint64_t next_answer_ { 0 };
+  // takes the next place in line, for an answer that will be buffered
+  uint64_t await_answer()
+  {
+    ordered_answers.push( next_answer_ );
+    return next_answer_++;
+  }
+
+  // objects this client is reading out of the shared arena, by reference handed out with them
+  std::unordered_map<int, BlobHandle> shared_refs_ {};
+  int next_shared_ref_ { 0 };
+
+  // MSG_ZEROCOPY transmit (off by default): blobs of at least ZEROCOPY_THRESHOLD bytes are handed to the kernel
+  // without a copy, so their messages' holds are kept until the kernel says it is done with them.
+  bool zerocopy_ { false };
+  uint32_t next_zerocopy_id_ { 0 };
+  // last send id covering each blob
+  std::deque<std::pair<uint32_t, std::shared_ptr<const void>>> zerocopy_in_flight_ {};
+  size_t zerocopy_bytes_ { 0 };
+  size_t zerocopy_copied_completions_ { 0 };
+
+  // everything read from and written to the socket
+  uint64_t bytes_in_ { 0 };
+  uint64_t bytes_out_ { 0 };
+
+  // the event loop rules for this connection. whoever touches the connection from outside them (a task handing it
+  // an answer or a request) notifies the group, so that the rules look again.
+  EventLoop::InterestGroup interest_group_ {};
+
+  // frame decoding. a frame is a 4-byte length (counting itself) followed by the message, and is handed to
+  // handle_frame_ as a view into read_buffer_, without copying. a store is split in two: once its header is in,
+  // allocate_payload_ says where the payload goes, part by part, and each part is copied into its object as it
+  // arrives. the objects it gives are held (pinned) until handle_frame_ has had the whole payload, so nothing can
+  // free or move them meanwhile. a store whose header does not fit in read_buffer_ comes as an ordinary frame
+  // instead, payload and all, with payload_stored unset.
+  std::function<std::optional<size_t>( std::string_view )> store_header_length_ {};
+  std::function<std::vector<PayloadPart>( std::string_view, size_t )> allocate_payload_ {};
+  std::function<void( const Frame& )> handle_frame_ {};
+
+  std::string store_header_ {}; // header of the store whose payload is arriving
+  std::vector<PayloadPart> payload_parts_ {};
+  size_t payload_part_ { 0 };  // the part arriving now
+  size_t part_received_ { 0 }; // bytes of it so far
+  size_t payload_size_ { 0 };
+  size_t payload_received_ { 0 };
+  bool receiving_payload_ { false };
+  uint64_t payload_started_ns_ { 0 };
+  bool receiving_directly_ { false }; // where the read in progress goes (see receive_target)
+
+  // stored payloads: how many bytes, how many of those skipped read_buffer_, and how long they took to arrive
+  // (from the end of their header to their last byte)
+  size_t payload_bytes_ { 0 };
+  size_t direct_payload_bytes_ { 0 };
+  uint64_t payload_ns_ { 0 };
+
+  std::string oversized_frame_ {}; // any other frame too large for read_buffer_ is assembled here
+  size_t oversized_length_ { 0 };
+
+  enum class ParseStep
+  {
+    Wait,
+    Frame,
+    StoreHeader,
+    Payload,
+    Oversized
+  };
+
+  static size_t frame_length( const std::string_view readable )
+  {
+    const size_t length = *reinterpret_cast<const uint32_t*>( readable.data() );
+    if ( length < 5 ) {
+      throw std::runtime_error( "ClientHandler: malformed frame of length " + std::to_string( length ) );
+    }
+    return length;
+  }
+
+  ParseStep next_parse_step() const
+  {
+    const std::string_view readable = read_buffer_.readable_region();
+    if ( receiving_payload_ ) {
+      return readable.empty() ? ParseStep::Wait : ParseStep::Payload;
+    }
+    if ( oversized_length_ > 0 ) {
+      return readable.empty() ? ParseStep::Wait : ParseStep::Oversized;
+    }
+    if ( readable.length() < 4 ) {
+      return ParseStep::Wait;
+    }
+
+    const size_t length = frame_length( readable );
+    const std::string_view message = readable.substr( 4, length - 4 );
+    if ( message.length() < std::min( length - 4, STORE_HEADER_PEEK ) ) {
+      return ParseStep::Wait;
+    }
+
+    const auto header_length = store_header_length_( message );
+    if ( header_length.has_value() and header_length.value() + 4 <= read_buffer_.capacity() ) {
+      return message.length() >= header_length.value() ? ParseStep::StoreHeader : ParseStep::Wait;
+    }
+
+    if ( message.length() == length - 4 ) {
+      return ParseStep::Frame;
+    }
+    return length > read_buffer_.capacity() ? ParseStep::Oversized : ParseStep::Wait;
+  }
+
+  bool can_parse() const { return next_parse_step() != ParseStep::Wait; }
+
+  // where the part of the payload arriving now goes, or nullptr if it is dropped
+  char* part_dest() const
+  {
+    const auto& dest = payload_parts_[payload_part_].dest;
+    return dest.has_value() ? static_cast<char*>( dest->blob.ptr ) : nullptr;
+  }
+
+  // once everything buffered ahead of a payload has been parsed, the rest of the payload is read from the socket
+  // straight into its destination
+  bool receives_directly() const
+  {
+    return receiving_payload_ and part_dest() != nullptr and read_buffer_.readable_region().empty();
+  }
+
+  bool wants_to_receive() const { return receives_directly() or not read_buffer_.writable_region().empty(); }
 
-  std::unordered_map<int, std::vector<OutboundMessage>> buffered_remote_responses_ {};
-  std::queue<int> ordered_tags {};
+  // where the next read from the socket goes: straight into a payload's destination, or into read_buffer_
+  simple_string_span receive_target()
+  {
+    receiving_directly_ = receives_directly();
+    if ( not receiving_directly_ ) {
+      return read_buffer_.writable_region();
+    }
+    return { part_dest() + part_received_, payload_parts_[payload_part_].size - part_received_ };
+  }
 
-  // fsm:
-  // state 0: starting state, don't know expected length
-  // state 1: in the middle of a message
-  // check test.py to see python reference FSM for receiving
+  // accounts for `n` bytes read into the last receive_target()
+  void received( const size_t n )
+  {
+    bytes_in_ += n;
+    if ( not receiving_directly_ ) {
+      read_buffer_.push( n );
+      return;
+    }
+
+    payload_received_ += n;
+    part_received_ += n;
+    direct_payload_bytes_ += n;
+    next_payload_part();
+  }
+
+  void receive() { received( socket_.read( receive_target() ) ); }
+
+  // for edge-triggered rules: receives until the socket has nothing more, or there is nowhere left to put it
+  void receive_all()
+  {
+    const unsigned blocked = socket_.blocked_read_count();
+    while ( wants_to_receive() and not socket_.eof() and socket_.blocked_read_count() == blocked ) {
+      receive();
+    }
+  }
+
+  // achieved receive rate of stored payloads on this connection, in GB/s
+  double payload_gbps() const { return payload_ns_ ? double( payload_bytes_ ) / payload_ns_ : 0; }
 
   void parse()
   {
-    temp_inbound_message_.append( read_buffer_.readable_region() );
-    read_buffer_.pop( read_buffer_.readable_region().length() );
-    if ( receive_state == 0 ) {
-      if ( temp_inbound_message_.length() > 4 ) {
-        expected_length = *reinterpret_cast<const int*>( temp_inbound_message_.c_str() );
-        std::cout << expected_length << std::endl;
-        if ( temp_inbound_message_.length() > expected_length - 1 ) {
-          inbound_messages_.emplace_back( move( temp_inbound_message_.substr( 4, expected_length - 4 ) ) );
-          temp_inbound_message_ = temp_inbound_message_.substr( expected_length );
-          expected_length = 4;
-          receive_state = 0;
+    while ( true ) {
+      const std::string_view readable = read_buffer_.readable_region();
+
+      switch ( next_parse_step() ) {
+        case ParseStep::Wait:
           return;
+
+        case ParseStep::Frame: {
+          const size_t length = frame_length( readable );
+          handle_frame_( { readable.substr( 4, length - 4 ), {}, false } );
+          read_buffer_.pop( length );
+          break;
+        }
+
+        case ParseStep::StoreHeader: {
+          const size_t length = frame_length( readable );
+          const size_t header_length = store_header_length_( readable.substr( 4 ) ).value();
+          store_header_.assign( readable.substr( 4, header_length ) );
+          payload_size_ = length - 4 - header_length;
+          payload_received_ = 0;
+          payload_parts_ = allocate_payload_( store_header_, payload_size_ );
+          size_t parts_size = 0;
+          for ( const auto& part : payload_parts_ ) {
+            parts_size += part.size;
+          }
+          if ( parts_size != payload_size_ ) {
+            throw std::runtime_error( "ClientHandler: payload parts do not add up to the payload" );
+          }
+          payload_part_ = 0;
+          part_received_ = 0;
+          receiving_payload_ = true;
+          payload_started_ns_ = Timer::timestamp_ns();
+          read_buffer_.pop( 4 + header_length );
+          next_payload_part();
+          break;
+        }
+
+        case ParseStep::Payload: {
+          const size_t n = std::min( readable.length(), payload_parts_[payload_part_].size - part_received_ );
+          if ( char* dest = part_dest() ) {
+            memcpy( dest + part_received_, readable.data(), n );
+          }
+          payload_received_ += n;
+          part_received_ += n;
+          read_buffer_.pop( n );
+          next_payload_part();
+          break;
+        }
+
+        case ParseStep::Oversized: {
+          if ( oversized_length_ == 0 ) {
+            oversized_length_ = frame_length( readable );
+            oversized_frame_.clear();
+          }
+          const size_t n = std::min( readable.length(), oversized_length_ - oversized_frame_.length() );
+          oversized_frame_.append( readable.substr( 0, n ) );
+          read_buffer_.pop( n );
+          if ( oversized_frame_.length() == oversized_length_ ) {
+            oversized_length_ = 0;
+            handle_frame_( { std::string_view { oversized_frame_ }.substr( 4 ), {}, false } );
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  // moves on past the parts that have all arrived (or are empty), and hands over the store after the last one
+  void next_payload_part()
+  {
+    while ( payload_part_ < payload_parts_.size() and part_received_ == payload_parts_[payload_part_].size ) {
+      payload_part_++;
+      part_received_ = 0;
+    }
+    if ( payload_part_ == payload_parts_.size() ) {
+      finish_payload();
+    }
+  }
+
+  void finish_payload()
+  {
+    receiving_payload_ = false;
+    // let go of the objects once they have been handled (and committed)
+    const auto parts = std::exchange( payload_parts_, {} );
+    Frame frame { store_header_, {}, true, {} };
+    for ( const auto& part : parts ) {
+      frame.payload_stored = frame.payload_stored and part.dest.has_value();
+      frame.parts_stored.push_back( part.dest.has_value() );
+    }
+    if ( frame.payload_stored ) {
+      payload_bytes_ += payload_size_;
+      payload_ns_ += Timer::timestamp_ns() - payload_started_ns_;
+    }
+    if ( parts.size() == 1 and parts.front().dest.has_value() ) {
+      frame.payload = { static_cast<const char*>( parts.front().dest->blob.ptr ), payload_size_ };
+    }
+    handle_frame_( frame );
+  }
+
+  // copies small control messages at the head of the queue into the send buffer, so that a run of them goes out
+  // in one write. anything else (in particular every pointer message) is left for send() to write in place.
+  void produce()
+  {
+    while ( can_produce() ) {
+      auto& message = outbound_messages_.front().message;
+      send_buffer_.write( message.plain );
+      outbound_messages_.pop_front();
+    }
+  }
+
+  bool can_produce() const
+  {
+    if ( outbound_messages_.empty() or outbound_offset_ > 0 or sending_ ) {
+      return false;
+    }
+    auto& message = outbound_messages_.front();
+    return message.message_type_ == plaintext and message.message.plain.length() <= SMALL_MESSAGE_SIZE
+           and message.message.plain.length() <= send_buffer_.writable_region().length();
+  }
+
+  // writes whatever is in the send buffer, followed by the queued messages, to the socket with one writev. blobs
+  // are sent straight from storage; a partially written message is resumed from outbound_offset_ next time.
+  void send()
+  {
+    if ( send_buffer_.readable_region().empty() and not outbound_messages_.empty()
+         and sends_zerocopy( outbound_messages_.front() ) ) {
+      const std::string_view blob = view( outbound_messages_.front() ).substr( outbound_offset_ );
+      const uint64_t copied_before = socket_.copied_sends();
+      const size_t bytes_wrote = socket_.send_zerocopy( { blob } );
+      if ( bytes_wrote > 0 ) {
+        bytes_out_ += bytes_wrote;
+        if ( socket_.copied_sends() == copied_before ) {
+          zerocopy_bytes_ += bytes_wrote;
+          consume( bytes_wrote, next_zerocopy_id_++ );
         } else {
-          receive_state = 1;
-          return;
+          // copied: the blob can go as soon as it leaves the queue
+          consume( bytes_wrote, {} );
         }
-      } else {
-        receive_state = 0;
-        return;
       }
-    } else {
-      if ( temp_inbound_message_.length() > expected_length - 1 ) {
-        inbound_messages_.emplace_back( move( temp_inbound_message_.substr( 4, expected_length - 4 ) ) );
-        temp_inbound_message_ = temp_inbound_message_.substr( expected_length );
-        expected_length = 4;
-        receive_state = 0;
-        return;
-      } else {
-        receive_state = 1;
-        return;
+      return;
+    }
+
+    std::vector<std::string_view> buffers;
+    buffers.reserve( MAX_IOVECS );
+    send_sources( buffers );
+    sent( socket_.write( buffers ) );
+  }
+
+  // for edge-triggered rules: sends until the socket has no more room, or there is nothing left to send
+  void send_all()
+  {
+    const unsigned blocked = socket_.blocked_write_count();
+    while ( wants_to_send() and socket_.blocked_write_count() == blocked ) {
+      const size_t before = bytes_out_;
+      send();
+      if ( bytes_out_ == before ) {
+        // neither progress nor EAGAIN: leave it to the loop to complain
+        break;
       }
     }
   }
 
-  void produce()
+  // what the next write to the socket sends, for send() or for whoever writes in its place (not messages sent
+  // with MSG_ZEROCOPY). until sent() says how much of it went out, none of it may change: produce() waits.
+  void send_sources( std::vector<std::string_view>& buffers )
   {
-    auto message = outbound_messages_.front();
-    if ( message.message_type_ == plaintext ) {
-      const size_t bytes_wrote = send_buffer_.write( message.message.plain );
-      if ( bytes_wrote == message.message.plain.length() ) {
-        outbound_messages_.pop_front();
-      } else {
-        message.message.plain = message.message.plain.substr( bytes_wrote );
+    const std::string_view buffered = send_buffer_.readable_region();
+    if ( not buffered.empty() ) {
+      buffers.push_back( buffered );
+    }
+    sending_from_buffer_ = buffered.length();
+    sending_ = true;
+
+    size_t offset = outbound_offset_;
+    for ( auto it = outbound_messages_.begin(); it != outbound_messages_.end() and buffers.size() < MAX_IOVECS;
+          it++ ) {
+      if ( sends_zerocopy( *it ) ) {
+        break;
       }
-    } else {
-      // write the memory location pointed to by this pointer to the send buffer. first create a stringview from this
-      // pointer
-
-      std::string_view a( reinterpret_cast<const char*>( message.message.outptr.first ),
-                          message.message.outptr.second );
-      const size_t bytes_wrote = send_buffer_.write( a );
-      if ( bytes_wrote == a.length() ) {
-        outbound_messages_.pop_front();
-      } else {
-        message.message.outptr.second -= bytes_wrote;
+      buffers.push_back( view( *it ).substr( offset ) );
+      offset = 0;
+    }
+  }
+
+  // accounts for `bytes_wrote` bytes of the last send_sources() having been written
+  void sent( const size_t bytes_wrote )
+  {
+    sending_ = false;
+    bytes_out_ += bytes_wrote;
+
+    const size_t from_buffer = std::min( bytes_wrote, sending_from_buffer_ );
+    send_buffer_.pop( from_buffer );
+    consume( bytes_wrote - from_buffer, {} );
+  }
+
+  // retires `bytes_wrote` bytes from the head of the queue, and any empty messages (an empty blob's) there
+  void consume( size_t bytes_wrote, const std::optional<uint32_t> zerocopy_id )
+  {
+    while ( not outbound_messages_.empty() ) {
+      const size_t remaining = view( outbound_messages_.front() ).length() - outbound_offset_;
+      if ( bytes_wrote < remaining ) {
+        outbound_offset_ += bytes_wrote;
+        break;
+      }
+      bytes_wrote -= remaining;
+      outbound_offset_ = 0;
+
+      auto& message = outbound_messages_.front();
+      if ( zerocopy_id.has_value() and message.hold_ ) {
+        zerocopy_in_flight_.emplace_back( zerocopy_id.value(), std::move( message.hold_ ) );
       }
+      outbound_messages_.pop_front();
+    }
+  }
+
+  // drains MSG_ZEROCOPY completions from the socket's error queue and lets go of the blobs that are fully sent
+  void complete_zerocopy()
+  {
+    while ( auto completion = socket_.recv_zerocopy_completion() ) {
+      if ( completion->copied ) {
+        zerocopy_copied_completions_++;
+      }
+      while ( not zerocopy_in_flight_.empty() and zerocopy_in_flight_.front().first <= completion->last_id ) {
+        zerocopy_in_flight_.pop_front();
+      }
+    }
+  }
+
+  bool sends_zerocopy( const OutboundMessage& message ) const
+  {
+    return zerocopy_ and message.message_type_ == pointer and message.message.outptr.second >= ZEROCOPY_THRESHOLD;
+  }
+
+  bool wants_to_send() const
+  {
+    return not send_buffer_.readable_region().empty() or not outbound_messages_.empty();
+  }
+
+  static std::string_view view( const OutboundMessage& message )
+  {
+    if ( message.message_type_ == plaintext ) {
+      return message.message.plain;
     }
+    return { static_cast<const char*>( message.message.outptr.first ), message.message.outptr.second };
   }
 };
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include "flat_index.hh"
+
+#include <cstring>
+#include <functional>
+
+using namespace std;
+
+namespace {
+
+size_t round_to_power_of_two( const size_t n )
+{
+  size_t capacity = 16;
+  while ( capacity < n ) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+}
+
+FlatIndex::FlatIndex( const size_t capacity )
+  : slots_( round_to_power_of_two( capacity ), Slot { 0, NOT_FOUND, 0, nullptr, {} } )
+  , mask_( slots_.size() - 1 )
+{}
+
+FlatIndex::~FlatIndex()
+{
+  for ( auto& slot : slots_ ) {
+    delete[] slot.heap_key;
+  }
+}
+
+uint64_t FlatIndex::hash( const string_view key )
+{
+  return std::hash<string_view> {}( key );
+}
+
+string_view FlatIndex::key_of( const Slot& slot )
+{
+  return { slot.heap_key ? slot.heap_key : slot.inline_key.data(), slot.length };
+}
+
+size_t FlatIndex::probe( const string_view key, const uint64_t key_hash ) const
+{
+  for ( size_t i = key_hash & mask_;; i = ( i + 1 ) & mask_ ) {
+    const Slot& slot = slots_[i];
+    if ( slot.value == NOT_FOUND or ( slot.hash == key_hash and key_of( slot ) == key ) ) {
+      return i;
+    }
+  }
+}
+
+void FlatIndex::rehash( const size_t capacity )
+{
+  vector<Slot> old( capacity, Slot { 0, NOT_FOUND, 0, nullptr, {} } );
+  old.swap( slots_ );
+  mask_ = capacity - 1;
+
+  // slots (and their heap keys) move as they are, nothing needs to be hashed or copied again
+  for ( const auto& slot : old ) {
+    if ( slot.value != NOT_FOUND ) {
+      size_t i = slot.hash & mask_;
+      while ( slots_[i].value != NOT_FOUND ) {
+        i = ( i + 1 ) & mask_;
+      }
+      slots_[i] = slot;
+    }
+  }
+}
+
+uint32_t FlatIndex::find( const string_view key ) const
+{
+  return slots_[probe( key, hash( key ) )].value;
+}
+
+bool FlatIndex::insert( const string_view key, const uint32_t value )
+{
+  // keep the table at most 3/4 full so probe runs stay short
+  if ( ( size_ + 1 ) * 4 > slots_.size() * 3 ) {
+    rehash( slots_.size() * 2 );
+  }
+
+  const uint64_t key_hash = hash( key );
+  Slot& slot = slots_[probe( key, key_hash )];
+  if ( slot.value != NOT_FOUND ) {
+    return false;
+  }
+
+  slot.hash = key_hash;
+  slot.value = value;
+  slot.length = key.size();
+  slot.heap_key = nullptr;
+  if ( key.size() > INLINE_KEY_SIZE ) {
+    slot.heap_key = new char[key.size()];
+  }
+  memcpy( slot.heap_key ? slot.heap_key : slot.inline_key.data(), key.data(), key.size() );
+  size_++;
+  return true;
+}
+
+bool FlatIndex::erase( const string_view key )
+{
+  size_t hole = probe( key, hash( key ) );
+  if ( slots_[hole].value == NOT_FOUND ) {
+    return false;
+  }
+  delete[] slots_[hole].heap_key;
+
+  // pull later members of the probe run back into the hole, unless that would put them before their home slot
+  for ( size_t i = ( hole + 1 ) & mask_; slots_[i].value != NOT_FOUND; i = ( i + 1 ) & mask_ ) {
+    const size_t home = slots_[i].hash & mask_;
+    if ( ( ( i - home ) & mask_ ) >= ( ( i - hole ) & mask_ ) ) {
+      slots_[hole] = slots_[i];
+      hole = i;
+    }
+  }
+
+  slots_[hole] = Slot { 0, NOT_FOUND, 0, nullptr, {} };
+  size_--;
+  return true;
+}
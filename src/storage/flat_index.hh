@@ -0,0 +1,58 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+//! An open-addressing hash table from names to small integer ids.
+//! \details Slots sit in one flat array and are probed linearly, so a lookup usually touches a single cache
+//! line: each slot carries the full hash of its name (compared before any bytes are), and names up to
+//! INLINE_KEY_SIZE bytes are stored in the slot itself. Longer names live in a separate heap allocation.
+//! Erasing shifts the rest of the probe run back instead of leaving tombstones.
+class FlatIndex
+{
+public:
+  static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+private:
+  static constexpr size_t INLINE_KEY_SIZE = 40;
+
+  struct Slot
+  {
+    uint64_t hash;
+    uint32_t value; // NOT_FOUND marks an empty slot
+    uint32_t length;
+    char* heap_key; // only for names longer than INLINE_KEY_SIZE
+    std::array<char, INLINE_KEY_SIZE> inline_key;
+  };
+
+  std::vector<Slot> slots_;
+  size_t mask_;
+  size_t size_ { 0 };
+
+  static uint64_t hash( std::string_view key );
+  static std::string_view key_of( const Slot& slot );
+
+  //! The slot holding `key`, or the empty slot that ends its probe run
+  size_t probe( std::string_view key, uint64_t hash ) const;
+  void rehash( size_t capacity );
+
+public:
+  FlatIndex( size_t capacity = 16 );
+  ~FlatIndex();
+
+  //! The id stored under `key`, or NOT_FOUND
+  uint32_t find( std::string_view key ) const;
+
+  //! Stores `value` under `key`, unless `key` is already present (returns false then)
+  bool insert( std::string_view key, uint32_t value );
+
+  //! Returns false if `key` was not present
+  bool erase( std::string_view key );
+
+  size_t size() const { return size_; }
+
+  FlatIndex( const FlatIndex& ) = delete;
+  FlatIndex& operator=( const FlatIndex& ) = delete;
+};
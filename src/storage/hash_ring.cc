@@ -0,0 +1,82 @@
+#include "hash_ring.hh"
+
+#include <algorithm>
+#include <mutex>
+
+using namespace std;
+
+HashRing::HashRing( const size_t vnodes )
+  : vnodes_( vnodes )
+{}
+
+uint64_t HashRing::hash( const string_view key )
+{
+  // FNV-1a, then the murmur3 finalizer so that similar keys (and a node's consecutive points) land far apart
+  uint64_t h = 14695981039346656037ULL;
+  for ( const char c : key ) {
+    h = ( h ^ static_cast<uint8_t>( c ) ) * 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+void HashRing::add_node( const int id )
+{
+  unique_lock<shared_mutex> lock { mutex_ };
+  if ( any_of( points_.begin(), points_.end(), [id]( const auto& point ) { return point.second == id; } ) ) {
+    return;
+  }
+  for ( size_t i = 0; i < vnodes_; i++ ) {
+    points_.emplace_back( hash( to_string( id ) + "#" + to_string( i ) ), id );
+  }
+  sort( points_.begin(), points_.end() );
+}
+
+void HashRing::remove_node( const int id )
+{
+  unique_lock<shared_mutex> lock { mutex_ };
+  points_.erase( remove_if( points_.begin(), points_.end(), [id]( const auto& point ) { return point.second == id; } ),
+                 points_.end() );
+  for ( auto it = homes_.begin(); it != homes_.end(); ) {
+    it = it->second == id ? homes_.erase( it ) : next( it );
+  }
+}
+
+size_t HashRing::nodes()
+{
+  shared_lock<shared_mutex> lock { mutex_ };
+  return points_.size() / vnodes_;
+}
+
+optional<int> HashRing::owner( const string_view key )
+{
+  shared_lock<shared_mutex> lock { mutex_ };
+  if ( points_.empty() ) {
+    return {};
+  }
+  if ( not homes_.empty() ) {
+    auto home = homes_.find( string { key } );
+    if ( home != homes_.end() ) {
+      return home->second;
+    }
+  }
+
+  auto point = lower_bound( points_.begin(), points_.end(), make_pair( hash( key ), INT32_MIN ) );
+  return point == points_.end() ? points_.front().second : point->second;
+}
+
+void HashRing::rehome( const string_view key, const int id )
+{
+  unique_lock<shared_mutex> lock { mutex_ };
+  homes_[string { key }] = id;
+}
+
+void HashRing::unhome( const string_view key )
+{
+  unique_lock<shared_mutex> lock { mutex_ };
+  homes_.erase( string { key } );
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// decides which storage node a key lives on, so clients only have to name the key. every node is hashed onto
+// a ring at many points (virtual nodes), and a key belongs to the first point at or after its own hash: keys
+// spread evenly over the nodes, and adding or removing one only moves the keys next to its points.
+// single keys can be re-homed to a node of choice (e.g. to spread out hot keys), overriding the ring.
+// the hash is the same on every machine, so all nodes with the same membership agree on placement.
+// every call is atomic.
+class HashRing
+{
+public:
+  static constexpr size_t DEFAULT_VNODES = 128;
+
+private:
+  const size_t vnodes_;
+
+  std::shared_mutex mutex_ {};
+  std::vector<std::pair<uint64_t, int>> points_ {}; // (hash, node), sorted
+  std::unordered_map<std::string, int> homes_ {};   // re-homed keys
+
+public:
+  explicit HashRing( size_t vnodes = DEFAULT_VNODES );
+
+  static uint64_t hash( std::string_view key );
+
+  void add_node( int id );
+  // also forgets the keys re-homed to it
+  void remove_node( int id );
+  size_t nodes();
+
+  // the node `key` lives on, or nothing while the ring is empty
+  std::optional<int> owner( std::string_view key );
+
+  // places `key` on node `id` from now on, wherever the ring would put it
+  void rehome( std::string_view key, int id );
+  // gives `key` back to the ring
+  void unhome( std::string_view key );
+};
@@ -1,174 +1,647 @@
 #include "local_storage.hh"
 
-LocalStorage::LocalStorage( size_t max_size )
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util/exception.hh"
+
+LocalStorage::LocalStorage( size_t max_size, std::unique_ptr<Allocator> allocator )
   : total_size_( 0 )
   , max_size_( max_size )
+  , allocator_( std::move( allocator ) )
 {}
 
-int LocalStorage::get_total_size()
+LocalStorage::~LocalStorage()
+{
+  for ( auto& entry : entries_ ) {
+    if ( entry.blob.ptr != nullptr ) {
+      free_memory( entry.blob );
+    }
+  }
+  for ( auto& it : unlinked_ ) {
+    free_memory( it.second );
+  }
+}
+
+void LocalStorage::release( const Blob& blob )
+{
+  if ( pins_.find( blob.ptr ) != pins_.end() ) {
+    unlinked_.insert( { blob.ptr, blob } );
+    return;
+  }
+
+  free_memory( blob );
+  total_size_ -= blob.size;
+}
+
+void LocalStorage::free_memory( const Blob& blob )
+{
+  if ( not blob.segmented() ) {
+    allocator_->deallocate( blob.ptr, blob.size );
+    return;
+  }
+  for ( const auto& chunk : blob.chunks ) {
+    allocator_->deallocate( chunk.ptr, chunk.capacity );
+  }
+}
+
+void LocalStorage::coalesce( Blob& blob )
+{
+  char* ptr = static_cast<char*>( allocator_->allocate( blob.size ) );
+  if ( ptr == nullptr ) {
+    return;
+  }
+
+  size_t offset = 0;
+  for ( const auto& chunk : blob.chunks ) {
+    std::memcpy( ptr + offset, chunk.ptr, chunk.size );
+    offset += chunk.size;
+  }
+  free_memory( blob );
+  blob.ptr = ptr;
+  blob.chunks.clear();
+}
+
+size_t LocalStorage::get_total_size()
 {
   return total_size_;
 }
 
-std::optional<Blob> LocalStorage::locate( std::string key )
+LocalStorage::Entry* LocalStorage::find( std::string_view key )
 {
-  std::unordered_map<std::string, Blob>::iterator got = storage_.find( key );
-  if ( got == storage_.end() ) {
-    auto alias_got = alias_.find( key );
-    if ( alias_got != alias_.end() ) {
-      return storage_.find( alias_got->second )->second;
-    } else {
-      return {};
+  const uint32_t got = index_.find( key );
+  return got == FlatIndex::NOT_FOUND ? nullptr : &entries_[got];
+}
+
+LocalStorage::Entry* LocalStorage::find_resident( std::string_view key )
+{
+  Entry* got = find( key );
+  if ( got == nullptr ) {
+    return nullptr;
+  }
+
+  if ( got->spill_offset.has_value() ) {
+    stats_.misses++;
+    if ( not fault_in( *got ) ) {
+      return nullptr;
     }
   } else {
-    return got->second;
+    stats_.hits++;
   }
+  got->referenced = true;
+  return got;
 }
 
-std::optional<void*> LocalStorage::new_object( std::string key, size_t size )
+void LocalStorage::enable_spill( const std::string& directory )
 {
-  if ( total_size_ + size > max_size_ ) {
-    std::cerr << "Allocation surpassing maximum size" << std::endl;
-    return {};
-  } else {
-    void* ptr = malloc( size );
-    total_size_ += size;
+  if ( not spill_file_.has_value() ) {
+    spill_file_.emplace( directory + "/punch-a-lambda-spill" );
+  }
+}
 
-    if ( alias_.find( key ) != alias_.end() ) {
-      std::cerr << "key is in aliases" << std::endl;
-      return {};
+bool LocalStorage::make_room( size_t size, const Entry* keep )
+{
+  if ( total_size_ + size <= max_size_ ) {
+    return true;
+  }
+  evict( total_size_ + size - max_size_, keep );
+  return total_size_ + size <= max_size_;
+}
+
+size_t LocalStorage::evict( size_t size, const Entry* keep )
+{
+  if ( not spill_file_.has_value() ) {
+    return 0;
+  }
+
+  // CLOCK: a blob that was looked up since the last sweep gets a second chance. two full sweeps
+  // without freeing enough means nothing else can go (only committed, unpinned blobs may be spilled).
+  size_t freed = 0;
+  for ( size_t scanned = 0; freed < size and scanned < 2 * entries_.size(); scanned++ ) {
+    clock_hand_ = ( clock_hand_ + 1 ) % entries_.size();
+    Entry& entry = entries_[clock_hand_];
+    if ( &entry == keep or entry.blob.ptr == nullptr or entry.blob.mutablility
+         or pins_.find( entry.blob.ptr ) != pins_.end() ) {
+      continue;
     }
+    if ( entry.referenced ) {
+      entry.referenced = false;
+      continue;
+    }
+    freed += entry.blob.size;
+    spill( entry );
+  }
+  return freed;
+}
 
-    bool ok = storage_.insert( { key, { true, size, ptr } } ).second;
-    if ( ok ) {
-      key2alias_.insert( { key, {} } );
-      return ptr;
-    } else {
-      std::cerr << "key is in storage" << std::endl;
-      return {};
+void LocalStorage::spill( Entry& entry )
+{
+  const int fd = spill_file_->fd().fd_num();
+  const std::vector<Chunk> whole { { entry.blob.ptr, entry.blob.size, entry.blob.size } };
+  uint64_t offset = spill_end_;
+  for ( const auto& chunk : entry.blob.segmented() ? entry.blob.chunks : whole ) {
+    const char* data = static_cast<const char*>( chunk.ptr );
+    for ( size_t written = 0; written < chunk.size; ) {
+      written += SystemCall( "pwrite", pwrite( fd, data + written, chunk.size - written, offset + written ) );
+    }
+    offset += chunk.size;
+  }
+
+  entry.spill_offset = spill_end_;
+  spill_end_ += entry.blob.size;
+  free_memory( entry.blob );
+  total_size_ -= entry.blob.size;
+  entry.blob.ptr = nullptr;
+  // it comes back in one piece
+  entry.blob.chunks.clear();
+  stats_.spills++;
+  stats_.spilled_bytes += entry.blob.size;
+}
+
+bool LocalStorage::fault_in( Entry& entry )
+{
+  void* ptr = make_room( entry.blob.size, &entry ) ? allocator_->allocate( entry.blob.size ) : nullptr;
+  if ( ptr == nullptr ) {
+    std::cerr << "no room to read a spilled blob back in" << std::endl;
+    return false;
+  }
+
+  const int fd = spill_file_->fd().fd_num();
+  char* data = static_cast<char*>( ptr );
+  for ( size_t read = 0; read < entry.blob.size; ) {
+    const ssize_t got
+      = SystemCall( "pread", pread( fd, data + read, entry.blob.size - read, entry.spill_offset.value() + read ) );
+    if ( got == 0 ) {
+      throw std::runtime_error( "spill file is shorter than expected" );
     }
+    read += got;
   }
+
+  entry.blob.ptr = ptr;
+  total_size_ += entry.blob.size;
+  // the blob is in memory now, so its copy on disk can go
+  fallocate( fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, entry.spill_offset.value(), entry.blob.size );
+  entry.spill_offset.reset();
+  stats_.spilled_bytes -= entry.blob.size;
+  return true;
 }
 
-int LocalStorage::new_object_from_string( std::string key, std::string&& object )
+std::optional<Blob> LocalStorage::locate( std::string_view key )
 {
-  auto size = object.length();
-  if ( total_size_ + size > max_size_ ) {
+  Entry* got = find_resident( key );
+  if ( got == nullptr ) {
+    return {};
+  } else {
+    return got->blob;
+  }
+}
+
+std::optional<void*> LocalStorage::new_object( std::string key, size_t size )
+{
+  Entry* existing = find( key );
+  if ( existing != nullptr ) {
+    std::cerr << ( existing->key == key ? "key is in storage" : "key is in aliases" ) << std::endl;
+    return {};
+  }
+
+  if ( not make_room( size ) ) {
     std::cerr << "Allocation surpassing maximum size" << std::endl;
-    return 1;
+    return {};
+  }
+
+  void* ptr = allocator_->allocate( size );
+  if ( ptr == nullptr ) {
+    std::cerr << "allocator out of memory" << std::endl;
+    return {};
+  }
+
+  uint32_t id = entries_.size();
+  if ( free_entries_.empty() ) {
+    entries_.emplace_back();
   } else {
-    void* ptr = malloc( size );
-    std::memcpy( ptr, object.c_str(), size );
-    total_size_ += size;
+    id = free_entries_.back();
+    free_entries_.pop_back();
+  }
+  index_.insert( key, id );
 
-    if ( alias_.find( key ) != alias_.end() ) {
-      std::cerr << "key is in aliases" << std::endl;
-      return 1;
-    }
+  // charge exactly the requested size, regardless of how the allocator rounds it
+  total_size_ += size;
+  entries_[id].key = std::move( key );
+  entries_[id].blob = { true, size, ptr };
+  return ptr;
+}
 
-    bool ok = storage_.insert( { key, { true, size, ptr } } ).second;
-    if ( ok ) {
-      key2alias_.insert( { key, {} } );
-      return 0;
-    } else {
-      std::cerr << "key is in storage" << std::endl;
-      return 1;
-    }
+int LocalStorage::new_object_from_string( std::string key, std::string&& object )
+{
+  auto ptr = new_object( key, object.length() );
+  if ( not ptr.has_value() ) {
+    return 1;
   }
+
+  std::memcpy( ptr.value(), object.data(), object.length() );
+  return 0;
 }
 
-int LocalStorage::commit( std::string key )
+int LocalStorage::commit( std::string_view key, bool coalesce )
 {
-  auto alias_lookup = alias_.find( key );
-  if ( alias_lookup != alias_.end() ) {
-    auto real_key = alias_lookup->second;
-    storage_.find( real_key )->second.mutablility = false;
+  Entry* got = find( key );
+  if ( got != nullptr ) {
+    got->blob.mutablility = false;
+    if ( coalesce and got->blob.segmented() and pins_.find( got->blob.ptr ) == pins_.end() ) {
+      this->coalesce( got->blob );
+    }
     return 0;
   } else {
-    auto storage_lookup = storage_.find( key );
-    if ( storage_lookup != storage_.end() ) {
-      storage_lookup->second.mutablility = false;
-      return 0;
-    } else {
-      std::cerr << "commit key not found" << std::endl;
-      return 1;
-    }
+    std::cerr << "commit key not found" << std::endl;
+    return 1;
   }
 }
 
-int LocalStorage::grow( std::string key, size_t size )
+int LocalStorage::grow( std::string_view key, size_t size )
 {
-  if ( size + total_size_ > max_size_ ) {
+  Entry* got = find( key );
+  if ( got == nullptr ) {
+    std::cerr << "grow key not found" << std::endl;
+    return 1;
+  }
+  return grow( *got, size );
+}
+
+int LocalStorage::grow( Entry& entry, size_t size )
+{
+  Blob& blob = entry.blob;
+  if ( blob.mutablility == false ) {
+    std::cerr << "cannot grow an immutable blob" << std::endl;
+    return 1;
+  }
+  if ( not make_room( size, &entry ) ) {
     std::cerr << "out of memory" << std::endl;
     return 1;
   }
-  auto alias_lookup = alias_.find( key );
-  if ( alias_lookup != alias_.end() ) {
-    auto real_key = alias_lookup->second;
-    Blob& blob = storage_.find( real_key )->second;
-    if ( blob.mutablility == false ) {
-      std::cerr << "cannot grow an immutable blob" << std::endl;
-      return 1;
+
+  // the blob's first allocation becomes its first chunk, full to its exact size
+  if ( not blob.segmented() ) {
+    blob.chunks.push_back( { blob.ptr, blob.size, blob.size } );
+  }
+
+  const size_t chunks_before = blob.chunks.size();
+  const size_t tail_before = blob.chunks.back().size;
+  size_t remaining = size;
+  while ( remaining > 0 ) {
+    Chunk& tail = blob.chunks.back();
+    if ( tail.size == tail.capacity ) {
+      void* ptr = allocator_->allocate( CHUNK_SIZE );
+      if ( ptr == nullptr ) {
+        // give back what this call took
+        for ( size_t i = chunks_before; i < blob.chunks.size(); i++ ) {
+          allocator_->deallocate( blob.chunks[i].ptr, blob.chunks[i].capacity );
+        }
+        blob.chunks.resize( chunks_before );
+        blob.chunks.back().size = tail_before;
+        std::cerr << "allocator out of memory" << std::endl;
+        return 1;
+      }
+      blob.chunks.push_back( { ptr, 0, CHUNK_SIZE } );
+      continue;
     }
-    blob.size += size;
-    blob.ptr = realloc( blob.ptr, blob.size );
-    return 0;
+    const size_t added = std::min( remaining, tail.capacity - tail.size );
+    tail.size += added;
+    remaining -= added;
+  }
+
+  blob.size += size;
+  total_size_ += size;
+  return 0;
+}
+
+int LocalStorage::append( std::string_view key, std::string_view data )
+{
+  Entry* got = find( key );
+  if ( got == nullptr ) {
+    std::cerr << "append key not found" << std::endl;
+    return 1;
+  }
+  if ( grow( *got, data.size() ) != 0 ) {
+    return 1;
+  }
+
+  // the new bytes are the last data.size() of the chunk list
+  auto chunk = got->blob.chunks.rbegin();
+  while ( not data.empty() ) {
+    const size_t n = std::min( data.size(), chunk->size );
+    std::memcpy( static_cast<char*>( chunk->ptr ) + chunk->size - n, data.data() + data.size() - n, n );
+    data.remove_suffix( n );
+    chunk++;
+  }
+  return 0;
+}
+
+int LocalStorage::delete_object( std::string_view key )
+{
+  const uint32_t id = index_.find( key );
+  if ( id == FlatIndex::NOT_FOUND ) {
+    std::cerr << "delete key not found" << std::endl;
+    return 1;
+  }
+
+  Entry& entry = entries_[id];
+  if ( entry.spill_offset.has_value() ) {
+    fallocate( spill_file_->fd().fd_num(),
+               FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+               entry.spill_offset.value(),
+               entry.blob.size );
+    stats_.spilled_bytes -= entry.blob.size;
   } else {
-    auto storage_lookup = storage_.find( key );
-    if ( storage_lookup != storage_.end() ) {
-      Blob& blob = storage_lookup->second;
-      if ( blob.mutablility == false ) {
-        std::cerr << "cannot grow an immutable blob" << std::endl;
+    release( entry.blob );
+  }
+
+  // now go ahead and remove all the aliases too
+  for ( auto& alias : entry.aliases ) {
+    index_.erase( alias );
+  }
+  index_.erase( entry.key );
+  entry = {};
+  free_entries_.push_back( id );
+  return 0;
+}
+
+// figure out what happens if it's actually an update
+int LocalStorage::add( std::string key, std::string alias )
+{
+  const uint32_t id = index_.find( key );
+  if ( id == FlatIndex::NOT_FOUND or entries_[id].key != key ) {
+    std::cerr << "key not in storage" << std::endl;
+    return 1;
+  } else {
+    const uint32_t got = index_.find( alias );
+    if ( got != FlatIndex::NOT_FOUND ) {
+      if ( got == id ) {
+        return 0;
+      } else {
+        std::cerr << "update is not supported" << std::endl;
         return 1;
       }
-      blob.size += size;
-      blob.ptr = realloc( blob.ptr, blob.size );
-      return 0;
-    } else {
-      std::cerr << "commit key not found" << std::endl;
-      return 1;
     }
+    index_.insert( alias, id );
+    entries_[id].aliases.push_back( std::move( alias ) );
+    return 0;
+  }
+}
+
+std::optional<Blob> LocalStorage::pin( std::string_view key )
+{
+  Entry* got = find_resident( key );
+  if ( got == nullptr ) {
+    return {};
+  }
+
+  pins_[got->blob.ptr]++;
+  return got->blob;
+}
+
+void LocalStorage::unpin( const void* ptr )
+{
+  auto pin = pins_.find( ptr );
+  if ( pin == pins_.end() ) {
+    std::cerr << "unpin of a blob that is not pinned" << std::endl;
+    return;
+  }
+
+  if ( --pin->second > 0 ) {
+    return;
+  }
+  pins_.erase( pin );
+
+  // the blob was deleted while pinned, it can go now
+  auto unlinked = unlinked_.find( ptr );
+  if ( unlinked != unlinked_.end() ) {
+    const Blob blob = std::move( unlinked->second );
+    unlinked_.erase( unlinked );
+    release( blob );
+  }
+}
+
+std::optional<BlobHandle> LocalStorage::acquire( std::string_view key )
+{
+  auto blob = pin( key );
+  if ( not blob.has_value() ) {
+    return {};
+  }
+  return BlobHandle { blob.value(), { blob->ptr, [this]( const void* ptr ) { unpin( ptr ); } } };
+}
+
+ConcurrentLocalStorage::ConcurrentLocalStorage( size_t max_size,
+                                                size_t shards,
+                                                std::function<std::unique_ptr<Allocator>()> make_allocator )
+  : max_size_( max_size )
+{
+  for ( size_t i = 0; i < std::max( shards, size_t { 1 } ); i++ ) {
+    shards_.push_back( std::make_unique<Shard>( max_size, make_allocator() ) );
+    pin_directory_.push_back( std::make_unique<PinDirectory>() );
+  }
+}
+
+ConcurrentLocalStorage::Shard& ConcurrentLocalStorage::shard_of( std::string_view key )
+{
+  return *shards_[std::hash<std::string_view> {}( key ) % shards_.size()];
+}
+
+ConcurrentLocalStorage::PinDirectory& ConcurrentLocalStorage::pins_of( const void* ptr )
+{
+  return *pin_directory_[std::hash<const void*> {}( ptr ) % pin_directory_.size()];
+}
+
+template<typename F>
+auto ConcurrentLocalStorage::settle( Shard& shard, size_t reserved, F&& f )
+{
+  const size_t before = shard.storage.get_total_size();
+  auto result = f();
+  const size_t after = shard.storage.get_total_size();
+
+  // frees (after < before) and unused reservations both hand capacity back
+  total_size_.fetch_add( after - before - reserved, std::memory_order_relaxed );
+  return result;
+}
+
+template<typename F>
+auto ConcurrentLocalStorage::with_object( std::string_view key, size_t reserved, F&& f )
+{
+  // most names are keys, found under the one lock of the shard they hash to; an alias costs a second lock
+  std::string real_key;
+  {
+    Shard& shard = shard_of( key );
+    std::lock_guard<std::mutex> lock { shard.mutex };
+    auto alias = shard.alias.end();
+    if ( not shard.storage.contains( key ) ) {
+      alias = shard.alias.find( std::string { key } );
+    }
+    if ( alias == shard.alias.end() ) {
+      return settle( shard, reserved, [&] { return f( shard, key ); } );
+    }
+    real_key = alias->second;
   }
+
+  Shard& shard = shard_of( real_key );
+  std::lock_guard<std::mutex> lock { shard.mutex };
+  return settle( shard, reserved, [&] { return f( shard, std::string_view { real_key } ); } );
 }
 
-int LocalStorage::delete_object( std::string key )
+bool ConcurrentLocalStorage::reserve( size_t size, std::string_view key )
 {
-  auto alias_lookup = alias_.find( key );
-  if ( alias_lookup != alias_.end() ) {
-    auto real_key = alias_lookup->second;
-    free( storage_.find( real_key )->second.ptr );
-    total_size_ -= storage_.find( real_key )->second.size;
-    storage_.erase( real_key );
-    // now go ahead and remove all the aliases too
-    auto aliases = key2alias_.find( real_key )->second;
-    for ( auto alias : aliases ) {
-      alias_.erase( alias );
+  for ( bool evicted = false;; evicted = true ) {
+    size_t used = total_size_.load( std::memory_order_relaxed );
+    while ( used <= max_size_ and size <= max_size_ - used ) {
+      if ( total_size_.compare_exchange_weak( used, used + size, std::memory_order_relaxed ) ) {
+        return true;
+      }
     }
-    key2alias_.erase( real_key );
-    return 0;
-  } else {
-    auto storage_lookup = storage_.find( key );
-    if ( storage_lookup != storage_.end() ) {
-      free( storage_.find( key )->second.ptr );
-      total_size_ -= storage_.find( key )->second.size;
-      storage_.erase( key );
-      return 0;
-    } else {
-      std::cerr << "commit key not found" << std::endl;
-      return 1;
+    if ( evicted or not spilling_ ) {
+      return false;
+    }
+    make_room( size, key );
+  }
+}
+
+void ConcurrentLocalStorage::make_room( size_t size, std::string_view key )
+{
+  const size_t first = std::hash<std::string_view> {}( key ) % shards_.size();
+  for ( size_t i = 0; i < shards_.size(); i++ ) {
+    const size_t used = total_size_.load( std::memory_order_relaxed );
+    if ( size <= max_size_ and used <= max_size_ - size ) {
+      return;
+    }
+
+    Shard& shard = *shards_[( first + i ) % shards_.size()];
+    std::lock_guard<std::mutex> lock { shard.mutex };
+    settle( shard, 0, [&] { return shard.storage.evict( used + size - max_size_ ); } );
+  }
+}
+
+size_t ConcurrentLocalStorage::get_total_size()
+{
+  return total_size_.load( std::memory_order_relaxed );
+}
+
+bool ConcurrentLocalStorage::contains( std::string_view key )
+{
+  return with_object(
+    key, 0, []( Shard& shard, std::string_view real_key ) { return shard.storage.contains( real_key ); } );
+}
+
+std::optional<Blob> ConcurrentLocalStorage::locate( std::string_view key )
+{
+  auto blob = with_object( key, 0, []( Shard& shard, std::string_view real_key ) {
+    return shard.storage.locate( real_key );
+  } );
+
+  // a shard reads a spilled blob back in without asking, which can take the total over the capacity
+  if ( spilling_ and total_size_.load( std::memory_order_relaxed ) > max_size_ ) {
+    make_room( 0, key );
+  }
+  return blob;
+}
+
+std::optional<void*> ConcurrentLocalStorage::new_object( std::string key, size_t size )
+{
+  if ( not reserve( size, key ) ) {
+    std::cerr << "Allocation surpassing maximum size" << std::endl;
+    return {};
+  }
+
+  Shard& shard = shard_of( key );
+  std::lock_guard<std::mutex> lock { shard.mutex };
+  return settle( shard, size, [&]() -> std::optional<void*> {
+    // the key's shard is also the one that would hold an alias of the same name
+    if ( shard.alias.find( key ) != shard.alias.end() ) {
+      std::cerr << "key is in aliases" << std::endl;
+      return {};
     }
+    return shard.storage.new_object( key, size );
+  } );
+}
+
+int ConcurrentLocalStorage::new_object_from_string( std::string key, std::string&& object )
+{
+  auto ptr = new_object( key, object.length() );
+  if ( not ptr.has_value() ) {
+    return 1;
+  }
+
+  std::memcpy( ptr.value(), object.data(), object.length() );
+  return 0;
+}
+
+int ConcurrentLocalStorage::commit( std::string_view key, bool coalesce )
+{
+  return with_object( key, 0, [&]( Shard& shard, std::string_view real_key ) {
+    return shard.storage.commit( real_key, coalesce );
+  } );
+}
+
+int ConcurrentLocalStorage::grow( std::string_view key, size_t size )
+{
+  if ( not reserve( size, key ) ) {
+    std::cerr << "out of memory" << std::endl;
+    return 1;
   }
+
+  return with_object( key, size, [&]( Shard& shard, std::string_view real_key ) {
+    return shard.storage.grow( real_key, size );
+  } );
 }
 
+int ConcurrentLocalStorage::append( std::string_view key, std::string_view data )
+{
+  if ( not reserve( data.size(), key ) ) {
+    std::cerr << "out of memory" << std::endl;
+    return 1;
+  }
+
+  return with_object( key, data.size(), [&]( Shard& shard, std::string_view real_key ) {
+    return shard.storage.append( real_key, data );
+  } );
+}
+
+int ConcurrentLocalStorage::delete_object( std::string_view key )
+{
+  std::vector<std::string> aliases;
+  const int result = with_object( key, 0, [&]( Shard& shard, std::string_view real_key ) {
+    if ( not shard.key2alias.empty() ) {
+      auto got = shard.key2alias.find( std::string { real_key } );
+      if ( got != shard.key2alias.end() ) {
+        aliases = std::move( got->second );
+        shard.key2alias.erase( got );
+      }
+    }
+    return shard.storage.delete_object( real_key );
+  } );
+
+  // now go ahead and remove all the aliases too, one shard at a time
+  for ( auto& alias : aliases ) {
+    Shard& shard = shard_of( alias );
+    std::lock_guard<std::mutex> lock { shard.mutex };
+    shard.alias.erase( alias );
+  }
+  return result;
+}
 // figure out what happens if it's actually an update
-int LocalStorage::add( std::string key, std::string alias )
+int ConcurrentLocalStorage::add( std::string key, std::string alias )
 {
-  if ( storage_.find( key ) == storage_.end() ) {
+  Shard& key_shard = shard_of( key );
+  Shard& alias_shard = shard_of( alias );
+
+  // only one shard is locked at a time, so the key is checked again after the alias went in
+  // in case it was deleted in between
+  if ( not contains( key ) ) {
     std::cerr << "key not in storage" << std::endl;
     return 1;
-  } else {
-    auto got = alias_.find( alias );
-    if ( got != alias_.end() ) {
+  }
+
+  {
+    std::lock_guard<std::mutex> lock { alias_shard.mutex };
+    auto got = alias_shard.alias.find( alias );
+    if ( got != alias_shard.alias.end() ) {
       if ( got->second.compare( key ) == 0 ) {
         return 0;
       } else {
@@ -176,8 +649,97 @@ int LocalStorage::add( std::string key, std::string alias )
         return 1;
       }
     }
-    alias_.insert( { alias, key } );
-    key2alias_.find( key )->second.push_back( alias );
+    alias_shard.alias.insert( { alias, key } );
+  }
+
+  {
+    std::lock_guard<std::mutex> lock { key_shard.mutex };
+    if ( key_shard.storage.contains( key ) ) {
+      key_shard.key2alias[key].push_back( alias );
+      return 0;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock { alias_shard.mutex };
+  alias_shard.alias.erase( alias );
+  std::cerr << "key not in storage" << std::endl;
+  return 1;
+}
+
+std::optional<Blob> ConcurrentLocalStorage::pin( std::string_view key )
+{
+  Shard* shard = nullptr;
+  auto blob = with_object( key, 0, [&]( Shard& s, std::string_view real_key ) {
+    shard = &s;
+    return s.storage.pin( real_key );
+  } );
+  if ( not blob.has_value() ) {
+    return {};
+  }
+  if ( spilling_ and total_size_.load( std::memory_order_relaxed ) > max_size_ ) {
+    make_room( 0, key );
+  }
+
+  PinDirectory& pins = pins_of( blob->ptr );
+  std::lock_guard<std::mutex> lock { pins.mutex };
+  auto& owner = pins.owners[blob->ptr];
+  owner.first = shard;
+  owner.second++;
+  return blob;
+}
+
+void ConcurrentLocalStorage::unpin( const void* ptr )
+{
+  Shard* shard;
+  {
+    PinDirectory& pins = pins_of( ptr );
+    std::lock_guard<std::mutex> lock { pins.mutex };
+    auto owner = pins.owners.find( ptr );
+    if ( owner == pins.owners.end() ) {
+      std::cerr << "unpin of a blob that is not pinned" << std::endl;
+      return;
+    }
+    shard = owner->second.first;
+    if ( --owner->second.second == 0 ) {
+      pins.owners.erase( owner );
+    }
+  }
+
+  std::lock_guard<std::mutex> lock { shard->mutex };
+  settle( *shard, 0, [&] {
+    shard->storage.unpin( ptr );
     return 0;
+  } );
+}
+
+std::optional<BlobHandle> ConcurrentLocalStorage::acquire( std::string_view key )
+{
+  auto blob = pin( key );
+  if ( not blob.has_value() ) {
+    return {};
   }
-}
\ No newline at end of file
+  return BlobHandle { blob.value(), { blob->ptr, [this]( const void* ptr ) { unpin( ptr ); } } };
+}
+
+void ConcurrentLocalStorage::enable_spill( const std::string& directory )
+{
+  for ( auto& shard : shards_ ) {
+    std::lock_guard<std::mutex> lock { shard->mutex };
+    shard->storage.enable_spill( directory );
+  }
+  spilling_ = true;
+}
+
+StorageStats ConcurrentLocalStorage::stats()
+{
+  StorageStats total;
+  for ( auto& shard : shards_ ) {
+    std::lock_guard<std::mutex> lock { shard->mutex };
+    const StorageStats& stats = shard->storage.stats();
+    total.hits += stats.hits;
+    total.misses += stats.misses;
+    total.spills += stats.spills;
+    total.spilled_bytes += stats.spilled_bytes;
+  }
+  return total;
+}
@@ -1,37 +1,215 @@
 #pragma once
+#include <atomic>
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <stdlib.h>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
+#include "storage/allocator.hh"
+#include "storage/flat_index.hh"
+#include "util/temp_file.hh"
+
+struct Chunk
+{
+  void* ptr {};
+  size_t size {};     // bytes of the blob in this chunk
+  size_t capacity {}; // bytes allocated for it
+};
+
 struct Blob
 {
   bool mutablility {};
   size_t size {};
-  void* ptr {};
+  void* ptr {}; // where the blob starts (its first chunk, if it is segmented)
+  // a blob that has been grown is kept as a list of chunks, so growing never moves what is already there.
+  // empty while the blob is one contiguous allocation.
+  std::vector<Chunk> chunks {};
+
+  bool segmented() const { return not chunks.empty(); }
+};
+
+// a blob that stays alive and in place for as long as any copy of its handle exists: it is pinned when the
+// handle is made, and unpinned when the last copy goes away (on whichever thread that is). deleting the object
+// in the meantime only removes its name. the storage must outlive the handles it gives out.
+struct BlobHandle
+{
+  Blob blob {};
+  std::shared_ptr<const void> pin {};
+};
+
+// how often lookups found their blob in memory, and how much was moved out to the spill file
+struct StorageStats
+{
+  uint64_t hits {};
+  uint64_t misses {}; // lookups that had to read a spilled blob back in
+  uint64_t spills {};
+  uint64_t spilled_bytes {}; // on disk right now
 };
 
 class LocalStorage
 {
 private:
-  std::unordered_map<std::string, Blob> storage_ {};
-  std::unordered_map<std::string, std::string> alias_ {};
-  std::unordered_map<std::string, std::vector<std::string>> key2alias_ {};
+  struct Entry
+  {
+    std::string key {};
+    Blob blob {}; // ptr is null while the blob is spilled
+    std::vector<std::string> aliases {};
+    std::optional<uint64_t> spill_offset {};
+    bool referenced {}; // looked up since the clock hand last passed
+  };
+
+  // keys and aliases both map straight to their entry, so an alias resolves in the same single probe
+  FlatIndex index_ {};
+  std::vector<Entry> entries_ {};
+  std::vector<uint32_t> free_entries_ {};
   size_t total_size_;
   size_t max_size_;
+  std::unique_ptr<Allocator> allocator_;
+
+  // blobs that someone outside the storage is reading in place; a pinned blob cannot move,
+  // and if it is deleted its memory is only given back once the last pin is dropped
+  std::unordered_map<const void*, size_t> pins_ {};
+  std::unordered_map<const void*, Blob> unlinked_ {};
+
+  // once enabled, cold committed blobs are written here when memory runs out, and read back on lookup
+  std::optional<TempFile> spill_file_ {};
+  uint64_t spill_end_ { 0 };
+  size_t clock_hand_ { 0 };
+  StorageStats stats_ {};
+
+  void release( const Blob& blob );
+  // hands a blob's memory back to the allocator
+  void free_memory( const Blob& blob );
+  // copies a segmented blob into one allocation, if there is memory for it
+  void coalesce( Blob& blob );
+
+  // the entry a key or one of its aliases names, or nullptr
+  Entry* find( std::string_view key );
+
+  // like find, but reads a spilled blob back in first (nullptr if there is no room for it)
+  Entry* find_resident( std::string_view key );
+
+  // spills blobs picked by CLOCK until `size` more bytes fit, never touching `keep`
+  bool make_room( size_t size, const Entry* keep = nullptr );
+  size_t evict( size_t size, const Entry* keep );
+  void spill( Entry& entry );
+  bool fault_in( Entry& entry );
+  int grow( Entry& entry, size_t size );
+
+public:
+  // blobs grow by chunks of this size (the largest slab size class)
+  static constexpr size_t CHUNK_SIZE = SlabAllocator::MAX_CLASS_SIZE;
+
+  LocalStorage( size_t max_size, std::unique_ptr<Allocator> allocator = std::make_unique<MallocAllocator>() );
+  ~LocalStorage();
+  size_t get_total_size();
+  // whether the key (or alias) names a blob; unlike locate, never reads a spilled one back in
+  bool contains( std::string_view key ) { return find( key ) != nullptr; }
+  std::optional<Blob> locate( std::string_view key );
+  std::optional<void*> new_object( std::string key, size_t size );
+  int new_object_from_string( std::string key, std::string&& object );
+  // with `coalesce`, a segmented blob is also copied into one allocation (unless it is pinned)
+  int commit( std::string_view key, bool coalesce = false );
+  // adds `size` bytes to the end of a mutable blob, in new chunks: nothing already in it moves
+  int grow( std::string_view key, size_t size );
+  int append( std::string_view key, std::string_view data );
+  int delete_object( std::string_view key );
+  int add( std::string key, std::string alias );
+  std::optional<Blob> pin( std::string_view key );
+  void unpin( const void* ptr );
+  std::optional<BlobHandle> acquire( std::string_view key );
+
+  // instead of failing allocations once full, spill committed, unpinned blobs to a file in `directory`.
+  // a located (rather than pinned) blob may then be spilled, and its pointer go stale, by a later call.
+  void enable_spill( const std::string& directory = "/tmp" );
+  // spills up to `size` bytes of cold blobs regardless of the limit, returns how much was freed
+  size_t evict( size_t size ) { return evict( size, nullptr ); }
+  const StorageStats& stats() const { return stats_; }
+
+  LocalStorage( const LocalStorage& ) = delete;
+  LocalStorage& operator=( const LocalStorage& ) = delete;
+};
+
+// LocalStorage for several threads at once (e.g. one storage server per event loop). every call is atomic.
+// keys are spread over independently locked shards by hash, so threads working on different keys rarely
+// contend; the capacity limit is enforced across all shards with an atomic reservation.
+class ConcurrentLocalStorage
+{
+public:
+  static constexpr size_t DEFAULT_SHARDS = 16;
+
+private:
+  // a shard owns the objects whose keys hash to it, and the aliases whose names do. an alias can
+  // point into another shard, so aliases are kept here rather than in the shard's LocalStorage.
+  struct Shard
+  {
+    std::mutex mutex {};
+    LocalStorage storage;
+    std::unordered_map<std::string, std::string> alias {};
+    std::unordered_map<std::string, std::vector<std::string>> key2alias {};
+
+    Shard( size_t max_size, std::unique_ptr<Allocator> allocator )
+      : storage( max_size, std::move( allocator ) )
+    {}
+  };
+
+  // which shard holds each pinned blob, so unpin does not have to ask all of them
+  struct PinDirectory
+  {
+    std::mutex mutex {};
+    std::unordered_map<const void*, std::pair<Shard*, size_t>> owners {};
+  };
+
+  const size_t max_size_;
+  std::atomic<size_t> total_size_ { 0 };
+  bool spilling_ { false };
+  std::vector<std::unique_ptr<Shard>> shards_ {};
+  std::vector<std::unique_ptr<PinDirectory>> pin_directory_ {};
+
+  Shard& shard_of( std::string_view key );
+  PinDirectory& pins_of( const void* ptr );
+
+  // claims `size` bytes of the capacity before a shard allocates them, spilling cold blobs if that is enabled
+  bool reserve( size_t size, std::string_view key );
+
+  // spills from the shards, starting with `key`'s, until `size` more bytes fit in the capacity
+  void make_room( size_t size, std::string_view key );
+
+  // runs `f` (with the shard's lock held), then settles `reserved` against what the shard really charged
+  template<typename F>
+  auto settle( Shard& shard, size_t reserved, F&& f );
+
+  // runs `f( shard, real_key )` under the lock of the shard holding `key`, or the key it is an alias of
+  template<typename F>
+  auto with_object( std::string_view key, size_t reserved, F&& f );
 
 public:
-  LocalStorage( size_t max_size );
-  int get_total_size();
-  std::optional<Blob> locate( std::string );
+  ConcurrentLocalStorage( size_t max_size,
+                          size_t shards = DEFAULT_SHARDS,
+                          std::function<std::unique_ptr<Allocator>()> make_allocator
+                          = [] { return std::make_unique<MallocAllocator>(); } );
+  size_t get_total_size();
+  bool contains( std::string_view key );
+  std::optional<Blob> locate( std::string_view key );
   std::optional<void*> new_object( std::string key, size_t size );
   int new_object_from_string( std::string key, std::string&& object );
-  int commit( std::string key );
-  int grow( std::string key, size_t size );
-  int delete_object( std::string key );
+  int commit( std::string_view key, bool coalesce = false );
+  int grow( std::string_view key, size_t size );
+  int append( std::string_view key, std::string_view data );
+  int delete_object( std::string_view key );
   int add( std::string key, std::string alias );
-};
\ No newline at end of file
+  std::optional<Blob> pin( std::string_view key );
+  void unpin( const void* ptr );
+  std::optional<BlobHandle> acquire( std::string_view key );
+
+  // see LocalStorage::enable_spill; call before the storage is shared between threads
+  void enable_spill( const std::string& directory = "/tmp" );
+  StorageStats stats();
+};
@@ -1,8 +1,15 @@
 #include "assert.h"
 
-#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
 
+#include "util/log.hh"
 #include "util/util.hh"
 
 class UniqueTagGenerator
@@ -12,26 +19,32 @@ private:
 
 public:
   UniqueTagGenerator( int size );
-  int emit();
+  UniqueTagGenerator( int first, int size ); // emits tags from [first, first + size)
+  // a tag nobody is using, or nothing if they have all been given out
+  std::optional<int> emit();
   void allow( int key );
+  size_t available() const { return allowed.size(); } // tags that can be emitted right now
 };
 
 UniqueTagGenerator::UniqueTagGenerator( int size )
+  : UniqueTagGenerator( 0, size )
+{}
+
+UniqueTagGenerator::UniqueTagGenerator( int first, int size )
 {
-  for ( int i = 0; i < size; i++ ) {
+  for ( int i = first; i < first + size; i++ ) {
     allowed.insert( i );
   }
 }
 
-int UniqueTagGenerator::emit()
+std::optional<int> UniqueTagGenerator::emit()
 {
-  if ( allowed.size() > 0 ) {
-    int key = *( allowed.begin() );
-    allowed.erase( key );
-    return key;
-  } else {
-    assert( false );
+  if ( allowed.empty() ) {
+    return {};
   }
+  int key = *( allowed.begin() );
+  allowed.erase( key );
+  return key;
 }
 
 void UniqueTagGenerator::allow( int key )
@@ -39,116 +52,418 @@ void UniqueTagGenerator::allow( int key )
   allowed.insert( key );
 }
 
+// integers on the wire are little-endian regardless of the host
+template<typename T>
+inline void put_le( char* out, const T value )
+{
+  for ( size_t i = 0; i < sizeof( T ); i++ ) {
+    out[i] = static_cast<char>( static_cast<uint64_t>( value ) >> ( 8 * i ) );
+  }
+}
+
+template<typename T>
+inline T get_le( const char* in )
+{
+  uint64_t value = 0;
+  for ( size_t i = 0; i < sizeof( T ); i++ ) {
+    value |= static_cast<uint64_t>( static_cast<uint8_t>( in[i] ) ) << ( 8 * i );
+  }
+  return static_cast<T>( value );
+}
+
+// fixed-size header of every message between storage servers. a message is the header, then key_length bytes
+// of key, then payload_length bytes of payload (an object's contents, or the text of a success/error reply).
+//
+//   0: length (u32, the whole message)  4: version (u8)  5: opcode (u8)  6: flags (u16)
+//   8: tag (u32)  12: key_length (u32)  16: payload_length (u64)
+struct PackedHeader
+{
+  static constexpr uint8_t VERSION = 2;
+  static constexpr size_t SIZE = 24;
+
+  uint32_t length {};
+  uint8_t version { VERSION };
+  uint8_t opcode {};
+  uint16_t flags {}; // none defined yet; receivers ignore the ones they don't know
+  uint32_t tag {};
+  uint32_t key_length {};
+  uint64_t payload_length {};
+
+  void encode( char* out ) const
+  {
+    put_le( out, length );
+    put_le( out + 4, version );
+    put_le( out + 5, opcode );
+    put_le( out + 6, flags );
+    put_le( out + 8, tag );
+    put_le( out + 12, key_length );
+    put_le( out + 16, payload_length );
+  }
+
+  // `message` starts after the length, as ClientHandler hands it out. nothing if it is too short to hold a
+  // header or was written by a different version of the protocol.
+  static std::optional<PackedHeader> decode( std::string_view message )
+  {
+    if ( message.length() < SIZE - 4 ) {
+      return {};
+    }
+    const char* in = message.data(); // offsets below are 4 less than in the layout above
+    PackedHeader header;
+    header.version = get_le<uint8_t>( in );
+    if ( header.version != VERSION ) {
+      return {};
+    }
+    header.opcode = get_le<uint8_t>( in + 1 );
+    header.flags = get_le<uint16_t>( in + 2 );
+    header.tag = get_le<uint32_t>( in + 4 );
+    header.key_length = get_le<uint32_t>( in + 8 );
+    header.payload_length = get_le<uint64_t>( in + 12 );
+    header.length = SIZE + header.key_length + header.payload_length;
+    return header;
+  }
+
+  // the key of a decoded message (which must hold at least the header and key)
+  std::string_view key( std::string_view message ) const { return message.substr( SIZE - 4, key_length ); }
+  std::string_view payload( std::string_view message ) const
+  {
+    return message.substr( SIZE - 4 + key_length, payload_length );
+  }
+};
+
 class MessageHandler
 {
 public:
-  enum RemoteOpCode : int {
+  enum RemoteOpCode : uint8_t {
+    SUCCESS = 0,
     LOOKUP = 1,
     STORE = 2,
-    DELETE = 3
+    DELETE = 3,
+    MULTI_LOOKUP = 4,
+    ERROR = 5,
+    MULTI_STORE = 6,
+    PUT = 7 // store an object on the peer, which answers with SUCCESS or ERROR
   };
   // rely on RVO for the return value
 
-  std::string generate_remote_lookup( int tag, std::string name )
+  // a whole message to a peer, built in place. the payload is left out when it is sent separately.
+  std::string generate_remote( RemoteOpCode opcode,
+                               int tag,
+                               std::string_view key,
+                               std::string_view payload,
+                               uint64_t payload_length )
+  {
+    PackedHeader header;
+    header.opcode = opcode;
+    header.tag = tag;
+    header.key_length = key.length();
+    header.payload_length = payload_length;
+    if ( PackedHeader::SIZE + key.length() + payload_length > UINT32_MAX ) {
+      throw std::runtime_error( "message too large for the wire format: " + std::to_string( payload_length ) );
+    }
+    header.length = PackedHeader::SIZE + key.length() + payload_length;
+
+    std::string message( PackedHeader::SIZE + key.length() + payload.length(), 0 );
+    header.encode( message.data() );
+    memcpy( message.data() + PackedHeader::SIZE, key.data(), key.length() );
+    memcpy( message.data() + PackedHeader::SIZE + key.length(), payload.data(), payload.length() );
+    return message;
+  };
+
+  std::string generate_remote_lookup( int tag, std::string_view name )
   {
-    std::string remote_request { "0000" + std::to_string(LOOKUP) + "0000" + name };
-    int* p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() ) );
-    p[0] = name.length() + 9;
-    p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() + 5 ) );
-    p[0] = tag;
-    return remote_request;
+    return generate_remote( LOOKUP, tag, name, {}, 0 );
   };
-  std::string generate_remote_delete( int tag, std::string name )
+  std::string generate_remote_delete( int tag, std::string_view name )
   {
-    std::string remote_request { "000030000" + name };
-    int* p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() ) );
-    p[0] = name.length() + 9;
-    p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() + 5 ) );
-    p[0] = tag;
-    return remote_request;
+    return generate_remote( DELETE, tag, name, {}, 0 );
   };
   // note that we send remote store as two messages, the first is a plaintext header and the second is a ptr payload
-  std::string generate_remote_store_header( int tag, std::string name, int payload_size )
+  std::string generate_remote_store_header( int tag, std::string_view name, uint64_t payload_size )
   {
-    std::string remote_request { "0000200000000" + name };
-    int* p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() ) );
-    p[0] = name.length() + 13 + payload_size;
-    p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() + 5 ) );
-    p[0] = tag;
-    p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() + 9 ) );
-    p[0] = name.length();
-    return remote_request;
+    return generate_remote( STORE, tag, name, {}, payload_size );
+  };
+  // an object for the peer to keep, sent like a store: the header, then the object as its own messages
+  std::string generate_remote_put_header( int tag, std::string_view name, uint64_t payload_size )
+  {
+    return generate_remote( PUT, tag, name, {}, payload_size );
+  };
+  std::string generate_remote_error( int tag, std::string_view error )
+  {
+    return generate_remote( ERROR, tag, {}, error, error.length() );
+  };
+  std::string generate_remote_success( int tag, std::string_view message )
+  {
+    return generate_remote( SUCCESS, tag, {}, message, message.length() );
   };
 
-  std::string generate_local_object_header( std::string name, int payload_size )
+  std::tuple<std::string, int> parse_remote_lookup( std::string_view request )
   {
-    std::string remote_request { "000020000" + name };
-    int* p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() ) );
-    p[0] = name.length() + 9 + payload_size;
-    p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() + 5 ) );
-    p[0] = name.length();
-    return remote_request;
+    const PackedHeader header = PackedHeader::decode( request ).value();
+    return { std::string { header.key( request ) }, header.tag };
+  };
+  std::tuple<std::string, uint64_t, int> parse_remote_store( std::string_view request )
+  {
+    const PackedHeader header = PackedHeader::decode( request ).value();
+    return { std::string { header.key( request ) }, header.payload_length, header.tag };
+  };
+  std::tuple<std::string, int> parse_remote_error( std::string_view request )
+  {
+    const PackedHeader header = PackedHeader::decode( request ).value();
+    return { std::string { header.payload( request ) }, header.tag };
+  };
+  // length of a store (or put, or multi store) message up to where its payload starts, or nothing if it isn't
+  // one. needs the first PackedHeader::SIZE bytes of the message.
+  std::optional<size_t> remote_store_header_length( std::string_view request )
+  {
+    const auto header = PackedHeader::decode( request );
+    if ( not header.has_value()
+         or ( header->opcode != STORE and header->opcode != PUT and header->opcode != MULTI_STORE ) ) {
+      return {};
+    }
+    return PackedHeader::SIZE - 4 + header->key_length;
+  };
+
+  // batches carry their keys as [count:4] then [key length:4][key] per key
+  std::string generate_key_list( const std::vector<std::string_view>& keys )
+  {
+    size_t length = 4;
+    for ( const auto key : keys ) {
+      length += 4 + key.length();
+    }
+    std::string list( length, 0 );
+    char* out = list.data();
+    put_le<uint32_t>( out, keys.size() );
+    out += 4;
+    for ( const auto key : keys ) {
+      put_le<uint32_t>( out, key.length() );
+      memcpy( out + 4, key.data(), key.length() );
+      out += 4 + key.length();
+    }
+    return list;
+  };
+  // the keys are views into `list`. `list` is advanced past them.
+  std::vector<std::string_view> parse_key_list( std::string_view& list )
+  {
+    if ( list.length() < 4 ) {
+      throw std::runtime_error( "truncated key list" );
+    }
+    const uint32_t count = get_le<uint32_t>( list.data() );
+    list.remove_prefix( 4 );
+    std::vector<std::string_view> keys;
+    keys.reserve( count );
+    for ( uint32_t i = 0; i < count; i++ ) {
+      if ( list.length() < 4 or list.length() - 4 < get_le<uint32_t>( list.data() ) ) {
+        throw std::runtime_error( "truncated key list" );
+      }
+      const uint32_t length = get_le<uint32_t>( list.data() );
+      keys.push_back( list.substr( 4, length ) );
+      list.remove_prefix( 4 + length );
+    }
+    return keys;
   };
 
-  std::string generate_remote_error( int tag, std::string error )
+  std::string generate_remote_multi_lookup( int tag, const std::vector<std::string_view>& keys )
+  {
+    const std::string list = generate_key_list( keys );
+    return generate_remote( MULTI_LOOKUP, tag, {}, list, list.length() );
+  };
+  std::tuple<std::vector<std::string_view>, int> parse_remote_multi_lookup( std::string_view request )
+  {
+    const PackedHeader header = PackedHeader::decode( request ).value();
+    std::string_view list = header.payload( request );
+    return { parse_key_list( list ), header.tag };
+  };
+  // answer to a multi lookup. its key is a table of the key list, then a size per key (NOT_FOUND for the missing
+  // ones); its payload is the objects that were found, back to back. as with a single store, the objects are
+  // sent separately, and the receiver can put each one straight into its object.
+  static constexpr uint64_t NOT_FOUND = UINT64_MAX;
+  std::string generate_remote_multi_store_header( int tag,
+                                                  const std::vector<std::string_view>& keys,
+                                                  const std::vector<uint64_t>& sizes )
   {
-    std::string message { "000050000" + error };
-    int* p = reinterpret_cast<int*>( const_cast<char*>( message.c_str() ) );
-    p[0] = message.length();
-    p = reinterpret_cast<int*>( const_cast<char*>( message.c_str() + 5 ) );
-    p[0] = tag;
+    std::string table = generate_key_list( keys );
+    const size_t list_length = table.length();
+    table.resize( list_length + 8 * sizes.size() );
+    uint64_t objects_length = 0;
+    for ( size_t i = 0; i < sizes.size(); i++ ) {
+      put_le( table.data() + list_length + 8 * i, sizes[i] );
+      objects_length += sizes[i] == NOT_FOUND ? 0 : sizes[i];
+    }
+    return generate_remote( MULTI_STORE, tag, table, {}, objects_length );
+  };
+  // (key, size) per key, the objects that follow, and the tag. `request` may stop after the table, when the
+  // objects were received on their own, and then the objects are empty.
+  std::tuple<std::vector<std::pair<std::string_view, uint64_t>>, std::string_view, int> parse_remote_multi_store(
+    std::string_view request )
+  {
+    const PackedHeader header = PackedHeader::decode( request ).value();
+    std::string_view table = header.key( request );
+    if ( table.length() != header.key_length ) {
+      throw std::runtime_error( "truncated multi store" );
+    }
+    const auto keys = parse_key_list( table );
+    if ( table.length() != 8 * keys.size() ) {
+      throw std::runtime_error( "multi store sizes do not match its keys" );
+    }
+    std::vector<std::pair<std::string_view, uint64_t>> entries;
+    entries.reserve( keys.size() );
+    // the sizes are the peer's word: they have to account for the objects exactly, or the frame is rejected
+    uint64_t remaining = header.payload_length;
+    for ( size_t i = 0; i < keys.size(); i++ ) {
+      const uint64_t size = get_le<uint64_t>( table.data() + 8 * i );
+      if ( size != NOT_FOUND ) {
+        if ( remaining < size ) {
+          throw std::runtime_error( "multi store sizes do not match its objects" );
+        }
+        remaining -= size;
+      }
+      entries.emplace_back( keys[i], size );
+    }
+    if ( remaining != 0 ) {
+      throw std::runtime_error( "multi store sizes do not match its objects" );
+    }
+    const std::string_view objects = header.payload( request );
+    if ( not objects.empty() and objects.length() != header.payload_length ) {
+      throw std::runtime_error( "truncated multi store" );
+    }
+    return { entries, objects, header.tag };
+  };
+
+  // local requests and responses keep their own layout: [length:4][opcode as an ASCII digit][fields]
+  std::string generate_local( char opcode, size_t fields_length, std::string_view text )
+  {
+    std::string message( 5 + fields_length + text.length(), 0 );
+    put_le<uint32_t>( message.data(), message.length() );
+    message[4] = opcode;
+    memcpy( message.data() + 5 + fields_length, text.data(), text.length() );
     return message;
   };
-  std::string generate_remote_success( int tag, std::string error )
+
+  std::string parse_local_lookup( std::string_view request ) { return std::string { request.substr( 1 ) }; };
+  std::string parse_local_store( std::string_view request )
   {
-    std::string message { "000000000" + error };
-    int* p = reinterpret_cast<int*>( const_cast<char*>( message.c_str() ) );
-    p[0] = message.length();
-    p = reinterpret_cast<int*>( const_cast<char*>( message.c_str() + 5 ) );
-    p[0] = tag;
+    const uint32_t size = get_le<uint32_t>( request.data() + 1 );
+    return std::string { request.substr( 5, size ) };
+  };
+  // same as remote_store_header_length, for local store requests (opcode 2, and P which is laid out the same).
+  // needs the first 5 bytes.
+  std::optional<size_t> local_store_header_length( std::string_view request )
+  {
+    if ( request[0] != '2' and request[0] != 'P' ) {
+      return {};
+    }
+    return 5 + get_le<uint32_t>( request.data() + 1 );
+  };
+  // nothing if the object is too large for the frame's 32-bit length
+  std::optional<std::string> generate_local_object_header( std::string_view name, uint64_t payload_size )
+  {
+    std::string message = generate_local( '2', 4, name );
+    if ( payload_size > UINT32_MAX or message.length() + payload_size > UINT32_MAX ) {
+      return {};
+    }
+    put_le<uint32_t>( message.data(), message.length() + payload_size );
+    put_le<uint32_t>( message.data() + 5, name.length() );
     return message;
   };
-  std::tuple<std::string, int> parse_remote_lookup( std::string request )
+  std::string generate_local_error( std::string_view error ) { return generate_local( '5', 0, error ); };
+  std::string generate_local_success( std::string_view message ) { return generate_local( '0', 0, message ); };
+  // offset of a freshly created object inside the shared arena
+  std::string generate_local_offset( uint64_t offset )
   {
-    int tag = *reinterpret_cast<const int*>( ( request.c_str() + 1 ) );
-    std::string name = request.substr( 5 );
-    return { name, tag };
+    std::string message = generate_local( '0', 8, {} );
+    put_le( message.data() + 5, offset );
+    return message;
   };
-  std::tuple<std::string, int, int> parse_remote_store( std::string request )
+  // where co-located clients can map the shared arena from
+  std::string generate_local_arena_info( std::string_view path, uint64_t capacity )
   {
-    int tag = *reinterpret_cast<const int*>( ( request.c_str() + 1 ) );
-    int size = *reinterpret_cast<const int*>( ( request.c_str() + 5 ) );
-    std::string name = request.substr( 9, size ); // name can only be 4 characters for now
-    return { name, size, tag };
+    std::string message = generate_local( '0', 8, path );
+    put_le( message.data() + 5, capacity );
+    return message;
   };
-  std::tuple<std::string, int> parse_remote_error( std::string request )
+  // an object the client reads straight out of the shared arena; it stays valid until the client releases `ref`
+  std::string generate_local_shared_object( uint64_t offset, uint64_t size, int ref )
   {
-    int tag = *reinterpret_cast<const int*>( ( request.c_str() + 1 ) );
-    std::string name = request.substr( 5 );
-    return { name, tag };
+    std::string message = generate_local( '8', 20, {} );
+    put_le( message.data() + 5, offset );
+    put_le( message.data() + 13, size );
+    put_le<int32_t>( message.data() + 21, ref );
+    return message;
   };
+  int parse_local_release( std::string_view message ) { return get_le<int32_t>( message.data() + 1 ); };
 
-  std::string parse_local_lookup( std::string request ) { return request.substr( 1 ); };
-  std::string generate_local_error( std::string error )
+  // multi get ('g', and 'r' to fetch from a peer) is answered with one 'g' message: [count:4], a size per key
+  // (NOT_FOUND for the missing ones), then the objects that were found, back to back. the objects are sent
+  // separately.
+  // nothing if the objects are too large, together, for the frame's 32-bit length
+  std::optional<std::string> generate_local_multi_get_header( const std::vector<uint64_t>& sizes )
   {
-    std::string message { "00005" + error };
-    int* p = reinterpret_cast<int*>( const_cast<char*>( message.c_str() ) );
-    p[0] = message.length();
+    std::string message = generate_local( 'g', 4 + 8 * sizes.size(), {} );
+    put_le<uint32_t>( message.data() + 5, sizes.size() );
+    uint64_t objects_length = 0;
+    for ( size_t i = 0; i < sizes.size(); i++ ) {
+      put_le( message.data() + 9 + 8 * i, sizes[i] );
+      if ( sizes[i] == NOT_FOUND ) {
+        continue;
+      }
+      objects_length += sizes[i];
+      if ( sizes[i] > UINT32_MAX or message.length() + objects_length > UINT32_MAX ) {
+        return {};
+      }
+    }
+    put_le<uint32_t>( message.data(), message.length() + objects_length );
     return message;
   };
-  std::string generate_local_success( std::string error )
+  std::vector<std::string_view> parse_local_multi_get( std::string_view message )
   {
-    std::string message { "00000" + error };
-    int* p = reinterpret_cast<int*>( const_cast<char*>( message.c_str() ) );
-    p[0] = message.length();
+    message.remove_prefix( 1 );
+    return parse_key_list( message );
+  };
+  // 'r': [peer id:4] then the key list
+  std::tuple<std::vector<std::string_view>, int> parse_local_remote_multi_get( std::string_view message )
+  {
+    int id = get_le<int32_t>( message.data() + 1 );
+    message.remove_prefix( 5 );
+    return { parse_key_list( message ), id };
+  };
+  // multi put ('p'): the key list, a size per key, then the objects back to back. (key, object) per key.
+  std::vector<std::pair<std::string_view, std::string_view>> parse_local_multi_put( std::string_view message )
+  {
+    message.remove_prefix( 1 );
+    const auto keys = parse_key_list( message );
+    if ( message.length() < 8 * keys.size() ) {
+      throw std::runtime_error( "truncated multi put" );
+    }
+    std::string_view objects = message.substr( 8 * keys.size() );
+    std::vector<std::pair<std::string_view, std::string_view>> entries;
+    entries.reserve( keys.size() );
+    for ( size_t i = 0; i < keys.size(); i++ ) {
+      const uint64_t size = get_le<uint64_t>( message.data() + 8 * i );
+      if ( objects.length() < size ) {
+        throw std::runtime_error( "truncated multi put" );
+      }
+      entries.emplace_back( keys[i], objects.substr( 0, size ) );
+      objects.remove_prefix( size );
+    }
+    return entries;
+  };
+  // answer to a multi put: 'p', [count:4], then '0' or '5' per key
+  std::string generate_local_multi_put_result( const std::vector<bool>& stored )
+  {
+    std::string message = generate_local( 'p', 4 + stored.size(), {} );
+    put_le<uint32_t>( message.data() + 5, stored.size() );
+    for ( size_t i = 0; i < stored.size(); i++ ) {
+      message[9 + i] = stored[i] ? '0' : '5';
+    }
     return message;
   };
-  std::tuple<std::string, int> parse_local_remote_lookup( std::string message )
+
+  std::tuple<std::string, int> parse_local_remote_lookup( std::string_view message )
   {
-    int size = *reinterpret_cast<const int*>( ( message.c_str() + 1 ) );
-    std::cout << "size " << size << ";" << std::endl;
-    std::string name = message.substr( 5, size );
-    int id = *reinterpret_cast<const int*>( ( message.c_str() + 5 + size ) );
+    const uint32_t size = get_le<uint32_t>( message.data() + 1 );
+    LOG( Debug ) << "size " << size << ";";
+    std::string name { message.substr( 5, size ) };
+    int id = get_le<int32_t>( message.data() + 5 + size );
     return { name, id };
   }
-};
\ No newline at end of file
+};
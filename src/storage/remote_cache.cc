@@ -0,0 +1,159 @@
+#include "remote_cache.hh"
+
+RemoteCache::RemoteCache( ConcurrentLocalStorage& storage, size_t capacity, Clock::duration negative_ttl )
+  : storage_( storage )
+  , capacity_( capacity )
+  , negative_ttl_( negative_ttl )
+{}
+
+void RemoteCache::erase( std::unordered_map<std::string, Entry>::iterator entry, bool drop_copy )
+{
+  if ( entry->second.present ) {
+    order_.erase( { entry->second.priority, entry->second.last_used, entry->first } );
+    stats_.cached_bytes -= entry->second.size;
+    if ( drop_copy ) {
+      // still readable through any handles given out for it
+      storage_.delete_object( entry->first );
+    }
+  }
+  entries_.erase( entry );
+}
+
+void RemoteCache::evict_one()
+{
+  erase( entries_.find( std::get<2>( *order_.begin() ) ) );
+  stats_.evictions++;
+}
+
+std::optional<BlobHandle> RemoteCache::find( int origin, std::string_view name )
+{
+  std::lock_guard<std::mutex> lock { mutex_ };
+  auto entry = entries_.find( std::string { name } );
+  if ( entry == entries_.end() or not entry->second.present ) {
+    stats_.misses++;
+    return {};
+  }
+  if ( entry->second.origin != origin ) {
+    // a copy of another peer's object would keep this one from being stored
+    erase( entry );
+    stats_.misses++;
+    return {};
+  }
+
+  auto handle = storage_.acquire( name );
+  if ( not handle.has_value() ) {
+    // deleted from the storage behind the cache's back
+    erase( entry, false );
+    stats_.misses++;
+    return {};
+  }
+
+  Entry& e = entry->second;
+  order_.erase( { e.priority, e.last_used, entry->first } );
+  e.priority++;
+  e.last_used = ++tick_;
+  order_.insert( { e.priority, e.last_used, entry->first } );
+  stats_.hits++;
+  return handle;
+}
+
+bool RemoteCache::known_missing( int origin, std::string_view name )
+{
+  std::lock_guard<std::mutex> lock { mutex_ };
+  auto entry = entries_.find( std::string { name } );
+  if ( entry == entries_.end() or entry->second.present or entry->second.origin != origin ) {
+    return false;
+  }
+  if ( entry->second.expires <= Clock::now() ) {
+    erase( entry );
+    return false;
+  }
+  stats_.negative_hits++;
+  return true;
+}
+
+void RemoteCache::insert( int origin, std::string_view name, size_t size )
+{
+  std::lock_guard<std::mutex> lock { mutex_ };
+  std::string key { name };
+  auto existing = entries_.find( key );
+  if ( existing != entries_.end() ) {
+    // the storage holds one object per name: this copy replaces whatever was known
+    erase( existing, false );
+  }
+
+  Entry entry { origin, true, size, 0, ++tick_, {} };
+  order_.insert( { entry.priority, entry.last_used, key } );
+  entries_.insert( { std::move( key ), entry } );
+  stats_.cached_bytes += size;
+
+  // the newest copy has no hits yet, but is the most recently used of those that have none
+  while ( stats_.cached_bytes > capacity_ ) {
+    evict_one();
+  }
+}
+
+void RemoteCache::insert_missing( int origin, std::string_view name )
+{
+  std::lock_guard<std::mutex> lock { mutex_ };
+  const auto now = Clock::now();
+
+  // forget the answers that have run out, so they don't pile up
+  while ( not expiry_.empty() and expiry_.front().first <= now ) {
+    auto expired = entries_.find( expiry_.front().second );
+    if ( expired != entries_.end() and not expired->second.present
+         and expired->second.expires == expiry_.front().first ) {
+      entries_.erase( expired );
+    }
+    expiry_.pop_front();
+  }
+
+  std::string key { name };
+  auto existing = entries_.find( key );
+  if ( existing != entries_.end() ) {
+    // one entry per name: a copy of something the peer no longer has is stale anyway
+    erase( existing );
+  }
+
+  Entry entry { origin, false, 0, 0, 0, now + negative_ttl_ };
+  expiry_.emplace_back( entry.expires, key );
+  entries_.insert( { std::move( key ), entry } );
+}
+
+void RemoteCache::invalidate( int origin, std::string_view name )
+{
+  std::lock_guard<std::mutex> lock { mutex_ };
+  auto entry = entries_.find( std::string { name } );
+  if ( entry == entries_.end() or entry->second.origin != origin ) {
+    return;
+  }
+  erase( entry );
+  stats_.invalidations++;
+}
+
+void RemoteCache::forget( std::string_view name )
+{
+  std::lock_guard<std::mutex> lock { mutex_ };
+  auto entry = entries_.find( std::string { name } );
+  if ( entry != entries_.end() ) {
+    erase( entry, false );
+    stats_.invalidations++;
+  }
+}
+
+bool RemoteCache::evict( size_t size )
+{
+  std::lock_guard<std::mutex> lock { mutex_ };
+  const uint64_t target = stats_.cached_bytes > size ? stats_.cached_bytes - size : 0;
+  const bool any = not order_.empty();
+  while ( stats_.cached_bytes > target and not order_.empty() ) {
+    evict_one();
+  }
+  return any;
+}
+
+RemoteCacheStats RemoteCache::stats()
+{
+  std::lock_guard<std::mutex> lock { mutex_ };
+  return stats_;
+}
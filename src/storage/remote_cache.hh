@@ -0,0 +1,95 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+
+#include "storage/local_storage.hh"
+
+// how well the cache of remote objects is doing
+struct RemoteCacheStats
+{
+  uint64_t hits {};
+  uint64_t negative_hits {}; // lookups answered with "not found" without asking the peer
+  uint64_t misses {};
+  uint64_t evictions {};
+  uint64_t invalidations {};
+  uint64_t cached_bytes {};
+};
+
+// remembers which objects in the storage are copies fetched from peers, so a later lookup of the same object
+// is answered from the copy instead of going back to the peer. answers that an object does not exist are
+// remembered too, for a short while (the peer may still create it).
+// copies are dropped when the peer deletes the object, and least valuable first (fewest hits, then least
+// recently used) whenever they would take more than the cache's capacity or the storage needs room for another.
+// the copies' bytes live in the storage under the object's own name: the cache only keeps track of them.
+// every call is atomic.
+class RemoteCache
+{
+public:
+  using Clock = std::chrono::steady_clock;
+  static constexpr Clock::duration DEFAULT_NEGATIVE_TTL = std::chrono::seconds( 1 );
+
+private:
+  struct Entry
+  {
+    int origin {};        // the peer it came from
+    bool present {};      // false for an object the peer said it does not have
+    size_t size {};       // of the local copy
+    uint64_t priority {}; // hits on the copy; copies with fewer go first
+    uint64_t last_used {};
+    Clock::time_point expires {}; // for an object that is not present
+  };
+
+  ConcurrentLocalStorage& storage_;
+  const size_t capacity_;
+  const Clock::duration negative_ttl_;
+
+  std::mutex mutex_ {};
+  std::unordered_map<std::string, Entry> entries_ {};
+  // the copies in eviction order: (priority, last use, name)
+  std::set<std::tuple<uint64_t, uint64_t, std::string>> order_ {};
+  // the "not present" entries in the order they expire
+  std::deque<std::pair<Clock::time_point, std::string>> expiry_ {};
+  uint64_t tick_ { 0 };
+  RemoteCacheStats stats_ {};
+
+  // forgets an entry, dropping its copy from the storage if `drop_copy` and it has one. lock held.
+  void erase( std::unordered_map<std::string, Entry>::iterator entry, bool drop_copy = true );
+  // drops the least valuable copy. lock held.
+  void evict_one();
+
+public:
+  RemoteCache( ConcurrentLocalStorage& storage,
+               size_t capacity,
+               Clock::duration negative_ttl = DEFAULT_NEGATIVE_TTL );
+
+  // the copy of `name` fetched from peer `origin`, if there still is one
+  std::optional<BlobHandle> find( int origin, std::string_view name );
+  // whether peer `origin` said recently that it has no `name`
+  bool known_missing( int origin, std::string_view name );
+
+  // remembers that `name` (already committed to the storage, `size` bytes) is a copy of peer `origin`'s object
+  void insert( int origin, std::string_view name, size_t size );
+  // remembers for a while that peer `origin` has no `name`
+  void insert_missing( int origin, std::string_view name );
+  // forgets whatever is known about peer `origin`'s `name`, dropping the local copy of it
+  void invalidate( int origin, std::string_view name );
+  // forgets `name` without touching the storage (for when the object there is deleted by other means)
+  void forget( std::string_view name );
+
+  // drops copies, least valuable first, until at least `size` bytes of them are gone (e.g. because the storage
+  // is too full to take a new object); returns whether anything was dropped
+  bool evict( size_t size );
+
+  RemoteCacheStats stats();
+
+  RemoteCache( const RemoteCache& ) = delete;
+  RemoteCache& operator=( const RemoteCache& ) = delete;
+};
@@ -0,0 +1,66 @@
+#include "shared_arena.hh"
+
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util/exception.hh"
+
+using namespace std;
+
+namespace {
+
+size_t round_to_pages( const size_t size )
+{
+  const size_t page_size = sysconf( _SC_PAGESIZE );
+  return ( size + page_size - 1 ) / page_size * page_size;
+}
+
+}
+
+SharedArena::SharedArena( const size_t capacity )
+  : fd_( [&] {
+    FileDescriptor fd { SystemCall( "memfd_create", memfd_create( "punch-a-lambda-storage", 0 ) ) };
+    SystemCall( "ftruncate", ftruncate( fd.fd_num(), round_to_pages( capacity ) ) );
+    return fd;
+  }() )
+  , mapping_( nullptr, round_to_pages( capacity ), PROT_READ | PROT_WRITE, MAP_SHARED, fd_.fd_num() )
+{}
+
+char* SharedArena::carve( const size_t size )
+{
+  const size_t rounded = round_to_pages( size );
+  size_t used = used_.load( memory_order_relaxed );
+  do {
+    if ( rounded > capacity() - used ) {
+      return nullptr;
+    }
+  } while ( not used_.compare_exchange_weak( used, used + rounded, memory_order_relaxed ) );
+
+  return base() + used;
+}
+
+void SharedArena::release( char* ptr, const size_t size )
+{
+  SystemCall( "madvise", madvise( ptr, round_to_pages( size ), MADV_REMOVE ) );
+}
+
+bool SharedArena::contains( const void* ptr ) const
+{
+  const char* p = static_cast<const char*>( ptr );
+  return p >= base() and p < base() + capacity();
+}
+
+uint64_t SharedArena::offset_of( const void* ptr ) const
+{
+  if ( not contains( ptr ) ) {
+    throw out_of_range( "pointer is outside of the shared arena" );
+  }
+
+  return static_cast<const char*>( ptr ) - base();
+}
+
+string SharedArena::path() const
+{
+  return "/proc/" + to_string( getpid() ) + "/fd/" + to_string( fd_.fd_num() );
+}
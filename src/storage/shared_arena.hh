@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "util/file_descriptor.hh"
+#include "util/ring_buffer.hh"
+
+//! A memfd-backed region that co-located clients can map to read objects in place.
+//! \details The whole capacity is reserved up front, but pages only get backed by memory
+//! once they are touched. Clients map the file behind path() read-only and address objects
+//! by their offset from the start of the arena.
+class SharedArena
+{
+private:
+  FileDescriptor fd_;
+  MMap_Region mapping_;
+  std::atomic<size_t> used_ { 0 }; // carved by every shard's allocator, from any thread
+
+public:
+  SharedArena( const size_t capacity );
+
+  char* base() const { return mapping_.addr(); }
+  size_t capacity() const { return mapping_.length(); }
+  size_t used() const { return used_; }
+
+  //! Hands out the next `size` bytes of the arena, or nullptr once it is exhausted (thread-safe)
+  char* carve( const size_t size );
+
+  //! Gives the pages of a no-longer-used range back to the kernel (they read as zero after)
+  void release( char* ptr, const size_t size );
+
+  bool contains( const void* ptr ) const;
+  uint64_t offset_of( const void* ptr ) const;
+
+  //! A path co-located processes can open to map the arena
+  std::string path() const;
+};
@@ -1,9 +1,26 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "clienthandler.hh"
+#include "hash_ring.hh"
 #include "local_storage.hh"
+#include "message.hh"
+#include "remote_cache.hh"
+#include "net/socket.hh"
+#include "util/eventfd.hh"
+#include "util/histogram.hh"
+#include "util/log.hh"
+#include "util/pipe.hh"
+#include "util/temp_file.hh"
 
 using namespace std::chrono;
 
@@ -38,32 +55,94 @@ void test_new_creation2()
   delete a;
 }
 
-void stress_test_new_creation()
+double churn_objects( LocalStorage& storage, const size_t object_size, const int rounds )
 {
   auto t1 = high_resolution_clock::now();
-  auto a = new LocalStorage( 1024 * 1024 * 1024 );
+  for ( int i = 0; i < rounds; i++ ) {
+    void* ptr = storage.new_object( "bump", object_size ).value();
+    memset( ptr, 1, object_size );
+    storage.delete_object( "bump" );
+  }
+  auto t2 = high_resolution_clock::now();
+  duration<double, std::milli> ms_double = t2 - t1;
+  return ms_double.count();
+}
 
-  for ( int i = 0; i < 1000; i++ ) {
-    void* ptr = a->new_object( "bump", 1024 ).value();
-    memset( ptr, 1, 1024 );
-    a->delete_object( "bump" );
+// many small shuffle blobs alive at once, freed in a different order than allocated
+double bulk_objects( LocalStorage& storage, const int count )
+{
+  std::vector<std::string> keys;
+  keys.reserve( count );
+  for ( int i = 0; i < count; i++ ) {
+    keys.push_back( "shuffle-" + std::to_string( i ) );
+  }
+
+  auto t1 = high_resolution_clock::now();
+  for ( int round = 0; round < 4; round++ ) {
+    for ( int i = 0; i < count; i++ ) {
+      const size_t size = 32 + ( i * 7919 ) % 2048;
+      void* ptr = storage.new_object( keys[i], size ).value();
+      memset( ptr, 1, size );
+    }
+    for ( int i = 0; i < count; i += 2 ) {
+      storage.delete_object( keys[i] );
+    }
+    for ( int i = 1; i < count; i += 2 ) {
+      storage.delete_object( keys[i] );
+    }
   }
   auto t2 = high_resolution_clock::now();
   duration<double, std::milli> ms_double = t2 - t1;
-  printf( " == object storage allocation == \n== at %.5f milliseconds == \n ", ms_double.count() );
+  return ms_double.count();
+}
 
-  delete a;
+void stress_test_new_creation()
+{
+  LocalStorage malloc_storage( 1024 * 1024 * 1024 );
+  LocalStorage slab_storage( 1024 * 1024 * 1024, std::make_unique<SlabAllocator>() );
+
+  printf( " == object storage allocation (malloc) == \n== at %.5f milliseconds == \n ",
+          churn_objects( malloc_storage, 1024, 1000 ) );
+  printf( " == object storage allocation (slab) == \n== at %.5f milliseconds == \n ",
+          churn_objects( slab_storage, 1024, 1000 ) );
 
-  t1 = high_resolution_clock::now();
+  auto t1 = high_resolution_clock::now();
   for ( int i = 0; i < 1000; i++ ) {
     void* ptr = malloc( 1024 );
     doNotOptimize( ptr );
     memset( ptr, 1, 1024 );
     free( ptr );
   }
-  t2 = high_resolution_clock::now();
-  ms_double = t2 - t1;
+  auto t2 = high_resolution_clock::now();
+  duration<double, std::milli> ms_double = t2 - t1;
   printf( " == C allocation == \n== at %.5f milliseconds == \n ", ms_double.count() );
+
+  printf( " == 200k small objects x4 (malloc) == \n== at %.5f milliseconds == \n ",
+          bulk_objects( malloc_storage, 200000 ) );
+  printf( " == 200k small objects x4 (slab) == \n== at %.5f milliseconds == \n ",
+          bulk_objects( slab_storage, 200000 ) );
+
+  require( malloc_storage.get_total_size() == 0 );
+  require( slab_storage.get_total_size() == 0 );
+}
+
+void test_slab_accounting()
+{
+  LocalStorage a( 4096, std::make_unique<SlabAllocator>() );
+  // 3000 bytes rounds up to a 4 KiB block, but only 3000 bytes count against max_size_
+  require( a.new_object( "first", 3000 ).has_value() );
+  require( a.get_total_size() == 3000 );
+  require( a.new_object( "second", 1096 ).has_value() );
+  require( not a.new_object( "third", 1 ).has_value() );
+  require( not a.new_object( "first", 0 ).has_value() );
+  require( a.get_total_size() == 4096 );
+
+  require( a.delete_object( "first" ) == 0 );
+  require( a.grow( "second", 3000 ) == 0 );
+  require( a.locate( "second" ).value().size == 4096 );
+  require( a.get_total_size() == 4096 );
+  require( a.delete_object( "second" ) == 0 );
+  require( a.get_total_size() == 0 );
 }
 
 void test_add_alias()
@@ -92,6 +171,1571 @@ void test_grow()
   delete a;
 }
 
+void test_pinned_delete()
+{
+  auto arena = std::make_shared<SharedArena>( 64 * 1024 * 1024 );
+  LocalStorage a( 1024 * 1024, std::make_unique<SlabAllocator>( arena, 16 * 1024 * 1024 ) );
+  void* ptr = a.new_object( "bump", 1000 ).value();
+  memset( ptr, 7, 1000 );
+  require( arena->contains( ptr ) );
+
+  auto pinned = a.pin( "bump" );
+  require( pinned.has_value() and pinned.value().ptr == ptr );
+  // growing adds a chunk, it does not move the pinned bytes
+  require( a.grow( "bump", 10 ) == 0 );
+  require( a.locate( "bump" ).value().ptr == ptr );
+
+  // the name goes away right away, the memory only once the reader is done
+  require( a.delete_object( "bump" ) == 0 );
+  require( not a.locate( "bump" ).has_value() );
+  require( a.get_total_size() == 1010 );
+  require( static_cast<char*>( ptr )[999] == 7 );
+
+  a.unpin( ptr );
+  require( a.get_total_size() == 0 );
+}
+
+void test_arena_churn()
+{
+  // large objects of many sizes, freed and allocated over and over: once they are all gone, the free spans have
+  // merged back into one, and an object the size of everything carved fits
+  auto arena = std::make_shared<SharedArena>( 256 * 1024 * 1024 );
+  SlabAllocator allocator( arena );
+  std::mt19937 rng( 1 );
+  std::vector<std::pair<void*, size_t>> live;
+  auto fill = [&] {
+    while ( true ) {
+      const size_t size = SlabAllocator::MAX_CLASS_SIZE + 1 + rng() % ( 4 * 1024 * 1024 );
+      void* ptr = allocator.allocate( size );
+      if ( ptr == nullptr ) {
+        return;
+      }
+      live.emplace_back( ptr, size );
+    }
+  };
+
+  fill();
+  for ( int round = 0; round < 20; round++ ) {
+    std::shuffle( live.begin(), live.end(), rng );
+    for ( size_t i = live.size() / 2; i < live.size(); i++ ) {
+      allocator.deallocate( live[i].first, live[i].second );
+    }
+    live.resize( live.size() / 2 );
+    fill();
+  }
+  for ( const auto& [ptr, size] : live ) {
+    allocator.deallocate( ptr, size );
+  }
+
+  require( arena->used() > arena->capacity() / 2 );
+  void* everything = allocator.allocate( arena->used() );
+  require( everything == arena->base() );
+  allocator.deallocate( everything, arena->used() );
+}
+
+// pushes `total` bytes over loopback TCP out of one `blob_size` blob, the way the storage server serves a remote
+// lookup, and returns GB/s
+double loopback_transmit( const size_t blob_size, const size_t total, const bool zerocopy )
+{
+  TCPSocket listener;
+  listener.set_reuseaddr();
+  listener.bind( { "127.0.0.1", 0 } );
+  listener.listen();
+
+  std::thread receiver( [&] {
+    TCPSocket connection = listener.accept();
+    std::string buffer( 1024 * 1024, '\0' );
+    while ( not connection.eof() ) {
+      connection.read( { buffer } );
+    }
+  } );
+
+  TCPSocket sender;
+  sender.connect( listener.local_address() );
+  if ( zerocopy ) {
+    sender.set_zerocopy();
+  }
+
+  std::string blob( blob_size, 'x' );
+  uint32_t sends = 0;
+  uint32_t completed = 0;
+
+  auto t1 = high_resolution_clock::now();
+  for ( size_t sent = 0; sent < total; ) {
+    std::string_view remaining { blob };
+    remaining = remaining.substr( sent % blob_size, total - sent );
+    if ( zerocopy ) {
+      sent += sender.send_zerocopy( { remaining } );
+      sends++;
+      while ( auto completion = sender.recv_zerocopy_completion() ) {
+        completed = completion->last_id + 1;
+      }
+    } else {
+      sent += sender.write( remaining );
+    }
+  }
+  // the blob may only be reused once the kernel has let go of it
+  while ( completed < sends ) {
+    if ( auto completion = sender.recv_zerocopy_completion() ) {
+      completed = completion->last_id + 1;
+    }
+  }
+  sender.shutdown( SHUT_WR );
+  receiver.join();
+  auto t2 = high_resolution_clock::now();
+
+  duration<double> seconds = t2 - t1;
+  return total / seconds.count() / 1e9;
+}
+
+void bench_loopback_transmit()
+{
+  const size_t total = 4ul * 1024 * 1024 * 1024;
+  for ( const size_t blob_size : { 256ul * 1024, 64ul * 1024 * 1024 } ) {
+    printf( " == loopback transmit, %zu KiB blobs (copy) == \n== at %.3f GB/s == \n ",
+            blob_size / 1024,
+            loopback_transmit( blob_size, total, false ) );
+    printf( " == loopback transmit, %zu KiB blobs (MSG_ZEROCOPY) == \n== at %.3f GB/s == \n ",
+            blob_size / 1024,
+            loopback_transmit( blob_size, total, true ) );
+  }
+}
+
+enum class RequestLogging
+{
+  Stream,   // std::cout, ending every line with std::endl, as the storage server used to
+  Async,    // through AsyncLogSink
+  CompiledOut // below LOG_LEVEL
+};
+
+// small lookups answered by a ClientHandler over loopback, logging what the storage server logs per request: a
+// line per read and per write, and two per message. the client pipelines batches of 32. returns requests/s.
+double request_rate( const RequestLogging logging, const int requests, TempFile& log_file )
+{
+  TCPSocket listener;
+  listener.set_reuseaddr();
+  listener.bind( { "127.0.0.1", 0 } );
+  listener.listen();
+
+  auto frame = []( std::string_view message ) {
+    std::string framed( 4 + message.size(), '\0' );
+    put_le<uint32_t>( framed.data(), framed.size() );
+    message.copy( framed.data() + 4, message.size() );
+    return framed;
+  };
+  const std::string response = frame( "0k" );
+
+  const int batch = 32;
+  std::thread client( [&] {
+    TCPSocket socket;
+    socket.connect( listener.local_address() );
+    std::string requests_out;
+    for ( int i = 0; i < batch; i++ ) {
+      requests_out += frame( "1key" );
+    }
+    std::string buffer( 4096, '\0' );
+    for ( int sent = 0; sent < requests; sent += batch ) {
+      socket.write_all( requests_out );
+      for ( size_t received = 0; received < batch * response.size(); ) {
+        received += socket.read( { buffer.data(), batch * response.size() - received } );
+      }
+    }
+  } );
+
+  ClientHandler server { listener.accept(), RingBuffer( 4096 ), RingBuffer( 4096 ) };
+  std::ofstream stream_log { log_file.name() };
+  std::streambuf* const stdout_buffer = std::cout.rdbuf( stream_log.rdbuf() );
+  AsyncLogSink::instance().set_output( log_file.fd().fd_num() );
+
+  auto log = [&]( std::string_view what, std::string_view detail ) {
+    switch ( logging ) {
+      case RequestLogging::Stream:
+        std::cout << what << detail << std::endl;
+        break;
+      case RequestLogging::Async:
+        LOG( Info ) << what << detail;
+        break;
+      case RequestLogging::CompiledOut:
+        LOG( Debug ) << what << detail;
+        break;
+    }
+  };
+
+  int handled = 0;
+  server.store_header_length_ = []( std::string_view ) { return std::optional<size_t> {}; };
+  server.handle_frame_ = [&]( const Frame& request ) {
+    log( "message received ", request.header );
+    log( "looking up:", request.header.substr( 1 ) );
+    server.outbound_messages_.push_back( { plaintext, { {}, response } } );
+    handled++;
+  };
+
+  auto t1 = high_resolution_clock::now();
+  while ( handled < requests or server.wants_to_send() ) {
+    if ( server.can_parse() ) {
+      server.parse();
+    } else if ( server.wants_to_send() ) {
+      server.produce();
+      log( "write ", {} );
+      server.send();
+    } else {
+      log( "read ", {} );
+      server.receive();
+    }
+  }
+  client.join();
+  auto t2 = high_resolution_clock::now();
+
+  std::cout.rdbuf( stdout_buffer );
+  AsyncLogSink::instance().flush();
+  AsyncLogSink::instance().set_output( STDOUT_FILENO );
+
+  duration<double> seconds = t2 - t1;
+  return requests / seconds.count();
+}
+
+void bench_request_rate( const int requests )
+{
+  TempFile log_file { "/tmp/request-log" };
+  for ( const auto& [logging, name] : { std::pair { RequestLogging::Stream, "std::cout/std::endl" },
+                                        std::pair { RequestLogging::Async, "async sink" },
+                                        std::pair { RequestLogging::CompiledOut, "compiled out" } } ) {
+    const uint64_t dropped = AsyncLogSink::instance().dropped();
+    printf( " == small lookups over loopback, logging with %s == \n== %.0f requests/s (%lu log lines dropped) == \n ",
+            name,
+            request_rate( logging, requests, log_file ),
+            AsyncLogSink::instance().dropped() - dropped );
+  }
+}
+
+void test_interest_group()
+{
+  EventLoop loop;
+  int asked = 0;
+  int pending = 0;
+  auto group = loop.make_interest_group();
+  group.add( loop.add_rule(
+    "grouped", [&] { pending--; }, [&] { return asked++, pending > 0; } ) );
+  // keeps the loop from exiting
+  EventFD never {};
+  loop.add_rule( "never", Direction::In, never, [] {}, [] { return true; } );
+
+  // asked once when placed, then not again until notified
+  loop.wait_next_event( 0 );
+  loop.wait_next_event( 0 );
+  require( asked == 1 );
+
+  pending = 3;
+  loop.wait_next_event( 0 );
+  require( asked == 1 and pending == 3 );
+
+  // once notified, it is asked until it has nothing left to do
+  group.notify();
+  loop.wait_next_event( 0 );
+  require( pending == 0 and asked == 5 );
+  loop.wait_next_event( 0 );
+  require( asked == 5 );
+}
+
+// round trips on one connection through an event loop that also has `idle` connections with nothing to do, each
+// with the rules the storage server gives a client, with their interest polled or grouped. returns round trips/s.
+double idle_connections_round_trips( const int idle, const bool grouped, const int round_trips )
+{
+  TCPSocket listener;
+  listener.set_reuseaddr();
+  listener.bind( { "127.0.0.1", 0 } );
+  listener.listen();
+
+  EventLoop loop;
+  const size_t parse_category = loop.add_category( "receive messages" );
+  const size_t answers_category = loop.add_category( "buffer to responses" );
+  const size_t produce_category = loop.add_category( "write responses" );
+  const size_t http_category = loop.add_category( "http" );
+
+  auto frame = []( std::string_view message ) {
+    std::string framed( 4 + message.size(), '\0' );
+    put_le<uint32_t>( framed.data(), framed.size() );
+    message.copy( framed.data() + 4, message.size() );
+    return framed;
+  };
+  const std::string request = frame( "1key" );
+  const std::string response = frame( "0k" );
+  int handled = 0;
+  std::list<ClientHandler> connections;
+  auto add_connection = [&]( TCPSocket&& socket ) {
+    auto& conn
+      = connections.emplace_back( ClientHandler { std::move( socket ), RingBuffer( 4096 ), RingBuffer( 4096 ) } );
+    conn.socket_.set_blocking( false );
+    conn.store_header_length_ = []( std::string_view ) { return std::optional<size_t> {}; };
+    conn.handle_frame_ = [&]( const Frame& ) {
+      conn.outbound_messages_.push_back( { plaintext, { {}, response } } );
+      handled++;
+    };
+
+    const EventLoop::RuleHandle rules[] = {
+      loop.add_rule(
+        parse_category, [&conn] { conn.parse(); }, [&conn] { return conn.can_parse(); } ),
+      loop.add_rule(
+        answers_category,
+        [] {},
+        [&conn] {
+          return not conn.ordered_answers.empty()
+                 and conn.buffered_remote_responses_.count( conn.ordered_answers.front() ) > 0;
+        } ),
+      loop.add_rule(
+        produce_category, [&conn] { conn.produce(); }, [&conn] { return conn.can_produce(); } ),
+      loop.add_rule(
+        http_category,
+        conn.socket_,
+        [&conn] { conn.receive(); },
+        [&conn] { return conn.wants_to_receive(); },
+        [&conn] { conn.send(); },
+        [&conn] { return conn.wants_to_send(); } ),
+    };
+    if ( grouped ) {
+      conn.interest_group_ = loop.make_interest_group();
+      for ( const auto& rule : rules ) {
+        conn.interest_group_.add( rule );
+      }
+    }
+  };
+
+  std::vector<TCPSocket> idle_clients;
+  for ( int i = 0; i < idle; i++ ) {
+    idle_clients.emplace_back().connect( listener.local_address() );
+    add_connection( listener.accept() );
+  }
+
+  std::thread client( [&] {
+    TCPSocket socket;
+    socket.connect( listener.local_address() );
+    std::string buffer( response.size(), '\0' );
+    for ( int i = 0; i < round_trips; i++ ) {
+      socket.write_all( request );
+      for ( size_t received = 0; received < response.size(); ) {
+        received += socket.read( { buffer.data() + received, response.size() - received } );
+      }
+    }
+  } );
+  add_connection( listener.accept() );
+
+  auto t1 = high_resolution_clock::now();
+  while ( handled < round_trips or connections.back().wants_to_send() ) {
+    loop.wait_next_event( -1 );
+  }
+  client.join();
+  auto t2 = high_resolution_clock::now();
+
+  duration<double> seconds = t2 - t1;
+  return round_trips / seconds.count();
+}
+
+void bench_idle_connections( const int round_trips )
+{
+  for ( const int idle : { 0, 1000 } ) {
+    for ( const bool grouped : { false, true } ) {
+      printf( " == round trips with %d idle connections, interest %s == \n== %.0f round trips/s == \n ",
+              idle,
+              grouped ? "grouped" : "polled",
+              idle_connections_round_trips( idle, grouped, round_trips ) );
+    }
+  }
+}
+
+struct BackendResult
+{
+  double requests_per_second;
+  double system_calls_per_request;
+};
+
+// `clients` threads each keep `pipeline` requests in flight against one loop, whose connections have the loop do
+// their I/O (EventLoop::LoopIO)
+BackendResult backend_round_trips( const EventLoop::Backend backend,
+                                   const bool registered,
+                                   const int clients,
+                                   const int pipeline,
+                                   const int requests )
+{
+  TCPSocket listener;
+  listener.set_reuseaddr();
+  listener.bind( { "127.0.0.1", 0 } );
+  listener.listen();
+
+  EventLoop loop { backend };
+  const size_t parse_category = loop.add_category( "receive messages" );
+  const size_t produce_category = loop.add_category( "write responses" );
+  const size_t http_category = loop.add_category( "http" );
+
+  auto frame = []( std::string_view message ) {
+    std::string framed( 4 + message.size(), '\0' );
+    put_le<uint32_t>( framed.data(), framed.size() );
+    message.copy( framed.data() + 4, message.size() );
+    return framed;
+  };
+  const std::string request = frame( "1key" );
+  const std::string response = frame( "0k" );
+  const int per_client = requests / clients / pipeline * pipeline;
+  int handled = 0;
+
+  std::vector<std::thread> client_threads;
+  for ( int i = 0; i < clients; i++ ) {
+    client_threads.emplace_back( [&] {
+      TCPSocket socket;
+      socket.connect( listener.local_address() );
+      std::string batch;
+      for ( int j = 0; j < pipeline; j++ ) {
+        batch += request;
+      }
+      std::string buffer( batch.size(), '\0' );
+      const size_t expected = response.size() * pipeline;
+      for ( int sent = 0; sent < per_client; sent += pipeline ) {
+        socket.write_all( batch );
+        for ( size_t received = 0; received < expected; ) {
+          received += socket.read( { buffer.data() + received, expected - received } );
+        }
+      }
+    } );
+  }
+
+  std::list<ClientHandler> connections;
+  for ( int i = 0; i < clients; i++ ) {
+    auto& conn = connections.emplace_back(
+      ClientHandler { listener.accept(), RingBuffer( 65536 ), RingBuffer( 65536 ) } );
+    conn.socket_.set_blocking( false );
+    conn.store_header_length_ = []( std::string_view ) { return std::optional<size_t> {}; };
+    conn.handle_frame_ = [&]( const Frame& ) {
+      conn.outbound_messages_.push_back( { plaintext, { {}, response } } );
+      handled++;
+    };
+    if ( registered ) {
+      loop.register_buffer( conn.read_buffer_.mapped_region() );
+      loop.register_buffer( conn.send_buffer_.mapped_region() );
+    }
+
+    const EventLoop::RuleHandle rules[] = {
+      loop.add_rule(
+        parse_category, [&conn] { conn.parse(); }, [&conn] { return conn.can_parse(); } ),
+      loop.add_rule(
+        produce_category, [&conn] { conn.produce(); }, [&conn] { return conn.can_produce(); } ),
+      loop.add_rule(
+        http_category,
+        EventLoop::LoopIO,
+        conn.socket_,
+        [&conn] { return conn.receive_target(); },
+        [&conn]( size_t n ) { conn.received( n ); },
+        [&conn] { return conn.wants_to_receive(); },
+        [&conn]( std::vector<std::string_view>& sources ) { conn.send_sources( sources ); },
+        [&conn]( size_t n ) { conn.sent( n ); },
+        [&conn] { return conn.wants_to_send(); } ),
+    };
+    conn.interest_group_ = loop.make_interest_group();
+    for ( const auto& rule : rules ) {
+      conn.interest_group_.add( rule );
+    }
+  }
+
+  const uint64_t calls_before = loop.system_calls();
+  auto t1 = high_resolution_clock::now();
+  auto busy = [&] {
+    return handled < per_client * clients
+           or std::any_of( connections.begin(), connections.end(), []( auto& c ) { return c.wants_to_send(); } );
+  };
+  while ( busy() ) {
+    loop.wait_next_event( -1 );
+  }
+  for ( auto& thread : client_threads ) {
+    thread.join();
+  }
+  auto t2 = high_resolution_clock::now();
+
+  duration<double> seconds = t2 - t1;
+  return { handled / seconds.count(), double( loop.system_calls() - calls_before ) / handled };
+}
+
+void bench_io_backends( const int requests )
+{
+  const std::tuple<const char*, EventLoop::Backend, bool> backends[] = {
+    { "epoll", EventLoop::Backend::Epoll, false },
+    { "io_uring", EventLoop::Backend::IoUring, false },
+    { "io_uring, registered buffers", EventLoop::Backend::IoUring, true },
+  };
+  for ( const auto& [name, backend, registered] : backends ) {
+    for ( const auto& [clients, pipeline] : { std::pair { 1, 1 }, std::pair { 8, 32 } } ) {
+      const auto result = backend_round_trips( backend, registered, clients, pipeline, requests );
+      printf( " == %s, %d clients x %d in flight == \n== %.0f requests/s, %.3f system calls/request == \n ",
+              name,
+              clients,
+              pipeline,
+              result.requests_per_second,
+              result.system_calls_per_request );
+    }
+  }
+}
+
+struct TransferResult
+{
+  double gigabytes_per_second;
+  double system_calls_per_megabyte;
+};
+
+// sends `bytes` over loopback TCP into a loop that reads them through a 4 KiB buffer, emptied by a rule of its own
+TransferResult bulk_transfer( const bool edge_triggered, const size_t bytes )
+{
+  TCPSocket listener;
+  listener.set_reuseaddr();
+  listener.bind( { "127.0.0.1", 0 } );
+  listener.listen();
+
+  std::thread sender( [&] {
+    TCPSocket socket;
+    socket.connect( listener.local_address() );
+    const std::string chunk( 1 << 20, 'x' );
+    for ( size_t sent = 0; sent < bytes; sent += chunk.size() ) {
+      socket.write_all( std::string_view { chunk }.substr( 0, bytes - sent ) );
+    }
+  } );
+  TCPSocket socket = listener.accept();
+  socket.set_blocking( false );
+
+  EventLoop loop;
+  std::string buffer( 4096, '\0' );
+  size_t filled = 0;
+  size_t received = 0;
+  auto read_some = [&] { filled += socket.read( { buffer.data() + filled, buffer.size() - filled } ); };
+  auto wants_to_read = [&] { return filled < buffer.size() and received + filled < bytes; };
+
+  loop.add_rule( "consume", [&] { received += std::exchange( filled, 0 ); }, [&] { return filled > 0; } );
+  if ( edge_triggered ) {
+    loop.add_rule(
+      "receive",
+      EventLoop::EdgeTriggered,
+      socket,
+      [&] {
+        const unsigned blocked = socket.blocked_read_count();
+        while ( wants_to_read() and not socket.eof() and socket.blocked_read_count() == blocked ) {
+          read_some();
+        }
+      },
+      wants_to_read,
+      [] {},
+      [] { return false; } );
+  } else {
+    loop.add_rule( "receive", Direction::In, socket, read_some, wants_to_read );
+  }
+
+  auto t1 = high_resolution_clock::now();
+  while ( received < bytes ) {
+    require( loop.wait_next_event( 10000 ) != EventLoop::Result::Timeout );
+  }
+  auto t2 = high_resolution_clock::now();
+  sender.join();
+
+  duration<double> seconds = t2 - t1;
+  return { bytes / seconds.count() / 1e9, loop.system_calls() / ( bytes / 1048576.0 ) };
+}
+
+void test_edge_triggered()
+{
+  // the buffer fills up long before the socket is drained, so the rule loses interest with data still waiting:
+  // no new edge will come for it
+  require( bulk_transfer( true, 1 << 20 ).gigabytes_per_second > 0 );
+
+  // a callback that doesn't read until EAGAIN would never hear from the fd again
+  TCPSocket listener;
+  listener.set_reuseaddr();
+  listener.bind( { "127.0.0.1", 0 } );
+  listener.listen();
+  TCPSocket client;
+  client.connect( listener.local_address() );
+  TCPSocket socket = listener.accept();
+  socket.set_blocking( false );
+  client.write_all( "0123456789" );
+
+  EventLoop loop;
+  loop.add_rule(
+    "one byte at a time",
+    EventLoop::EdgeTriggered,
+    socket,
+    [&] {
+      char c;
+      socket.read( { &c, 1 } );
+    },
+    [] { return true; },
+    [] {},
+    [] { return false; } );
+  bool caught = false;
+  try {
+    loop.wait_next_event( 1000 );
+  } catch ( const std::runtime_error& e ) {
+    caught = std::string_view { e.what() }.find( "busy wait" ) != std::string_view::npos;
+  }
+  require( caught );
+}
+
+void bench_edge_triggered( const size_t bytes )
+{
+  for ( const bool edge_triggered : { false, true } ) {
+    const auto result = bulk_transfer( edge_triggered, bytes );
+    printf( " == bulk transfer through a 4 KiB buffer, %s == \n== %.2f GB/s, %.1f loop system calls/MiB == \n ",
+            edge_triggered ? "edge-triggered" : "level-triggered",
+            result.gigabytes_per_second,
+            result.system_calls_per_megabyte );
+  }
+}
+
+void test_empty_outbound_message()
+{
+  // an empty blob is sent as a message of its own, with nothing in it: it still has to leave the queue, alone or
+  // after others, whether sent by send() or send_all()
+  TCPSocket listener;
+  listener.set_reuseaddr();
+  listener.bind( { "127.0.0.1", 0 } );
+  listener.listen();
+  TCPSocket client;
+  client.connect( listener.local_address() );
+  ClientHandler server { listener.accept(), RingBuffer( 4096 ), RingBuffer( 4096 ) };
+  server.socket_.set_blocking( false );
+
+  const char empty_blob[1] = {};
+  for ( const bool all : { false, true } ) {
+    for ( const bool alone : { false, true } ) {
+      if ( not alone ) {
+        server.outbound_messages_.push_back( { plaintext, { {}, "header" } } );
+      }
+      server.outbound_messages_.push_back( { pointer, { { empty_blob, 0 }, {} } } );
+      for ( int tries = 0; tries < 3 and server.wants_to_send(); tries++ ) {
+        all ? server.send_all() : server.send();
+      }
+      require( not server.wants_to_send() );
+    }
+  }
+
+  std::string received( 12, '\0' );
+  for ( size_t filled = 0; filled < received.size(); ) {
+    filled += client.read( { received.data() + filled, received.size() - filled } );
+  }
+  require( received == "headerheader" );
+}
+
+void test_payload_pinned()
+{
+  // the object a store's payload is arriving into stays where it is if it is deleted meanwhile: the rest of the
+  // payload lands in it rather than in freed memory, and it only goes once the payload has been handled
+  ConcurrentLocalStorage storage( 1 << 20 );
+  TCPSocket listener;
+  listener.set_reuseaddr();
+  listener.bind( { "127.0.0.1", 0 } );
+  listener.listen();
+  TCPSocket client;
+  client.connect( listener.local_address() );
+  ClientHandler server { listener.accept(), RingBuffer( 4096 ), RingBuffer( 4096 ) };
+
+  // "S", then a 3-byte name, then the payload
+  server.store_header_length_ = []( std::string_view ) { return std::optional<size_t> { 4 }; };
+  server.allocate_payload_ = [&]( std::string_view header, size_t size ) -> std::vector<PayloadPart> {
+    const std::string name { header.substr( 1 ) };
+    if ( not storage.new_object( name, size ).has_value() ) {
+      return { { size, {} } };
+    }
+    return { { size, storage.acquire( name ) } };
+  };
+  std::string handled;
+  server.handle_frame_ = [&]( const Frame& frame ) {
+    require( frame.payload_stored );
+    handled = frame.payload;
+  };
+
+  const std::string payload( 100000, 'p' );
+  std::string framed( 8, '\0' );
+  put_le<uint32_t>( framed.data(), framed.size() + payload.size() );
+  framed.replace( 4, 4, "Sobj" );
+  framed += payload;
+
+  client.write_all( std::string_view { framed }.substr( 0, 2000 ) );
+  while ( not server.receiving_payload_ ) {
+    server.receive();
+    server.parse();
+  }
+  require( storage.delete_object( "obj" ) == 0 );
+  require( storage.get_total_size() == payload.size() );
+
+  client.write_all( std::string_view { framed }.substr( 2000 ) );
+  while ( handled.empty() ) {
+    server.receive();
+    server.parse();
+  }
+  require( handled == payload );
+  require( storage.get_total_size() == 0 );
+}
+
+void test_payload_parts()
+{
+  // a payload in parts goes to a different object each, straight from the socket, skipping the ones that have
+  // nowhere to go
+  ConcurrentLocalStorage storage( 1 << 20 );
+  TCPSocket listener;
+  listener.set_reuseaddr();
+  listener.bind( { "127.0.0.1", 0 } );
+  listener.listen();
+  TCPSocket client;
+  client.connect( listener.local_address() );
+  ClientHandler server { listener.accept(), RingBuffer( 4096 ), RingBuffer( 4096 ) };
+
+  // "M", then two 1-byte names: the first gets 30000 bytes, then 20000 are dropped, then an empty part, and the
+  // second gets the rest
+  server.store_header_length_ = []( std::string_view ) { return std::optional<size_t> { 3 }; };
+  server.allocate_payload_ = [&]( std::string_view header, size_t size ) -> std::vector<PayloadPart> {
+    std::vector<PayloadPart> parts { { 30000, {} }, { 20000, {} }, { 0, {} }, { size - 50000, {} } };
+    for ( const size_t i : { 0, 3 } ) {
+      const std::string name { header.substr( 1 + ( i != 0 ), 1 ) };
+      storage.new_object( name, parts[i].size );
+      parts[i].dest = storage.acquire( name );
+    }
+    return parts;
+  };
+  std::optional<Frame> handled;
+  server.handle_frame_ = [&]( const Frame& frame ) { handled = frame; };
+
+  std::string payload( 30000, 'a' );
+  payload += std::string( 20000, 'x' ) + std::string( 70000, 'b' );
+  std::string framed( 7, '\0' );
+  put_le<uint32_t>( framed.data(), framed.size() + payload.size() );
+  framed.replace( 4, 3, "Mab" );
+  framed += payload;
+
+  // some of it arrives with the header, and the rest is read as it comes
+  client.write_all( std::string_view { framed }.substr( 0, 1000 ) );
+  while ( not server.receiving_payload_ ) {
+    server.receive();
+    server.parse();
+  }
+  client.write_all( std::string_view { framed }.substr( 1000 ) );
+  while ( not handled.has_value() ) {
+    server.receive();
+    server.parse();
+  }
+  require( not handled->payload_stored and handled->payload.empty() );
+  const std::vector<bool> stored { true, false, false, true };
+  require( handled->parts_stored == stored );
+  auto contents = [&]( const std::string& name ) {
+    const auto handle = storage.acquire( name );
+    return std::string { static_cast<const char*>( handle->blob.ptr ), handle->blob.size };
+  };
+  require( contents( "a" ) == payload.substr( 0, 30000 ) );
+  require( contents( "b" ) == payload.substr( 50000 ) );
+  require( server.direct_payload_bytes_ > 0 );
+}
+
+void test_timers()
+{
+  EventLoop loop;
+  std::vector<int> fired;
+  bool early = false;
+  auto at = [&]( const uint64_t delay_ms, const int id ) {
+    const uint64_t deadline = Timer::timestamp_ns() + delay_ms * 1'000'000;
+    return loop.add_timer( deadline, [&, deadline, id] {
+      early = early or Timer::timestamp_ns() < deadline;
+      fired.push_back( id );
+    } );
+  };
+
+  // across a cascade from the second level, and one cancelled before and one from another's callback
+  at( 90, 4 );
+  at( 5, 1 );
+  at( 30, 2 );
+  at( 200, 0 ).cancel();
+  auto doomed = at( 60, 0 );
+  loop.add_timer( Timer::timestamp_ns() + 40'000'000, [&] {
+    doomed.cancel();
+    // already due: goes off on the next tick
+    at( 0, 3 );
+  } );
+
+  while ( fired.size() < 4 ) {
+    loop.wait_next_event( -1 );
+  }
+  std::this_thread::sleep_for( std::chrono::milliseconds( 250 ) );
+  loop.wait_next_event( 0 );
+  require( ( fired == std::vector<int> { 1, 2, 3, 4 } ) );
+  require( not early );
+
+  // a timeout shorter than the next timer still times out
+  at( 50, 5 );
+  require( loop.wait_next_event( 1 ) == EventLoop::Result::Timeout );
+  require( loop.wait_next_event( -1 ) == EventLoop::Result::Success and fired.back() == 5 );
+}
+
+void test_post()
+{
+  // more than a queue's worth from each of several threads: all of it runs, each thread's in order
+  EventLoop loop;
+  constexpr int producers = 4;
+  constexpr int per_producer = 20000;
+  std::vector<int> last( producers, -1 );
+  bool in_order = true;
+  int done = 0;
+  std::vector<std::thread> threads;
+  for ( int p = 0; p < producers; p++ ) {
+    threads.emplace_back( [&, p] {
+      for ( int i = 0; i < per_producer; i++ ) {
+        loop.post( [&, p, i] {
+          in_order = in_order and i == last[p] + 1;
+          last[p] = i;
+          done++;
+        } );
+      }
+    } );
+  }
+  while ( done < producers * per_producer ) {
+    loop.wait_next_event( -1 );
+  }
+  for ( auto& thread : threads ) {
+    thread.join();
+  }
+  require( in_order );
+  require( loop.posted_tasks() == 0 );
+
+  // the loops have nothing to wait for but tasks already posted, once a rule has lost interest
+  for ( const auto backend : { EventLoop::Backend::Epoll, EventLoop::Backend::IoUring } ) {
+    EventLoop idle_loop { backend };
+    auto [read_end, write_end] = make_pipe();
+    bool wants_to_read = true;
+    idle_loop.add_rule(
+      "read once",
+      Direction::In,
+      read_end,
+      [&] {
+        char c;
+        read_end.read( { &c, 1 } );
+        wants_to_read = false;
+      },
+      [&] { return wants_to_read; } );
+    write_end.write( "x" );
+    require( idle_loop.wait_next_event( 1000 ) == EventLoop::Result::Success and not wants_to_read );
+    require( idle_loop.wait_next_event( 1000 ) == EventLoop::Result::Exit );
+    std::thread( [&] { idle_loop.post( [&] { done = 0; } ); } ).join();
+    require( idle_loop.wait_next_event( 1000 ) == EventLoop::Result::Success and done == 0 );
+    require( idle_loop.wait_next_event( 1000 ) == EventLoop::Result::Exit );
+    done = 1;
+  }
+
+  // the loop's own thread can't wait for room
+  bool caught = false;
+  try {
+    for ( int i = 0; i <= 1 << 20; i++ ) {
+      loop.post( [] {} );
+    }
+  } catch ( const std::runtime_error& e ) {
+    caught = std::string_view { e.what() }.find( "full" ) != std::string_view::npos;
+  }
+  require( caught );
+}
+
+void bench_post( const int tasks )
+{
+  // the loops sleep in epoll_wait until woken up for a task, as they would with nothing else to do
+  // latency: one task at a time
+  {
+    EventLoop loop;
+    EventFD idle;
+    loop.add_rule( "idle", Direction::In, idle, [] {}, [] { return true; } );
+    std::atomic<bool> stop { false };
+    std::thread runner( [&] {
+      while ( not stop ) {
+        loop.wait_next_event( -1 );
+      }
+    } );
+
+    LatencyHistogram latency;
+    for ( int i = 0; i < tasks / 100; i++ ) {
+      std::atomic<bool> ran { false };
+      const uint64_t posted = Timer::timestamp_ns();
+      loop.post( [&] {
+        latency.record( Timer::timestamp_ns() - posted );
+        ran = true;
+      } );
+      while ( not ran ) {
+        std::this_thread::yield();
+      }
+    }
+    loop.post( [&] { stop = true; } );
+    runner.join();
+    printf( " == post to execute, one at a time == \n== median %lu ns, p99 %lu ns == \n ",
+            latency.percentile( 50 ),
+            latency.percentile( 99 ) );
+  }
+
+  // throughput: as fast as the producers can post
+  for ( const int producers : { 1, 4 } ) {
+    EventLoop loop;
+    EventFD idle;
+    loop.add_rule( "idle", Direction::In, idle, [] {}, [] { return true; } );
+    int done = 0;
+    std::vector<std::thread> threads;
+    auto t1 = high_resolution_clock::now();
+    for ( int p = 0; p < producers; p++ ) {
+      threads.emplace_back( [&] {
+        for ( int i = 0; i < tasks / producers; i++ ) {
+          loop.post( [&] { done++; } );
+        }
+      } );
+    }
+    while ( done < tasks / producers * producers ) {
+      loop.wait_next_event( -1 );
+    }
+    auto t2 = high_resolution_clock::now();
+    for ( auto& thread : threads ) {
+      thread.join();
+    }
+
+    duration<double> seconds = t2 - t1;
+    printf( " == posts from %d threads == \n== %.0f tasks/s, %.1f tasks per loop system call == \n ",
+            producers,
+            done / seconds.count(),
+            double( done ) / std::max<uint64_t>( 1, loop.system_calls() ) );
+  }
+}
+
+// the ASCII-template peer format that PackedHeader replaced, kept here to compare against
+std::string legacy_remote_store_header( int tag, std::string name, int payload_size )
+{
+  std::string remote_request { "0000200000000" + name };
+  int* p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() ) );
+  p[0] = name.length() + 13 + payload_size;
+  p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() + 5 ) );
+  p[0] = tag;
+  p = reinterpret_cast<int*>( const_cast<char*>( remote_request.c_str() + 9 ) );
+  p[0] = name.length();
+  return remote_request;
+}
+
+std::tuple<std::string, int, int> legacy_parse_remote_store( std::string request )
+{
+  int opcode = stoi( request.substr( 0, 1 ) );
+  int tag = *reinterpret_cast<const int*>( ( request.c_str() + 1 ) );
+  int size = *reinterpret_cast<const int*>( ( request.c_str() + 5 ) );
+  std::string name = request.substr( 9, size );
+  return { name, size, tag + opcode };
+}
+
+void test_packed_header()
+{
+  MessageHandler handler;
+  const std::string message = handler.generate_remote_store_header( 7, "key", 3ul << 30 );
+  require( message.length() == PackedHeader::SIZE + 3 );
+  require( message[0] == char( PackedHeader::SIZE + 3 ) and message[4] == PackedHeader::VERSION );
+  require( message[5] == MessageHandler::STORE and message[8] == 7 and message[19] == char( 0xc0 ) );
+
+  const std::string_view body = std::string_view { message }.substr( 4 );
+  const auto header = PackedHeader::decode( body );
+  require( header.has_value() and header->length == PackedHeader::SIZE + 3 + ( 3ul << 30 ) );
+  require( header->key( body ) == "key" );
+  require( handler.remote_store_header_length( body ) == PackedHeader::SIZE - 4 + 3 );
+  require( std::get<1>( handler.parse_remote_store( body ) ) == 3ul << 30 );
+
+  std::string other_version { message };
+  other_version[4]++;
+  require( not PackedHeader::decode( std::string_view { other_version }.substr( 4 ) ).has_value() );
+  require( not PackedHeader::decode( body.substr( 0, PackedHeader::SIZE - 5 ) ).has_value() );
+
+  bool too_large = false;
+  try {
+    handler.generate_remote_store_header( 7, "key", 1ul << 32 );
+  } catch ( const std::runtime_error& ) {
+    too_large = true;
+  }
+  require( too_large );
+}
+
+// local answers carry a 32-bit length: objects that don't fit in one are refused, not sent with a wrong length
+void test_local_header_limits()
+{
+  MessageHandler handler;
+  const auto header = handler.generate_local_object_header( "key", 1000 );
+  require( header.has_value() and get_le<uint32_t>( header->data() ) == header->length() + 1000 );
+  require( not handler.generate_local_object_header( "key", 1ul << 32 ).has_value() );
+  require( not handler.generate_local_object_header( "key", UINT32_MAX - 5 ).has_value() );
+
+  const auto multi = handler.generate_local_multi_get_header( { MessageHandler::NOT_FOUND, 10 } );
+  require( multi.has_value() and get_le<uint32_t>( multi->data() ) == multi->length() + 10 );
+  require( not handler.generate_local_multi_get_header( { 3ul << 30, 2ul << 30 } ).has_value() );
+  require( not handler.generate_local_multi_get_header( { 10, UINT64_MAX - 1 } ).has_value() );
+}
+
+// tags run out rather than repeat, and come back once allowed
+void test_tag_generator()
+{
+  UniqueTagGenerator tags( 10, 2 );
+  const auto first = tags.emit(), second = tags.emit();
+  require( first.has_value() and second.has_value() and *first != *second );
+  require( *first >= 10 and *first < 12 and *second >= 10 and *second < 12 );
+  require( not tags.emit().has_value() and tags.available() == 0 );
+  tags.allow( *second );
+  require( tags.emit() == second );
+}
+
+// a multi store's sizes have to add up to the objects that follow them
+void test_multi_store_sizes()
+{
+  MessageHandler handler;
+  const std::vector<std::string_view> keys { "a", "b", "c" };
+  auto frame = [&]( const std::vector<uint64_t>& sizes, std::string_view objects ) {
+    std::string message = handler.generate_remote_multi_store_header( 3, keys, sizes ) + std::string { objects };
+    return std::string { std::string_view { message }.substr( 4 ) };
+  };
+  auto rejected = [&]( const std::string& body ) {
+    try {
+      handler.parse_remote_multi_store( body );
+    } catch ( const std::runtime_error& ) {
+      return true;
+    }
+    return false;
+  };
+
+  const std::string good = frame( { 2, MessageHandler::NOT_FOUND, 3 }, "xxyyy" );
+  const auto [entries, objects, tag] = handler.parse_remote_multi_store( good );
+  require( entries.size() == 3 and entries[1].second == MessageHandler::NOT_FOUND );
+  require( objects == "xxyyy" and tag == 3 );
+
+  // the header announces 5 bytes of objects: claim more than that, or less, behind the same framing
+  std::string too_large = good;
+  put_le<uint64_t>( too_large.data() + too_large.length() - 5 - 8, 4 );
+  require( rejected( too_large ) );
+  std::string wrapping = good;
+  put_le<uint64_t>( wrapping.data() + wrapping.length() - 5 - 8, UINT64_MAX - 1 );
+  require( rejected( wrapping ) );
+  std::string too_small = good;
+  put_le<uint64_t>( too_small.data() + too_small.length() - 5 - 8, 1 );
+  require( rejected( too_small ) );
+
+  // the objects may be left off when they were received separately, but not cut short
+  const std::string header_only = frame( { 2, MessageHandler::NOT_FOUND, 3 }, {} );
+  require( std::get<0>( handler.parse_remote_multi_store( header_only ) ).size() == 3 );
+  require( std::get<1>( handler.parse_remote_multi_store( header_only ) ).empty() );
+  require( handler.remote_store_header_length( header_only ) == header_only.length() );
+  require( rejected( frame( { 2, MessageHandler::NOT_FOUND, 3 }, "xxy" ) ) );
+}
+
+// encodes then decodes `rounds` store headers with a 16-byte key in both formats
+void bench_wire_format( const int rounds )
+{
+  MessageHandler handler;
+  const std::string key { "shuffle-00001234" };
+
+  auto t1 = high_resolution_clock::now();
+  for ( int i = 0; i < rounds; i++ ) {
+    const std::string message = legacy_remote_store_header( i, key, 4096 );
+    auto parsed = legacy_parse_remote_store( message.substr( 4 ) );
+    doNotOptimize( parsed );
+  }
+  auto t2 = high_resolution_clock::now();
+  for ( int i = 0; i < rounds; i++ ) {
+    const std::string message = handler.generate_remote_store_header( i, key, 4096 );
+    auto parsed = handler.parse_remote_store( std::string_view { message }.substr( 4 ) );
+    doNotOptimize( parsed );
+  }
+  auto t3 = high_resolution_clock::now();
+
+  duration<double> legacy = t2 - t1;
+  duration<double> packed = t3 - t2;
+  printf( " == wire format, encode + decode (ASCII templates) == \n== at %.2f M messages/s == \n ",
+          rounds / legacy.count() / 1e6 );
+  printf( " == wire format, encode + decode (packed header) == \n== at %.2f M messages/s == \n ",
+          rounds / packed.count() / 1e6 );
+}
+
+void test_flat_index()
+{
+  FlatIndex index;
+  std::unordered_map<std::string, uint32_t> reference;
+  std::mt19937 prng( 1 );
+
+  // short keys sit inline, long ones on the heap; erasing has to keep every probe run intact
+  for ( int round = 0; round < 200000; round++ ) {
+    const uint32_t n = prng() % 5000;
+    const std::string key = ( n % 3 ? "k" : std::string( 100, 'l' ) ) + std::to_string( n );
+    if ( prng() % 3 ) {
+      require( index.insert( key, n ) == reference.insert( { key, n } ).second );
+    } else {
+      require( index.erase( key ) == ( reference.erase( key ) == 1 ) );
+    }
+  }
+  require( index.size() == reference.size() );
+  for ( uint32_t n = 0; n < 5000; n++ ) {
+    for ( const std::string& key : { "k" + std::to_string( n ), std::string( 100, 'l' ) + std::to_string( n ) } ) {
+      auto got = reference.find( key );
+      require( index.find( key ) == ( got == reference.end() ? FlatIndex::NOT_FOUND : got->second ) );
+    }
+  }
+}
+
+// random-order lookups among `count` resident keys, returns nanoseconds per lookup
+template<typename F>
+double lookup_latency( const std::vector<std::string>& keys, F&& lookup )
+{
+  std::vector<uint32_t> order( keys.size() );
+  for ( uint32_t i = 0; i < order.size(); i++ ) {
+    order[i] = i;
+  }
+  std::shuffle( order.begin(), order.end(), std::mt19937 { 2 } );
+
+  auto t1 = high_resolution_clock::now();
+  for ( const uint32_t i : order ) {
+    doNotOptimize( lookup( std::string_view { keys[i] } ) );
+  }
+  auto t2 = high_resolution_clock::now();
+
+  duration<double, std::nano> elapsed = t2 - t1;
+  return elapsed.count() / order.size();
+}
+
+void bench_index_lookup( const int count )
+{
+  std::vector<std::string> keys;
+  for ( int i = 0; i < count; i++ ) {
+    keys.push_back( "shuffle/part-" + std::to_string( i ) + "/of-" + std::to_string( count ) );
+  }
+
+  // what LocalStorage::locate used to do: build a std::string key and probe a node-based map
+  std::unordered_map<std::string, Blob> node_map;
+  FlatIndex flat_index;
+  LocalStorage storage( 1ul << 40 );
+  for ( int i = 0; i < count; i++ ) {
+    node_map.insert( { keys[i], {} } );
+    flat_index.insert( keys[i], i );
+    storage.new_object( keys[i], 1 );
+  }
+  for ( int i = 0; i < count; i += 2 ) {
+    storage.add( keys[i], "alias-" + keys[i] );
+  }
+
+  printf( " == %d-key lookup (std::unordered_map, std::string key) == \n== at %.1f ns == \n ",
+          count,
+          lookup_latency( keys, [&]( std::string_view key ) {
+            return node_map.find( std::string { key } )->second;
+          } ) );
+  printf( " == %d-key lookup (FlatIndex) == \n== at %.1f ns == \n ",
+          count,
+          lookup_latency( keys, [&]( std::string_view key ) { return flat_index.find( key ); } ) );
+  printf( " == %d-key lookup (LocalStorage::locate) == \n== at %.1f ns == \n ",
+          count,
+          lookup_latency( keys, [&]( std::string_view key ) { return storage.locate( key ); } ) );
+}
+
+void test_spill()
+{
+  LocalStorage a( 4000 );
+  a.enable_spill();
+  for ( int i = 0; i < 4; i++ ) {
+    require( a.new_object_from_string( "object" + std::to_string( i ), std::string( 1000, 'a' + i ) ) == 0 );
+  }
+  // only complete (committed) blobs may leave memory
+  require( not a.new_object( "object4", 1000 ).has_value() );
+  for ( int i = 0; i < 4; i++ ) {
+    a.commit( "object" + std::to_string( i ) );
+  }
+  void* pinned = a.pin( "object0" ).value().ptr;
+
+  require( a.new_object( "object4", 1000 ).has_value() );
+  require( a.get_total_size() == 4000 );
+  require( a.stats().spills == 1 and a.stats().spilled_bytes == 1000 );
+  require( a.locate( "object0" ).value().ptr == pinned );
+
+  // every object reads back intact, faulting out others to make room
+  for ( int i = 1; i < 4; i++ ) {
+    auto blob = a.locate( "object" + std::to_string( i ) ).value();
+    require( blob.ptr != nullptr );
+    require( std::string( static_cast<char*>( blob.ptr ), blob.size ) == std::string( 1000, 'a' + i ) );
+  }
+  require( a.get_total_size() <= 4000 and a.stats().misses >= 1 );
+  a.unpin( pinned );
+
+  // deleting a spilled object gives back its disk space
+  a.commit( "object4" );
+  require( a.new_object( "object5", 3000 ).has_value() );
+  const uint64_t on_disk = a.stats().spilled_bytes;
+  for ( int i = 0; i < 5; i++ ) {
+    require( a.delete_object( "object" + std::to_string( i ) ) == 0 );
+  }
+  require( on_disk > 0 and a.stats().spilled_bytes == 0 );
+  require( a.get_total_size() == 3000 );
+
+  // the sharded store spills across shards, and keeps to the capacity
+  ConcurrentLocalStorage b( 64 * 1024 );
+  b.enable_spill();
+  for ( int i = 0; i < 256; i++ ) {
+    const std::string key = "object" + std::to_string( i );
+    require( b.new_object_from_string( key, std::string( 1024, 'a' + i % 26 ) ) == 0 );
+    b.commit( key );
+  }
+  require( b.get_total_size() <= 64 * 1024 and b.stats().spills >= 192 );
+  for ( int i = 0; i < 256; i++ ) {
+    auto blob = b.pin( "object" + std::to_string( i ) ).value();
+    require( static_cast<char*>( blob.ptr )[1023] == 'a' + i % 26 );
+    b.unpin( blob.ptr );
+  }
+  require( b.get_total_size() <= 64 * 1024 and b.stats().misses >= 192 );
+
+  // finding out that a key exists, or deleting it, leaves a spilled blob on disk
+  ConcurrentLocalStorage c( 64 * 1024 );
+  c.enable_spill();
+  for ( int i = 0; i < 256; i++ ) {
+    const std::string key = "object" + std::to_string( i );
+    require( c.new_object_from_string( key, std::string( 1024, 'a' ) ) == 0 );
+    c.commit( key );
+  }
+  require( c.stats().spilled_bytes >= 192 * 1024 );
+  for ( int i = 0; i < 256; i++ ) {
+    const std::string key = "object" + std::to_string( i );
+    require( c.contains( key ) and c.delete_object( key ) == 0 and not c.contains( key ) );
+  }
+  require( c.stats().misses == 0 and c.stats().spilled_bytes == 0 );
+}
+
+void test_remote_cache()
+{
+  ConcurrentLocalStorage storage( 1 << 20 );
+  RemoteCache cache( storage, 3000, milliseconds( 50 ) );
+  auto fetched = [&]( int origin, const std::string& name ) {
+    require( storage.new_object_from_string( name, std::string( 1000, name[0] ) ) == 0 );
+    storage.commit( name );
+    cache.insert( origin, name, 1000 );
+  };
+
+  // a copy answers lookups for the peer it came from, and only that one
+  fetched( 1, "a" );
+  auto hit = cache.find( 1, "a" );
+  require( hit.has_value() and static_cast<char*>( hit->blob.ptr )[999] == 'a' );
+  require( not cache.find( 2, "a" ).has_value() and not storage.locate( "a" ).has_value() );
+  require( std::string( static_cast<char*>( hit->blob.ptr ), 1000 ) == std::string( 1000, 'a' ) );
+  hit = {};
+
+  // past the capacity, the copies with the fewest hits go first, the least recently used of them first
+  fetched( 1, "a" );
+  fetched( 1, "b" );
+  fetched( 1, "c" );
+  cache.find( 1, "a" );
+  cache.find( 1, "b" );
+  fetched( 1, "d" );
+  require( not storage.locate( "c" ).has_value() and cache.stats().evictions == 1 );
+  require( cache.find( 1, "a" ).has_value() and cache.find( 1, "b" ).has_value() );
+  require( cache.evict( 1 ) and not storage.locate( "d" ).has_value() );
+  require( cache.stats().cached_bytes == 2000 );
+
+  // "not found" is remembered for the peer that said so, for a while
+  cache.insert_missing( 1, "x" );
+  require( cache.known_missing( 1, "x" ) and not cache.known_missing( 2, "x" ) );
+  std::this_thread::sleep_for( milliseconds( 60 ) );
+  require( not cache.known_missing( 1, "x" ) );
+
+  // a delete on the peer drops the copy; one elsewhere only makes the cache forget it
+  cache.invalidate( 2, "a" );
+  require( cache.find( 1, "a" ).has_value() );
+  cache.invalidate( 1, "a" );
+  require( not storage.locate( "a" ).has_value() and not cache.find( 1, "a" ).has_value() );
+  cache.forget( "b" );
+  require( storage.locate( "b" ).has_value() and not cache.find( 1, "b" ).has_value() );
+  require( cache.stats().cached_bytes == 0 and cache.stats().negative_hits == 1 );
+}
+
+void test_hash_ring()
+{
+  HashRing ring;
+  require( not ring.owner( "key" ).has_value() );
+  const int nodes = 8, keys = 100000;
+  for ( int id = 0; id < nodes; id++ ) {
+    ring.add_node( id );
+  }
+  require( ring.nodes() == nodes );
+
+  // keys spread evenly
+  std::vector<int> before( keys ), load( nodes );
+  for ( int i = 0; i < keys; i++ ) {
+    before[i] = ring.owner( "key" + std::to_string( i ) ).value();
+    load[before[i]]++;
+  }
+  const auto [least, most] = std::minmax_element( load.begin(), load.end() );
+  std::cout << "hash ring: " << nodes << " nodes, " << keys << " keys, " << *least << " to " << *most
+            << " keys per node" << std::endl;
+  require( *least > keys / nodes * 3 / 4 and *most < keys / nodes * 5 / 4 );
+
+  // only the keys of a node that leaves move, and they spread over the others
+  ring.remove_node( 3 );
+  std::vector<int> moved_to( nodes );
+  for ( int i = 0; i < keys; i++ ) {
+    const int now = ring.owner( "key" + std::to_string( i ) ).value();
+    require( now != 3 and ( before[i] == 3 or now == before[i] ) );
+    moved_to[now] += before[i] == 3;
+  }
+  require( *std::min_element( moved_to.begin(), moved_to.begin() + 3 ) > 0 );
+
+  // a re-homed key goes where it was sent, until it is given back or its node leaves
+  const int placed = ring.owner( "key1" ).value();
+  const int home = placed == 5 ? 6 : 5;
+  ring.rehome( "key1", home );
+  require( ring.owner( "key1" ).value() == home );
+  ring.unhome( "key1" );
+  require( ring.owner( "key1" ).value() == placed );
+  ring.rehome( "key1", home );
+  ring.remove_node( home );
+  require( ring.owner( "key1" ).value() != home );
+}
+
+void test_latency_histogram()
+{
+  LatencyHistogram empty;
+  require( empty.count() == 0 and empty.percentile( 99 ) == 0 and empty.min() == 0 );
+
+  // small values are exact
+  LatencyHistogram small;
+  for ( uint64_t v = 1; v <= 50; v++ ) {
+    small.record( v );
+  }
+  require( small.percentile( 50 ) == 25 and small.percentile( 100 ) == 50 and small.min() == 1 );
+
+  // large ones are within 1/32 of themselves, from ns to hours
+  std::mt19937_64 rng( 1 );
+  std::vector<uint64_t> values;
+  LatencyHistogram a, b;
+  for ( int i = 0; i < 100000; i++ ) {
+    const uint64_t v = rng() >> ( 20 + rng() % 40 );
+    values.push_back( v );
+    ( i % 2 ? a : b ).record( v );
+  }
+  a.merge( b );
+  require( a.count() == values.size() );
+  std::sort( values.begin(), values.end() );
+  for ( const double p : { 1.0, 50.0, 90.0, 99.0, 99.9, 100.0 } ) {
+    const uint64_t exact = values[std::max<size_t>( 1, p / 100 * values.size() + 0.5 ) - 1];
+    const uint64_t estimate = a.percentile( p );
+    require( estimate >= exact and estimate - exact <= exact / LatencyHistogram::SUB_BUCKETS );
+  }
+  require( a.max() == values.back() and a.min() == values.front() );
+
+  uint64_t bucketed = 0;
+  for ( const auto& [lowest, count] : a.buckets() ) {
+    bucketed += count;
+  }
+  require( bucketed == values.size() );
+  require( a.json().find( "\"count\":100000" ) != std::string::npos );
+}
+
+void test_blob_handle()
+{
+  ConcurrentLocalStorage a( 1024 * 1024 );
+  require( a.new_object_from_string( "object", std::string( 1000, 'x' ) ) == 0 );
+
+  // the memory outlives the name for as long as any copy of the handle does
+  auto handle = a.acquire( "object" ).value();
+  auto copy = handle;
+  require( a.delete_object( "object" ) == 0 );
+  require( a.get_total_size() == 1000 );
+  require( static_cast<const char*>( copy.blob.ptr )[999] == 'x' );
+  handle = {};
+  require( a.get_total_size() == 1000 );
+  copy = {};
+  require( a.get_total_size() == 0 );
+
+  // readers stream objects while a writer deletes and recreates them underneath
+  std::atomic<bool> done { false };
+  std::atomic<int> torn { 0 };
+  std::thread writer( [&] {
+    for ( int round = 0; round < 20000; round++ ) {
+      const std::string key = "object" + std::to_string( round % 8 );
+      a.delete_object( key );
+      a.new_object_from_string( key, std::string( 4096, 'a' + round % 26 ) );
+      a.commit( key );
+    }
+    done = true;
+  } );
+  std::thread reader( [&] {
+    while ( not done ) {
+      for ( int i = 0; i < 8; i++ ) {
+        // an object is only complete once committed
+        auto got = a.acquire( "object" + std::to_string( i ) );
+        if ( got.has_value() and not got->blob.mutablility ) {
+          const char* data = static_cast<const char*>( got->blob.ptr );
+          torn += std::string_view( data, got->blob.size ).find_first_not_of( data[0] ) != std::string_view::npos;
+        }
+      }
+    }
+  } );
+  writer.join();
+  reader.join();
+  require( torn == 0 );
+}
+
+void test_segmented_grow()
+{
+  LocalStorage a( 1024 * 1024 * 1024, std::make_unique<SlabAllocator>() );
+  a.enable_spill();
+  void* first = a.new_object( "log", 100 ).value();
+  memset( first, 0, 100 );
+
+  // uneven appends across several chunk boundaries; nothing already written moves
+  std::string expected( 100, '\0' );
+  for ( int i = 0; expected.size() < 3 * LocalStorage::CHUNK_SIZE + 12345; i++ ) {
+    const std::string data( 1000 + i * 777 % 100000, 'a' + i % 26 );
+    require( a.append( "log", data ) == 0 );
+    expected += data;
+  }
+  auto contents = [&]( const Blob& blob ) {
+    std::string out;
+    for ( const auto& chunk : blob.segmented() ? blob.chunks : std::vector<Chunk> { { blob.ptr, blob.size } } ) {
+      out.append( static_cast<const char*>( chunk.ptr ), chunk.size );
+    }
+    return out;
+  };
+  Blob blob = a.locate( "log" ).value();
+  require( blob.ptr == first and blob.segmented() and blob.chunks.size() == 5 );
+  require( blob.size == expected.size() and a.get_total_size() == expected.size() );
+  require( contents( blob ) == expected );
+
+  // a segmented blob spills and comes back in one piece
+  a.commit( "log" );
+  require( a.evict( 1 ) == expected.size() );
+  blob = a.locate( "log" ).value();
+  require( not blob.segmented() and contents( blob ) == expected );
+
+  require( a.new_object_from_string( "joined", "abc" ) == 0 );
+  require( a.append( "joined", std::string( LocalStorage::CHUNK_SIZE, 'd' ) ) == 0 );
+  require( a.commit( "joined", true ) == 0 );
+  blob = a.locate( "joined" ).value();
+  require( not blob.segmented() and contents( blob ) == "abc" + std::string( LocalStorage::CHUNK_SIZE, 'd' ) );
+  require( a.append( "joined", "e" ) == 1 );
+}
+
+// builds one `total`-byte object out of `step`-byte appends, returns GB/s
+double append_object( const size_t total, const size_t step, const bool chunked )
+{
+  const std::string data( step, 'x' );
+  SlabAllocator allocator;
+  LocalStorage storage( 2 * total, std::make_unique<SlabAllocator>() );
+
+  auto t1 = high_resolution_clock::now();
+  if ( chunked ) {
+    storage.new_object( "object", 0 );
+    for ( size_t size = 0; size < total; size += step ) {
+      storage.append( "object", data );
+    }
+  } else {
+    // how grow used to work: reallocate the whole object on every append
+    char* ptr = static_cast<char*>( allocator.allocate( 0 ) );
+    for ( size_t size = 0; size < total; size += step ) {
+      ptr = static_cast<char*>( allocator.reallocate( ptr, size, size + step ) );
+      memcpy( ptr + size, data.data(), step );
+    }
+    allocator.deallocate( ptr, total );
+  }
+  auto t2 = high_resolution_clock::now();
+
+  duration<double> seconds = t2 - t1;
+  return total / seconds.count() / 1e9;
+}
+
+void bench_append()
+{
+  const size_t step = 64 * 1024;
+  // the quadratic version would copy ~8 TB to reach 1 GB, so it only builds 64 MB
+  printf( " == 64 MB in 64 KiB appends (realloc) == \n== at %.3f GB/s == \n ",
+          append_object( 64ul * 1024 * 1024, step, false ) );
+  printf( " == 64 MB in 64 KiB appends (chunks) == \n== at %.3f GB/s == \n ",
+          append_object( 64ul * 1024 * 1024, step, true ) );
+  printf( " == 1 GB in 64 KiB appends (chunks) == \n== at %.3f GB/s == \n ",
+          append_object( 1024ul * 1024 * 1024, step, true ) );
+}
+
+void test_concurrent_storage()
+{
+  ConcurrentLocalStorage a( 64 * 1024 );
+
+  // aliases work across shards, and go away with their key
+  require( a.new_object_from_string( "key", std::string( 100, 'k' ) ) == 0 );
+  for ( int i = 0; i < 32; i++ ) {
+    require( a.add( "key", "alias" + std::to_string( i ) ) == 0 );
+  }
+  require( a.locate( "alias7" ).value().size == 100 );
+  require( a.add( "nokey", "alias7" ) == 1 );
+  require( not a.new_object( "alias7", 10 ).has_value() );
+  require( a.grow( "alias3", 50 ) == 0 );
+  require( a.get_total_size() == 150 );
+  require( a.delete_object( "alias31" ) == 0 );
+  require( not a.locate( "key" ).has_value() and not a.locate( "alias0" ).has_value() );
+  require( a.new_object( "alias0", 10 ).has_value() and a.delete_object( "alias0" ) == 0 );
+
+  // a pinned blob keeps being charged until it is unpinned
+  require( a.new_object_from_string( "pinned", std::string( 1000, 'p' ) ) == 0 );
+  const void* ptr = a.pin( "pinned" ).value().ptr;
+  require( a.delete_object( "pinned" ) == 0 );
+  require( a.get_total_size() == 1000 );
+  a.unpin( ptr );
+  require( a.get_total_size() == 0 );
+
+  // racing threads together never overshoot the capacity
+  std::vector<std::thread> threads;
+  std::atomic<int> created { 0 };
+  for ( int t = 0; t < 4; t++ ) {
+    threads.emplace_back( [&, t] {
+      for ( int i = 0; i < 100; i++ ) {
+        if ( a.new_object( std::to_string( t ) + "-" + std::to_string( i ), 1000 ).has_value() ) {
+          created++;
+        }
+      }
+    } );
+  }
+  for ( auto& thread : threads ) {
+    thread.join();
+  }
+  require( created == 65 );
+  require( a.get_total_size() == 65000 );
+}
+
+// each thread creates, looks up and deletes its own objects; returns millions of operations per second
+double concurrent_churn( ConcurrentLocalStorage& storage, const int threads, const int rounds )
+{
+  constexpr int LOCATES_PER_OBJECT = 8;
+  std::vector<std::thread> workers;
+
+  auto t1 = high_resolution_clock::now();
+  for ( int t = 0; t < threads; t++ ) {
+    workers.emplace_back( [&, t] {
+      std::vector<std::string> keys;
+      for ( int i = 0; i < 64; i++ ) {
+        keys.push_back( "thread" + std::to_string( t ) + "-object" + std::to_string( i ) );
+      }
+      for ( int r = 0; r < rounds; r++ ) {
+        const std::string& key = keys[r % keys.size()];
+        storage.new_object( key, 64 );
+        for ( int l = 0; l < LOCATES_PER_OBJECT; l++ ) {
+          doNotOptimize( storage.locate( key ) );
+        }
+        storage.delete_object( key );
+      }
+    } );
+  }
+  for ( auto& worker : workers ) {
+    worker.join();
+  }
+  auto t2 = high_resolution_clock::now();
+
+  duration<double> seconds = t2 - t1;
+  return threads * rounds * ( LOCATES_PER_OBJECT + 2 ) / seconds.count() / 1e6;
+}
+
+void bench_concurrent_storage()
+{
+  const int max_threads = std::max( 4u, std::thread::hardware_concurrency() );
+  for ( int threads = 1; threads <= max_threads; threads *= 2 ) {
+    for ( const size_t shards : { size_t { 1 }, ConcurrentLocalStorage::DEFAULT_SHARDS } ) {
+      ConcurrentLocalStorage storage( 1024 * 1024 * 1024, shards );
+      printf( " == locate/new_object/delete, %d threads, %zu shards == \n== at %.2f M ops/s == \n ",
+              threads,
+              shards,
+              concurrent_churn( storage, threads, 200000 / threads ) );
+    }
+  }
+}
+
 void test_delete();
 
 int main()
@@ -99,6 +1743,38 @@ int main()
   test_new_creation1();
   test_new_creation2();
   stress_test_new_creation();
+  test_slab_accounting();
   test_add_alias();
   test_grow();
+  test_pinned_delete();
+  test_arena_churn();
+  test_flat_index();
+  test_concurrent_storage();
+  test_spill();
+  test_remote_cache();
+  test_hash_ring();
+  test_latency_histogram();
+  test_blob_handle();
+  test_segmented_grow();
+  test_packed_header();
+  test_multi_store_sizes();
+  test_tag_generator();
+  test_local_header_limits();
+  test_interest_group();
+  test_edge_triggered();
+  test_empty_outbound_message();
+  test_payload_pinned();
+  test_payload_parts();
+  test_timers();
+  test_post();
+  bench_wire_format( 2000000 );
+  bench_concurrent_storage();
+  bench_index_lookup( 1000000 );
+  bench_append();
+  bench_loopback_transmit();
+  bench_request_rate( 2000000 );
+  bench_idle_connections( 100000 );
+  bench_io_backends( 400000 );
+  bench_edge_triggered( 1ul << 30 );
+  bench_post( 4000000 );
 }
@@ -1,5 +1,6 @@
 #include "eventloop.hh"
 #include "exception.hh"
+#include "io_uring.hh"
 #include "net/socket.hh"
 #include "timer.hh"
 
@@ -9,49 +10,100 @@
 
 using namespace std;
 
+EventLoop::EventLoop( const Backend backend )
+  : _uring( backend == Backend::IoUring ? make_unique<IoUring>( 256 ) : nullptr )
+{
+  if ( _uring ) {
+    _uring->register_sparse_tables( REGISTERED_SLOTS );
+    for ( unsigned slot = REGISTERED_SLOTS; slot > 0; slot-- ) {
+      _free_file_slots.push_back( slot - 1 );
+      _free_buffer_slots.push_back( slot - 1 );
+    }
+  }
+
+  _post_category = add_category( "posted tasks" );
+  add_rule(
+    _post_category, Direction::In, _post_wakeup, [this] { run_posted(); }, [] { return true; } );
+  _post_rule = _pending_fd_rules.back().get();
+}
+
+EventLoop::~EventLoop() = default;
+
 size_t EventLoop::add_category( const string& name )
 {
   _rule_categories.emplace_back( name );
   return _rule_categories.size() - 1;
 }
 
-EventLoop::BasicRule::BasicRule( const size_t category_id_ )
+EventLoop::BasicRule::BasicRule( const size_t category_id_, const bool is_fd_rule_ )
   : category_id( category_id_ )
   , cancel_requested( false )
+  , is_fd_rule( is_fd_rule_ )
 {}
 
 EventLoop::Rule::Rule( const size_t category_id_, const InterestT& interest_, const CallbackT& callback_ )
-  : BasicRule( category_id_ )
+  : BasicRule( category_id_, false )
   , interest( interest_ )
   , callback( callback_ )
 {}
 
 EventLoop::FDRule::FDRule( const size_t category_id_,
-                           const FileDescriptor& epoll_fd,
+                           const int epoll_fd_num_,
                            FileDescriptor&& fd_,
                            const optional<pair<InterestT, CallbackT>>& in_,
                            const optional<pair<InterestT, CallbackT>>& out_,
-                           const CallbackT& cancel_ )
-  : BasicRule( category_id_ )
+                           const CallbackT& cancel_,
+                           const CallbackT& error_queue_,
+                           const bool edge_triggered_ )
+  : BasicRule( category_id_, true )
   , fd( move( fd_ ) )
   , in( in_.value_or( make_pair( [] { return false; }, [] {} ) ) )
   , out( out_.value_or( make_pair( [] { return false; }, [] {} ) ) )
   , cancel( cancel_ )
+  , error_queue( error_queue_ )
   , current_in_interested( in_ )
   , current_out_interested( out_ )
-  , epoll_fd_num( epoll_fd.fd_num() )
+  , edge_triggered( edge_triggered_ )
+  , epoll_fd_num( epoll_fd_num_ )
 {
   if ( not( in_ or out_ ) ) {
     throw runtime_error( "callback in at least one direction is required" );
   }
 
-  SystemCall( "epoll_ctl", ::epoll_ctl( epoll_fd_num, EPOLL_CTL_ADD, this->fd.fd_num(), *this ) );
+  if ( epoll_fd_num >= 0 ) {
+    SystemCall( "epoll_ctl", ::epoll_ctl( epoll_fd_num, EPOLL_CTL_ADD, this->fd.fd_num(), *this ) );
+  }
 }
 
 EventLoop::FDRule::~FDRule()
 {
-  struct epoll_event event; // see epoll_ctl(2), BUGS
-  ::epoll_ctl( epoll_fd_num, EPOLL_CTL_DEL, fd.fd_num(), &event );
+  if ( epoll_fd_num >= 0 ) {
+    struct epoll_event event; // see epoll_ctl(2), BUGS
+    ::epoll_ctl( epoll_fd_num, EPOLL_CTL_DEL, fd.fd_num(), &event );
+  }
+}
+
+uint64_t EventLoop::FDRule::user_data( const unsigned op ) const
+{
+  // rules are 8-byte aligned, and user-space addresses fit in 48 bits
+  const uint64_t generation = op == Poll ? poll_generation : 0;
+  return generation << 48 | reinterpret_cast<uintptr_t>( this ) | op;
+}
+
+void EventLoop::FDRule::quiesce()
+{
+  if ( not uring or ops_in_flight == 0 ) {
+    return;
+  }
+  if ( armed_events ) {
+    uring->cancel( user_data( Poll ) );
+  }
+  if ( read_in_flight ) {
+    uring->cancel( user_data( Read ) );
+  }
+  if ( write_in_flight ) {
+    uring->cancel( user_data( Write ) );
+  }
 }
 
 EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
@@ -60,20 +112,48 @@ EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
                                            const InterestT& in_interest,
                                            const CallbackT& out_callback,
                                            const InterestT& out_interest,
-                                           const CallbackT& cancel )
+                                           const CallbackT& cancel,
+                                           const CallbackT& error_queue )
 {
   if ( category_id >= _rule_categories.size() ) {
     throw out_of_range( "bad category_id" );
   }
 
-  _fd_rules.emplace_back( make_shared<FDRule>( category_id,
-                                               _epoll_fd,
+  _pending_fd_rules.emplace_back( make_shared<FDRule>( category_id,
+                                               _uring ? -1 : _epoll_fd.fd_num(),
                                                fd.duplicate(),
                                                make_optional( make_pair( in_interest, in_callback ) ),
                                                make_optional( make_pair( out_interest, out_callback ) ),
-                                               cancel ) );
+                                               cancel,
+                                               error_queue ) );
+
+  return _pending_fd_rules.back();
+}
+
+EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
+                                           edge_triggered_t,
+                                           const FileDescriptor& fd,
+                                           const CallbackT& in_callback,
+                                           const InterestT& in_interest,
+                                           const CallbackT& out_callback,
+                                           const InterestT& out_interest,
+                                           const CallbackT& cancel,
+                                           const CallbackT& error_queue )
+{
+  if ( category_id >= _rule_categories.size() ) {
+    throw out_of_range( "bad category_id" );
+  }
+
+  _pending_fd_rules.emplace_back( make_shared<FDRule>( category_id,
+                                                       _uring ? -1 : _epoll_fd.fd_num(),
+                                                       fd.duplicate(),
+                                                       make_optional( make_pair( in_interest, in_callback ) ),
+                                                       make_optional( make_pair( out_interest, out_callback ) ),
+                                                       cancel,
+                                                       error_queue,
+                                                       true ) );
 
-  return _fd_rules.back();
+  return _pending_fd_rules.back();
 }
 
 EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
@@ -87,10 +167,14 @@ EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
     throw out_of_range( "bad category_id" );
   }
 
-  _fd_rules.emplace_back( make_shared<FDRule>(
-    category_id, _epoll_fd, fd.duplicate(), make_optional( make_pair( in_interest, in_callback ) ), nullopt, cancel ) );
+  _pending_fd_rules.emplace_back( make_shared<FDRule>( category_id,
+                                                       _uring ? -1 : _epoll_fd.fd_num(),
+                                                       fd.duplicate(),
+                                                       make_optional( make_pair( in_interest, in_callback ) ),
+                                                       nullopt,
+                                                       cancel ) );
 
-  return _fd_rules.back();
+  return _pending_fd_rules.back();
 }
 
 EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
@@ -104,14 +188,45 @@ EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
     throw out_of_range( "bad category_id" );
   }
 
-  _fd_rules.emplace_back( make_shared<FDRule>( category_id,
-                                               _epoll_fd,
+  _pending_fd_rules.emplace_back( make_shared<FDRule>( category_id,
+                                               _uring ? -1 : _epoll_fd.fd_num(),
                                                fd.duplicate(),
                                                nullopt,
                                                make_optional( make_pair( out_interest, out_callback ) ),
                                                cancel ) );
 
-  return _fd_rules.back();
+  return _pending_fd_rules.back();
+}
+
+EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
+                                           loop_io_t,
+                                           const FileDescriptor& fd,
+                                           const ReadTargetT& read_target,
+                                           const DoneT& read_done,
+                                           const InterestT& read_interest,
+                                           const WriteSourcesT& write_sources,
+                                           const DoneT& write_done,
+                                           const InterestT& write_interest,
+                                           const CallbackT& cancel )
+{
+  if ( category_id >= _rule_categories.size() ) {
+    throw out_of_range( "bad category_id" );
+  }
+
+  auto rule = make_shared<FDRule>( category_id,
+                                   _uring ? -1 : _epoll_fd.fd_num(),
+                                   fd.duplicate(),
+                                   make_optional( make_pair( read_interest, CallbackT {} ) ),
+                                   make_optional( make_pair( write_interest, CallbackT {} ) ),
+                                   cancel );
+  rule->loop_io = true;
+  rule->read_target = read_target;
+  rule->read_done = read_done;
+  rule->write_sources = write_sources;
+  rule->write_done = write_done;
+  _pending_fd_rules.push_back( rule );
+
+  return rule;
 }
 
 EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
@@ -122,9 +237,9 @@ EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
     throw out_of_range( "bad category_id" );
   }
 
-  _non_fd_rules.emplace_back( make_shared<Rule>( category_id, interest, callback ) );
+  _pending_non_fd_rules.emplace_back( make_shared<Rule>( category_id, interest, callback ) );
 
-  return _non_fd_rules.back();
+  return _pending_non_fd_rules.back();
 }
 
 void EventLoop::RuleHandle::cancel()
@@ -132,6 +247,251 @@ void EventLoop::RuleHandle::cancel()
   const shared_ptr<BasicRule> rule_shared_ptr = rule_weak_ptr_.lock();
   if ( rule_shared_ptr ) {
     rule_shared_ptr->cancel_requested = true;
+    if ( rule_shared_ptr->is_fd_rule ) {
+      // whoever cancels it may be about to free what it reads into or writes from
+      static_cast<FDRule&>( *rule_shared_ptr ).quiesce();
+    }
+    if ( rule_shared_ptr->group ) {
+      // so that it gets removed
+      rule_shared_ptr->group->loop->mark_dirty( rule_shared_ptr );
+    }
+  }
+}
+
+EventLoop::TimerHandle EventLoop::add_timer( const uint64_t deadline_ns, const CallbackT& callback )
+{
+  auto timer = make_shared<TimerEntry>( TimerEntry { this, deadline_ns, callback } );
+  // the slot of the tick the wheel is at has already been run
+  place_timer( timer, 1 );
+  _timer_count++;
+  return TimerHandle { timer };
+}
+
+void EventLoop::TimerHandle::cancel()
+{
+  const shared_ptr<TimerEntry> timer = timer_weak_ptr_.lock();
+  if ( timer and timer->slot ) {
+    TimerSlot* const slot = timer->slot;
+    timer->slot = nullptr;
+    timer->loop->_timer_count--;
+    slot->erase( timer->at );
+  }
+}
+
+void EventLoop::place_timer( const shared_ptr<TimerEntry>& timer, const uint64_t min_ticks )
+{
+  const uint64_t deadline_tick = ( timer->deadline + TICK_NS - 1 ) / TICK_NS;
+  uint64_t ticks = max( deadline_tick > _wheel_tick ? deadline_tick - _wheel_tick : 0, min_ticks );
+  // beyond the top level: it waits there, in the slot furthest away, and is placed again when that comes round
+  ticks = min( ticks, ( uint64_t( 1 ) << ( WHEEL_BITS * WHEEL_LEVELS ) ) - 1 );
+
+  unsigned level = 0;
+  while ( ticks >> ( WHEEL_BITS * ( level + 1 ) ) ) {
+    level++;
+  }
+  TimerSlot& slot = _wheel[level][( ( _wheel_tick + ticks ) >> ( WHEEL_BITS * level ) ) & ( WHEEL_SLOTS - 1 )];
+  timer->slot = &slot;
+  timer->at = slot.insert( slot.end(), timer );
+}
+
+bool EventLoop::run_timers()
+{
+  const uint64_t now_tick = Timer::timestamp_ns() / TICK_NS;
+  bool fired = false;
+
+  while ( _wheel_tick < now_tick ) {
+    if ( _timer_count == 0 ) {
+      _wheel_tick = now_tick;
+      break;
+    }
+    _wheel_tick++;
+
+    // each level whose slot comes round on this tick moves its timers down, starting from the top, so that none
+    // lands in a slot of a lower level that has already been emptied
+    for ( unsigned level = WHEEL_LEVELS - 1; level > 0; level-- ) {
+      if ( _wheel_tick & ( ( uint64_t( 1 ) << ( WHEEL_BITS * level ) ) - 1 ) ) {
+        continue;
+      }
+      TimerSlot cascading;
+      cascading.swap( _wheel[level][( _wheel_tick >> ( WHEEL_BITS * level ) ) & ( WHEEL_SLOTS - 1 )] );
+      for ( const auto& timer : cascading ) {
+        place_timer( timer, 0 );
+      }
+    }
+
+    _firing_timers.swap( _wheel[0][_wheel_tick & ( WHEEL_SLOTS - 1 )] );
+    for ( const auto& timer : _firing_timers ) {
+      // so that cancelling one from the callback of another finds it
+      timer->slot = &_firing_timers;
+    }
+    while ( not _firing_timers.empty() ) {
+      const shared_ptr<TimerEntry> timer = move( _firing_timers.front() );
+      _firing_timers.pop_front();
+      timer->slot = nullptr;
+      _timer_count--;
+      fired = true;
+      timer->callback();
+    }
+  }
+
+  return fired;
+}
+
+int EventLoop::timer_timeout( const int timeout_ms, const uint64_t started ) const
+{
+  const uint64_t now = Timer::timestamp_ns();
+  int remaining_ms = timeout_ms;
+  if ( timeout_ms > 0 ) {
+    const uint64_t give_up = started + timeout_ms * uint64_t( 1'000'000 );
+    remaining_ms = give_up > now ? ( give_up - now + 999'999 ) / 1'000'000 : 0;
+  }
+  if ( _timer_count == 0 ) {
+    return remaining_ms;
+  }
+
+  // the next timer due from the lowest level, or the next cascade, which may bring some down to it
+  uint64_t ticks = WHEEL_SLOTS - ( _wheel_tick & ( WHEEL_SLOTS - 1 ) );
+  for ( uint64_t i = 1; i < ticks; i++ ) {
+    if ( not _wheel[0][( _wheel_tick + i ) & ( WHEEL_SLOTS - 1 )].empty() ) {
+      ticks = i;
+      break;
+    }
+  }
+
+  const uint64_t wake_up = ( _wheel_tick + ticks ) * TICK_NS;
+  const int timer_ms = wake_up > now ? ( wake_up - now + 999'999 ) / 1'000'000 : 0;
+  return remaining_ms < 0 ? timer_ms : min( remaining_ms, timer_ms );
+}
+
+void EventLoop::post( CallbackT callback )
+{
+  while ( not _posted.try_push( move( callback ) ) ) {
+    if ( _loop_thread.load( memory_order_relaxed ) == this_thread::get_id() ) {
+      throw runtime_error( "EventLoop: posted task queue is full, and only this thread can empty it" );
+    }
+    wake_for_posted();
+    this_thread::yield();
+  }
+  wake_for_posted();
+}
+
+void EventLoop::wake_for_posted()
+{
+  // pairs with the fence in run_posted(): either the loop sees the task, or this sees the flag it cleared first
+  atomic_thread_fence( memory_order_seq_cst );
+  // looked at before being written, so that posts in a burst only read the flag (and share its cache line)
+  if ( not _post_wakeup_pending.load() and not _post_wakeup_pending.exchange( true ) ) {
+    _post_wakeup.write_event();
+  }
+}
+
+void EventLoop::run_posted()
+{
+  _post_wakeup.read_event();
+  _post_wakeup_pending.store( false );
+  atomic_thread_fence( memory_order_seq_cst );
+
+  // a task whose producer is still pushing it stops the batch; the producer wakes the loop again once it is done.
+  // Nor does a steady stream of posts keep the loop here: after a queue's worth, the rest wait for the next turn.
+  CallbackT task;
+  for ( size_t budget = _posted.capacity(); _posted.try_pop( task ); ) {
+    task();
+    if ( --budget == 0 ) {
+      wake_for_posted();
+      break;
+    }
+  }
+}
+
+EventLoop::InterestGroup EventLoop::make_interest_group()
+{
+  InterestGroup group;
+  group.state_ = make_shared<GroupState>( GroupState { this } );
+  return group;
+}
+
+void EventLoop::InterestGroup::add( const RuleHandle& handle )
+{
+  const shared_ptr<BasicRule> rule = handle.rule_weak_ptr_.lock();
+  if ( not rule ) {
+    return;
+  }
+  if ( rule->placed ) {
+    throw runtime_error( "EventLoop: a rule must join its group before the loop runs it" );
+  }
+  rule->group = state_;
+  state_->rules.push_back( rule );
+}
+
+void EventLoop::InterestGroup::notify()
+{
+  if ( state_ ) {
+    state_->notify();
+  }
+}
+
+void EventLoop::GroupState::notify()
+{
+  for ( auto it = rules.begin(); it != rules.end(); ) {
+    const shared_ptr<BasicRule> rule = it->lock();
+    if ( not rule ) {
+      it = rules.erase( it );
+      continue;
+    }
+    loop->mark_dirty( rule );
+    ++it;
+  }
+}
+
+void EventLoop::mark_dirty( const shared_ptr<BasicRule>& rule )
+{
+  if ( rule->dirty ) {
+    return;
+  }
+  rule->dirty = true;
+  if ( rule->is_fd_rule ) {
+    _dirty_fd_rules.push_back( static_pointer_cast<FDRule>( rule ) );
+  } else {
+    _dirty_non_fd_rules.push_back( static_pointer_cast<Rule>( rule ) );
+  }
+}
+
+void EventLoop::fired( BasicRule& rule )
+{
+  if ( rule.group ) {
+    rule.group->notify();
+  }
+}
+
+void EventLoop::place_pending_rules()
+{
+  // a grouped rule starts out dirty, so it is evaluated for the first time as soon as it is placed
+  while ( not _pending_fd_rules.empty() ) {
+    auto& rule = _pending_fd_rules.front();
+    rule->placed = true;
+    adopt( *rule );
+    if ( rule->group ) {
+      _dirty_fd_rules.push_back( rule );
+      rule->grouped_at = _grouped_fd_rules.insert( _grouped_fd_rules.end(), rule );
+      if ( rule->current_in_interested or rule->current_out_interested ) {
+        _interested_grouped_fd_rules++;
+      }
+      _pending_fd_rules.pop_front();
+    } else {
+      _fd_rules.splice( _fd_rules.end(), _pending_fd_rules, _pending_fd_rules.begin() );
+    }
+  }
+
+  while ( not _pending_non_fd_rules.empty() ) {
+    auto& rule = _pending_non_fd_rules.front();
+    rule->placed = true;
+    if ( rule->group ) {
+      _dirty_non_fd_rules.push_back( rule );
+      rule->grouped_at = _grouped_non_fd_rules.insert( _grouped_non_fd_rules.end(), rule );
+      _pending_non_fd_rules.pop_front();
+    } else {
+      _non_fd_rules.splice( _non_fd_rules.end(), _pending_non_fd_rules, _pending_non_fd_rules.begin() );
+    }
   }
 }
 
@@ -140,13 +500,76 @@ void EventLoop::set_fd_failure_callback( const CallbackT& callback )
   _fd_failure_callback = callback;
 }
 
+void EventLoop::run_non_fd_rule( Rule& rule, const unsigned int iterations )
+{
+  if ( iterations > 128 ) {
+    throw runtime_error( "EventLoop: busy wait detected: rule \"" + _rule_categories.at( rule.category_id ).name
+                         + "\" is still interested after " + to_string( iterations ) + " iterations" );
+  }
+
+  RecordScopeTimer<Timer::Category::Nonblock> record_timer { _rule_categories.at( rule.category_id ).timer };
+  rule.callback();
+}
+
+void EventLoop::update_interest( const shared_ptr<FDRule>& rule_ptr )
+{
+  FDRule& rule = *rule_ptr;
+  const bool in_interested = rule.in.first();
+  const bool out_interested = rule.out.first();
+
+  if ( _uring ) {
+    // the equivalent of being registered with epoll is having an operation in flight
+    rule.current_in_interested = in_interested;
+    rule.current_out_interested = out_interested;
+    if ( rule.loop_io ) {
+      if ( in_interested and not rule.read_in_flight ) {
+        submit_read( rule_ptr );
+      }
+      if ( out_interested and not rule.write_in_flight ) {
+        submit_write( rule_ptr );
+      }
+    } else {
+      const uint32_t events
+        = ( in_interested ? uint32_t( EPOLLIN ) : 0 ) | ( out_interested ? uint32_t( EPOLLOUT ) : 0 );
+      if ( events != rule.armed_events ) {
+        submit_poll( rule_ptr, events );
+      }
+    }
+    return;
+  }
+
+  if ( rule.edge_triggered ) {
+    rule.current_in_interested = in_interested;
+    rule.current_out_interested = out_interested;
+    if ( ( in_interested and rule.in_ready ) or ( out_interested and rule.out_ready ) ) {
+      _ready_fd_rules.push_back( rule_ptr );
+    }
+    return;
+  }
+
+  if ( rule.current_in_interested != in_interested or rule.current_out_interested != out_interested ) {
+    // needs update
+    rule.current_in_interested = in_interested;
+    rule.current_out_interested = out_interested;
+
+    _system_calls++;
+    SystemCall( "epoll_ctl", epoll_ctl( _epoll_fd.fd_num(), EPOLL_CTL_MOD, rule.fd.fd_num(), rule ) );
+  }
+}
+
 EventLoop::Result EventLoop::wait_next_event( const int timeout_ms )
 {
+  _loop_thread.store( this_thread::get_id(), memory_order_relaxed );
+
+  // timers that came due while callbacks ran, or since the last call
+  const bool timers_fired = run_timers();
+
   // handle the non-file-descriptor-related rules
   {
     unsigned int iterations = 0;
     while ( true ) {
       ++iterations;
+      place_pending_rules();
       bool rule_fired = false;
       for ( auto it = _non_fd_rules.begin(); it != _non_fd_rules.end(); ) {
         auto& this_rule = **it;
@@ -157,29 +580,47 @@ EventLoop::Result EventLoop::wait_next_event( const int timeout_ms )
         }
 
         if ( this_rule.interest() ) {
-          if ( iterations > 128 ) {
-            throw runtime_error( "EventLoop: busy wait detected: rule \""
-                                 + _rule_categories.at( this_rule.category_id ).name + "\" is still interested after "
-                                 + to_string( iterations ) + " iterations" );
-          }
-
+          run_non_fd_rule( this_rule, iterations );
           rule_fired = true;
-          RecordScopeTimer<Timer::Category::Nonblock> record_timer {
-            _rule_categories.at( this_rule.category_id ).timer
-          };
-          this_rule.callback();
         }
 
         ++it;
       }
 
+      // of the grouped rules, only the dirty ones; one that fires stays dirty (its group is notified), so it is
+      // asked again on the next pass, like the others
+      _evaluating_non_fd_rules.swap( _dirty_non_fd_rules );
+      for ( const auto& rule_ptr : _evaluating_non_fd_rules ) {
+        auto& this_rule = *rule_ptr;
+        this_rule.dirty = false;
+
+        if ( this_rule.cancel_requested ) {
+          if ( this_rule.placed ) {
+            _grouped_non_fd_rules.erase( this_rule.grouped_at );
+            this_rule.placed = false;
+          }
+          continue;
+        }
+
+        if ( this_rule.interest() ) {
+          run_non_fd_rule( this_rule, iterations );
+          fired( this_rule );
+          rule_fired = true;
+        }
+      }
+      _evaluating_non_fd_rules.clear();
+
       if ( not rule_fired ) {
         break;
       }
     }
   }
 
-  if ( _fd_rules.empty() ) {
+  place_pending_rules();
+
+  // nothing but the posted task rule
+  if ( _fd_rules.size() == 1 and _grouped_fd_rules.empty() and not others_in_flight() and _timer_count == 0
+       and _posted.size() == 0 ) {
     return Result::Success;
   }
 
@@ -189,70 +630,175 @@ EventLoop::Result EventLoop::wait_next_event( const int timeout_ms )
     auto& rule = **it;
 
     if ( rule.done ) {
+      retire( rule );
       it = _fd_rules.erase( it );
       continue;
     } else if ( rule.cancel_requested ) {
+      retire( rule );
       it = _fd_rules.erase( it );
       continue;
     }
 
     // FIXME: maybe we're not interested in reading
     if ( rule.fd.eof() or rule.fd.closed() ) {
+      retire( rule );
       rule.cancel();
       it = _fd_rules.erase( it );
       continue;
     }
 
-    const bool in_interested = rule.in.first();
-    const bool out_interested = rule.out.first();
-
-    if ( rule.current_in_interested != in_interested or rule.current_out_interested != out_interested ) {
-      // needs update
-      rule.current_in_interested = in_interested;
-      rule.current_out_interested = out_interested;
+    update_interest( *it );
 
-      SystemCall( "epoll_ctl", epoll_ctl( _epoll_fd.fd_num(), EPOLL_CTL_MOD, rule.fd.fd_num(), rule ) );
+    // the posted task rule is always interested, but only tasks actually posted keep the loop going
+    if ( rule.category_id != _post_category ) {
+      someone_is_interested = someone_is_interested || rule.current_in_interested || rule.current_out_interested;
     }
 
-    someone_is_interested = someone_is_interested || rule.current_in_interested || rule.current_out_interested;
-
     ++it;
   }
 
-  if ( not someone_is_interested ) {
+  // a cancel callback may dirty (or add) more rules
+  while ( not _dirty_fd_rules.empty() ) {
+    _evaluating_fd_rules.swap( _dirty_fd_rules );
+    for ( const auto& rule_ptr : _evaluating_fd_rules ) {
+      auto& rule = *rule_ptr;
+      rule.dirty = false;
+      if ( not rule.placed ) {
+        continue;
+      }
+
+      const bool was_interested = rule.current_in_interested or rule.current_out_interested;
+      bool remove = rule.done or rule.cancel_requested;
+      if ( not remove and ( rule.fd.eof() or rule.fd.closed() ) ) {
+        retire( rule );
+        rule.cancel();
+        remove = true;
+      }
+
+      if ( remove ) {
+        retire( rule );
+        _interested_grouped_fd_rules -= was_interested;
+        _grouped_fd_rules.erase( rule.grouped_at );
+        rule.placed = false;
+        continue;
+      }
+
+      update_interest( rule_ptr );
+      _interested_grouped_fd_rules += ( rule.current_in_interested or rule.current_out_interested );
+      _interested_grouped_fd_rules -= was_interested;
+    }
+    _evaluating_fd_rules.clear();
+    place_pending_rules();
+  }
+
+  someone_is_interested = someone_is_interested || _interested_grouped_fd_rules > 0;
+
+  if ( not someone_is_interested and not others_in_flight() and _timer_count == 0 and _posted.size() == 0 ) {
     return Result::Exit;
   }
 
+  // a wait cut short for the timers carries on if none came due, until the caller's timeout is up
+  const uint64_t wait_started = Timer::timestamp_ns();
+  auto timed_out = [&] {
+    return timeout_ms >= 0 and Timer::timestamp_ns() >= wait_started + timeout_ms * uint64_t( 1'000'000 );
+  };
+
+  if ( _uring ) {
+    while ( not wait_for_completions( timers_fired ? 0 : timer_timeout( timeout_ms, wait_started ) ) ) {
+      if ( run_timers() or timers_fired ) {
+        return Result::Success;
+      }
+      if ( timed_out() ) {
+        return Result::Timeout;
+      }
+    }
+    return Result::Success;
+  }
+
   // TODO: make this a class member
   size_t available_fd_count = 0;
 
-  // call poll -- wait until one of the fds satisfies one of the rules
-  // (writeable/readable)
-  {
-    GlobalScopeTimer<Timer::Category::WaitingForEvent> timer;
+  // ready edge-triggered rules have something to do already; every so often, the others get a look in
+  if ( _ready_fd_rules.empty() or ++_ready_passes > MAX_READY_PASSES ) {
+    _ready_passes = 0;
 
-    available_fd_count = SystemCall(
-      "epoll_wait", ::epoll_wait( _epoll_fd.fd_num(), _epoll_events.data(), _epoll_events.size(), timeout_ms ) );
+    // call poll -- wait until one of the fds satisfies one of the rules
+    // (writeable/readable)
+    while ( true ) {
+      {
+        GlobalScopeTimer<Timer::Category::WaitingForEvent> timer;
+
+        _system_calls++;
+        const int ready = ::epoll_wait( _epoll_fd.fd_num(),
+                                        _epoll_events.data(),
+                                        _epoll_events.size(),
+                                        _ready_fd_rules.empty() and not timers_fired
+                                          ? timer_timeout( timeout_ms, wait_started )
+                                          : 0 );
+        // a signal can cut the wait short, and so can io_uring work for this thread (e.g. the last completions
+        // for an io_uring loop that has gone): like a timeout
+        available_fd_count = ready < 0 and errno == EINTR ? 0 : SystemCall( "epoll_wait", ready );
+      }
 
-    if ( available_fd_count == 0 ) {
-      return Result::Timeout;
+      if ( available_fd_count > 0 or not _ready_fd_rules.empty() ) {
+        break;
+      }
+      if ( run_timers() or timers_fired ) {
+        return Result::Success;
+      }
+      if ( timed_out() ) {
+        return Result::Timeout;
+      }
     }
   }
 
   for ( size_t i = 0; i < available_fd_count; i++ ) {
     auto& this_epoll_event = _epoll_events[i];
-    auto& this_rule = *reinterpret_cast<FDRule*>( this_epoll_event.data.ptr );
-    const uint32_t this_events = this_epoll_event.events;
+    dispatch( *reinterpret_cast<FDRule*>( this_epoll_event.data.ptr ), this_epoll_event.events );
+  }
 
-    // check if we have an error
-    if ( this_events & EPOLLERR ) {
-      /* see if fd is a socket */
-      int socket_error = 0;
-      socklen_t optlen = sizeof( socket_error );
-      const int ret = getsockopt( this_rule.fd.fd_num(), SOL_SOCKET, SO_ERROR, &socket_error, &optlen );
+  for ( const auto& rule : _ready_fd_rules ) {
+    dispatch( *rule, 0 );
+  }
+  _ready_fd_rules.clear();
 
-      this_rule.done = true;
-      this_rule.cancel();
+  return Result::Success;
+}
+
+void EventLoop::dispatch( FDRule& this_rule, uint32_t this_events )
+{
+  if ( this_rule.cancel_requested or this_rule.done ) {
+    // cancelled by an earlier callback in this batch
+    return;
+  }
+
+  if ( this_rule.edge_triggered ) {
+    if ( _uring ) {
+      // each poll looks afresh
+      this_rule.in_ready = this_rule.out_ready = false;
+    }
+    this_rule.in_ready = this_rule.in_ready or ( this_events & ( EPOLLIN | EPOLLHUP ) );
+    this_rule.out_ready = this_rule.out_ready or ( this_events & EPOLLOUT );
+    this_events |= this_rule.in_ready ? uint32_t( EPOLLIN ) : 0;
+    this_events |= this_rule.out_ready ? uint32_t( EPOLLOUT ) : 0;
+  }
+
+  // anything that happens on the fd may change what its group is interested in
+  fired( this_rule );
+
+  // check if we have an error
+  if ( this_events & EPOLLERR ) {
+    /* see if fd is a socket */
+    int socket_error = 0;
+    socklen_t optlen = sizeof( socket_error );
+    const int ret = getsockopt( this_rule.fd.fd_num(), SOL_SOCKET, SO_ERROR, &socket_error, &optlen );
+
+    if ( this_rule.error_queue and ret == 0 and socket_error == 0 ) {
+      // nothing is wrong, the error queue just has notifications for us
+      RecordScopeTimer<Timer::Category::Nonblock> record_timer { _rule_categories.at( this_rule.category_id ).timer };
+      this_rule.error_queue();
+    } else {
+      fail( this_rule );
 
       if ( _fd_failure_callback ) {
         ( *_fd_failure_callback )();
@@ -269,12 +815,23 @@ EventLoop::Result EventLoop::wait_next_event( const int timeout_ms )
                           socket_error );
       }
 
-      continue;
+      return;
     }
+  }
 
-    if ( this_rule.current_in_interested && ( this_events & EPOLLIN ) ) {
-      RecordScopeTimer<Timer::Category::Nonblock> record_timer { _rule_categories.at( this_rule.category_id ).timer };
-
+  if ( this_rule.edge_triggered ) {
+    dispatch_edge_triggered( this_rule, this_events );
+  } else if ( this_rule.current_in_interested && ( this_events & EPOLLIN ) ) {
+    RecordScopeTimer<Timer::Category::Nonblock> record_timer { _rule_categories.at( this_rule.category_id ).timer };
+
+    if ( this_rule.loop_io ) {
+      const simple_string_span target = read_target( this_rule );
+      _system_calls++;
+      const size_t bytes_read = this_rule.fd.read( target );
+      if ( bytes_read > 0 or this_rule.fd.eof() ) {
+        this_rule.read_done( bytes_read );
+      }
+    } else {
       const auto count_before = this_rule.fd.read_count();
       this_rule.in.second(); // call the read callback
 
@@ -284,10 +841,18 @@ EventLoop::Result EventLoop::wait_next_event( const int timeout_ms )
                              + "\" did not read fd and is still interested" );
       }
     }
+  }
 
-    if ( this_rule.current_out_interested && ( this_events & EPOLLOUT ) ) {
-      RecordScopeTimer<Timer::Category::Nonblock> record_timer { _rule_categories.at( this_rule.category_id ).timer };
+  if ( not this_rule.edge_triggered and this_rule.current_out_interested && ( this_events & EPOLLOUT )
+       and not this_rule.fd.closed() ) {
+    RecordScopeTimer<Timer::Category::Nonblock> record_timer { _rule_categories.at( this_rule.category_id ).timer };
 
+    if ( this_rule.loop_io ) {
+      write_sources( this_rule );
+      _system_calls++;
+      this_rule.write_done( this_rule.sources.size() == 1 ? this_rule.fd.write( this_rule.sources.front() )
+                                                          : this_rule.fd.write( this_rule.sources ) );
+    } else {
       const auto count_before = this_rule.fd.write_count();
       this_rule.out.second(); // call the read callback
 
@@ -297,15 +862,301 @@ EventLoop::Result EventLoop::wait_next_event( const int timeout_ms )
                              + "\" did not write fd and is still interested" );
       }
     }
+  }
 
-    if ( this_events & EPOLLHUP ) {
-      this_rule.done = true;
-      this_rule.cancel();
-      continue;
+  if ( this_events & EPOLLHUP ) {
+    fail( this_rule );
+  }
+}
+
+void EventLoop::dispatch_edge_triggered( FDRule& rule, const uint32_t events )
+{
+  // it may have lost interest since it was last asked, e.g. by reading until its buffer filled up
+  if ( ( events & EPOLLIN ) and rule.in.first() ) {
+    RecordScopeTimer<Timer::Category::Nonblock> record_timer { _rule_categories.at( rule.category_id ).timer };
+
+    const auto blocked_before = rule.fd.blocked_read_count();
+    rule.in.second();
+
+    if ( blocked_before != rule.fd.blocked_read_count() or rule.fd.eof() ) {
+      rule.in_ready = false;
+    } else if ( not rule.fd.closed() and rule.in.first() ) {
+      throw runtime_error( "EventLoop: busy wait detected: rule \"" + _rule_categories.at( rule.category_id ).name
+                           + "\" did not read fd until EAGAIN and is still interested" );
     }
   }
 
-  return Result::Success;
+  if ( ( events & EPOLLOUT ) and not rule.fd.closed() and rule.out.first() ) {
+    RecordScopeTimer<Timer::Category::Nonblock> record_timer { _rule_categories.at( rule.category_id ).timer };
+
+    const auto blocked_before = rule.fd.blocked_write_count();
+    rule.out.second();
+
+    if ( blocked_before != rule.fd.blocked_write_count() ) {
+      rule.out_ready = false;
+    } else if ( not rule.fd.closed() and rule.out.first() ) {
+      throw runtime_error( "EventLoop: busy wait detected: rule \"" + _rule_categories.at( rule.category_id ).name
+                           + "\" did not write fd until EAGAIN and is still interested" );
+    }
+  }
+}
+
+void EventLoop::fail( FDRule& rule )
+{
+  rule.done = true;
+  // nothing of the rule's may be in use by the kernel once its owner hears about it
+  rule.quiesce();
+  rule.cancel();
+}
+
+simple_string_span EventLoop::read_target( FDRule& rule )
+{
+  const simple_string_span target = rule.read_target();
+  if ( target.empty() ) {
+    throw runtime_error( "EventLoop: busy wait detected: rule \"" + _rule_categories.at( rule.category_id ).name
+                         + "\" is interested in reading but has nowhere to read to" );
+  }
+  return target;
+}
+
+void EventLoop::write_sources( FDRule& rule )
+{
+  rule.sources.clear();
+  rule.write_sources( rule.sources );
+  if ( rule.sources.empty() ) {
+    throw runtime_error( "EventLoop: busy wait detected: rule \"" + _rule_categories.at( rule.category_id ).name
+                         + "\" is interested in writing but has nothing to write" );
+  }
+}
+
+void EventLoop::adopt( FDRule& rule )
+{
+  rule.uring = _uring.get();
+  if ( _uring and rule.loop_io and not _free_file_slots.empty() ) {
+    rule.fixed_file = _free_file_slots.back();
+    _free_file_slots.pop_back();
+    _uring->update_file( rule.fixed_file, rule.fd.fd_num() );
+  }
+}
+
+void EventLoop::retire( FDRule& rule )
+{
+  rule.quiesce();
+  if ( rule.fixed_file >= 0 ) {
+    _uring->update_file( rule.fixed_file, -1 );
+    _free_file_slots.push_back( rule.fixed_file );
+    rule.fixed_file = -1;
+  }
+}
+
+void EventLoop::register_buffer( const string_view region )
+{
+  if ( not _uring or _free_buffer_slots.empty() ) {
+    return;
+  }
+  const unsigned slot = _free_buffer_slots.back();
+  try {
+    _uring->update_buffer( slot, { const_cast<char*>( region.data() ), region.size() } );
+  } catch ( const unix_error& ) {
+    // e.g. over RLIMIT_MEMLOCK: it will do without
+    return;
+  }
+  _free_buffer_slots.pop_back();
+  _registered_buffers[region.data()] = { region.size(), slot };
+}
+
+void EventLoop::unregister_buffer( const string_view region )
+{
+  const auto it = _registered_buffers.find( region.data() );
+  if ( it == _registered_buffers.end() ) {
+    return;
+  }
+  _uring->update_buffer( it->second.second, { nullptr, 0 } );
+  _free_buffer_slots.push_back( it->second.second );
+  _registered_buffers.erase( it );
+}
+
+optional<unsigned> EventLoop::buffer_slot( const string_view region ) const
+{
+  auto it = _registered_buffers.upper_bound( region.data() );
+  if ( it == _registered_buffers.begin() ) {
+    return {};
+  }
+  --it;
+  const uintptr_t start = reinterpret_cast<uintptr_t>( it->first );
+  if ( reinterpret_cast<uintptr_t>( region.data() ) + region.size() <= start + it->second.first ) {
+    return it->second.second;
+  }
+  return {};
+}
+
+uint64_t EventLoop::system_calls() const
+{
+  return _system_calls + ( _uring ? _uring->system_calls() : 0 );
+}
+
+void EventLoop::started( const shared_ptr<FDRule>& rule )
+{
+  if ( rule->ops_in_flight++ == 0 ) {
+    _in_flight.emplace( rule.get(), rule );
+  }
+}
+
+namespace {
+
+// the file for an operation on `rule`'s fd
+void set_file( io_uring_sqe& sqe, const int fd, const int fixed_file )
+{
+  if ( fixed_file >= 0 ) {
+    sqe.fd = fixed_file;
+    sqe.flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe.fd = fd;
+  }
+}
+
+}
+
+void EventLoop::submit_poll( const shared_ptr<FDRule>& rule, const uint32_t events )
+{
+  io_uring_sqe& sqe = _uring->next_sqe();
+  if ( rule->armed_events == 0 ) {
+    // (one-shot, so it reports readiness the way level-triggered epoll does)
+    rule->poll_generation++;
+    sqe.opcode = IORING_OP_POLL_ADD;
+    sqe.fd = rule->fd.fd_num();
+    sqe.poll32_events = events;
+    sqe.user_data = rule->user_data( Poll );
+    started( rule );
+  } else {
+    // remove it, or change what it waits for in place
+    sqe.opcode = IORING_OP_POLL_REMOVE;
+    sqe.addr = rule->user_data( Poll );
+    if ( events ) {
+      sqe.len = IORING_POLL_UPDATE_EVENTS;
+      sqe.poll32_events = events;
+    }
+    sqe.user_data = Ignored;
+  }
+  rule->armed_events = events;
+}
+
+void EventLoop::submit_read( const shared_ptr<FDRule>& rule )
+{
+  const simple_string_span target = read_target( *rule );
+  io_uring_sqe& sqe = _uring->next_sqe();
+  set_file( sqe, rule->fd.fd_num(), rule->fixed_file );
+  sqe.addr = reinterpret_cast<uintptr_t>( target.data() );
+  sqe.len = target.size();
+  sqe.off = -1; // (not a position)
+  if ( const auto slot = buffer_slot( target ) ) {
+    sqe.opcode = IORING_OP_READ_FIXED;
+    sqe.buf_index = *slot;
+  } else {
+    sqe.opcode = IORING_OP_READ;
+  }
+  sqe.user_data = rule->user_data( Read );
+  rule->read_in_flight = true;
+  started( rule );
+}
+
+void EventLoop::submit_write( const shared_ptr<FDRule>& rule )
+{
+  write_sources( *rule );
+  io_uring_sqe& sqe = _uring->next_sqe();
+  set_file( sqe, rule->fd.fd_num(), rule->fixed_file );
+  sqe.off = -1;
+  const auto& sources = rule->sources;
+  const auto slot = sources.size() == 1 ? buffer_slot( sources.front() ) : nullopt;
+  if ( sources.size() == 1 ) {
+    sqe.opcode = slot ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe.addr = reinterpret_cast<uintptr_t>( sources.front().data() );
+    sqe.len = sources.front().size();
+    sqe.buf_index = slot.value_or( 0 );
+  } else {
+    rule->iovecs.clear();
+    for ( const auto source : sources ) {
+      rule->iovecs.push_back( { const_cast<char*>( source.data() ), source.size() } );
+    }
+    sqe.opcode = IORING_OP_WRITEV;
+    sqe.addr = reinterpret_cast<uintptr_t>( rule->iovecs.data() );
+    sqe.len = rule->iovecs.size();
+  }
+  sqe.user_data = rule->user_data( Write );
+  rule->write_in_flight = true;
+  started( rule );
+}
+
+bool EventLoop::wait_for_completions( const int timeout_ms )
+{
+  {
+    GlobalScopeTimer<Timer::Category::WaitingForEvent> timer;
+    _uring->enter( true, timeout_ms );
+  }
+
+  if ( not _uring->completed() ) {
+    return false;
+  }
+
+  _uring->drain( [&]( const uint64_t user_data, const int result, uint32_t ) { complete( user_data, result ); } );
+  return true;
+}
+
+void EventLoop::complete( const uint64_t user_data, const int result )
+{
+  const unsigned op = user_data & 7;
+  if ( op == Ignored ) {
+    return;
+  }
+
+  const auto found = _in_flight.find( reinterpret_cast<FDRule*>( user_data & 0x0000'ffff'ffff'fff8 ) );
+  if ( found == _in_flight.end() ) {
+    throw runtime_error( "EventLoop: completion for no operation in flight" );
+  }
+  const shared_ptr<FDRule> rule_ptr = found->second;
+  FDRule& rule = *rule_ptr;
+  if ( --rule.ops_in_flight == 0 ) {
+    _in_flight.erase( found );
+  }
+
+  if ( op == Poll ) {
+    if ( uint16_t( user_data >> 48 ) != rule.poll_generation or result == -ECANCELED ) {
+      // one that was removed
+      return;
+    }
+    rule.armed_events = 0;
+    dispatch( rule, result < 0 ? uint32_t( EPOLLERR ) : uint32_t( result ) );
+    return;
+  }
+
+  ( op == Read ? rule.read_in_flight : rule.write_in_flight ) = false;
+  if ( rule.done or rule.cancel_requested or rule.fd.closed() ) {
+    return;
+  }
+  fired( rule );
+  if ( result == -EAGAIN or result == -EINTR ) {
+    // to be submitted again
+    return;
+  }
+  if ( result < 0 ) {
+    fail( rule );
+    if ( _fd_failure_callback ) {
+      ( *_fd_failure_callback )();
+      return;
+    }
+    throw unix_error( string( op == Read ? "read" : "write" ) + " (io_uring) for rule \""
+                        + _rule_categories.at( rule.category_id ).name + "\"",
+                      -result );
+  }
+
+  RecordScopeTimer<Timer::Category::Nonblock> record_timer { _rule_categories.at( rule.category_id ).timer };
+  if ( op == Read ) {
+    rule.fd.account_read( result );
+    rule.read_done( result );
+  } else {
+    rule.fd.account_write();
+    rule.write_done( result );
+  }
 }
 
 constexpr double THOUSAND = 1e3;
@@ -1,18 +1,29 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <functional>
 #include <list>
+#include <map>
 #include <memory>
 #include <optional>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <sys/epoll.h>
+#include <sys/uio.h>
 
+#include "eventfd.hh"
 #include "exception.hh"
 #include "file_descriptor.hh"
+#include "mpsc_queue.hh"
+#include "simple_string_span.hh"
 #include "timer.hh"
 
+class IoUring;
+
 //! Waits for events on file descriptors and executes corresponding callbacks.
 class EventLoop
 {
@@ -35,9 +46,37 @@ public:
     inline static constexpr direction_out_t Out {};
   };
 
+  //! Tag for rules whose reads and writes the loop does itself (see add_rule)
+  class loop_io_t
+  {
+  public:
+    explicit loop_io_t() = default;
+  };
+
+  inline static constexpr loop_io_t LoopIO {};
+
+  //! Tag for edge-triggered rules (see add_rule)
+  class edge_triggered_t
+  {
+  public:
+    explicit edge_triggered_t() = default;
+  };
+
+  inline static constexpr edge_triggered_t EdgeTriggered {};
+
+  //! What waits for the file descriptors to be ready
+  enum class Backend
+  {
+    Epoll,  //!< epoll_wait, with one epoll_ctl per change of interest
+    IoUring //!< io_uring: one io_uring_enter submits every change and waits (see IoUring)
+  };
+
 private:
   using CallbackT = std::function<void( void )>;
   using InterestT = std::function<bool( void )>;
+  using ReadTargetT = std::function<simple_string_span( void )>;
+  using WriteSourcesT = std::function<void( std::vector<std::string_view>& )>;
+  using DoneT = std::function<void( size_t )>;
 
   struct RuleCategory
   {
@@ -49,18 +88,27 @@ private:
     {}
   };
 
+  struct GroupState;
+
   struct BasicRule
   {
     size_t category_id;
     bool cancel_requested;
+    const bool is_fd_rule;
+
+    //! If set, the rule's interest is only evaluated when it is dirty (see InterestGroup)
+    std::shared_ptr<GroupState> group {};
+    bool dirty { true }; //!< Waiting in a dirty list (or not yet placed) to be evaluated
+    bool placed { false }; //!< Moved from the pending list into the loop
 
-    BasicRule( const size_t category_id );
+    BasicRule( const size_t category_id, const bool is_fd_rule );
   };
 
   struct Rule : public BasicRule
   {
     InterestT interest;
     CallbackT callback;
+    std::list<std::shared_ptr<Rule>>::iterator grouped_at {}; //!< Position in _grouped_non_fd_rules, once placed
 
     Rule( const size_t category_id, const InterestT& interest, const CallbackT& callback );
   };
@@ -72,28 +120,79 @@ private:
     std::pair<InterestT, CallbackT> out { [] { return false; }, [] {} };
     CallbackT cancel; //!< A callback that is called when the rule is cancelled
                       //!< (e.g. on hangup)
+    CallbackT error_queue; //!< If set, called on EPOLLERR without a pending socket error
+                           //!< (e.g. MSG_ZEROCOPY completions); must drain the error queue
 
     bool current_in_interested;
     bool current_out_interested;
-
-    const int epoll_fd_num; // necessary for the destructor
+    //! \name Edge-triggered rules: epoll reports a change of readiness once, so the loop keeps track of it until the
+    //! callback has run into EAGAIN
+    //!@{
+    const bool edge_triggered;
+    bool in_ready { false };
+    bool out_ready { false };
+    //!@}
+    std::list<std::shared_ptr<FDRule>>::iterator grouped_at {}; //!< Position in _grouped_fd_rules, once placed
+
+    //! \name Rules added with LoopIO: the loop reads into read_target() and writes out what write_sources() gives,
+    //! and reports how many bytes that was to read_done and write_done (0 and eof for end of file)
+    //!@{
+    bool loop_io { false };
+    ReadTargetT read_target {};
+    DoneT read_done {};
+    WriteSourcesT write_sources {};
+    DoneT write_done {};
+    std::vector<std::string_view> sources {}; //!< What is being written (kept while io_uring writes it)
+    //!@}
+
+    //! \name io_uring state
+    //!@{
+    IoUring* uring { nullptr };
+    uint32_t armed_events { 0 }; //!< What the poll in flight is for (0: none), for rules that do their own I/O
+    uint16_t poll_generation { 0 }; //!< Tells an old poll's completion from the current one's
+    bool read_in_flight { false };
+    bool write_in_flight { false };
+    unsigned ops_in_flight { 0 };
+    int fixed_file { -1 }; //!< Slot in the registered file table, if any
+    std::vector<iovec> iovecs {};
+    //!@}
+
+    const int epoll_fd_num; // necessary for the destructor (-1 if not on epoll)
     epoll_event _epoll_event {};
     bool done { false };
 
     FDRule( const size_t category_id,
-            const FileDescriptor& epoll_fd,
+            const int epoll_fd_num,
             FileDescriptor&& fd,
             const std::optional<std::pair<InterestT, CallbackT>>& in,
             const std::optional<std::pair<InterestT, CallbackT>>& out,
-            const CallbackT& cancel );
+            const CallbackT& cancel,
+            const CallbackT& error_queue = {},
+            const bool edge_triggered = false );
 
     ~FDRule();
 
+    FDRule( const FDRule& ) = delete;
+    FDRule& operator=( const FDRule& ) = delete;
+
+    //! The user_data of this rule's operations of kind `op` (see Op)
+    uint64_t user_data( unsigned op ) const;
+
+    //! Cancels the rule's io_uring operations and waits for them to stop, so that the memory they read from and
+    //! write to can go (their completions still come, and keep the rule alive until then)
+    void quiesce();
+
     operator epoll_event*()
     {
       _epoll_event.data.ptr = static_cast<void*>( this );
       _epoll_event.events = 0;
 
+      if ( edge_triggered ) {
+        // registered once and for all; interest only decides whether the callbacks run
+        _epoll_event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        return &_epoll_event;
+      }
+
       if ( current_in_interested ) {
         _epoll_event.events |= EPOLLIN;
       }
@@ -117,6 +216,143 @@ private:
   std::list<std::shared_ptr<FDRule>> _pending_fd_rules {};
   std::list<std::shared_ptr<Rule>> _pending_non_fd_rules {};
 
+  //! Rules in an InterestGroup: evaluated only from the dirty lists, never by walking these
+  std::list<std::shared_ptr<FDRule>> _grouped_fd_rules {};
+  std::list<std::shared_ptr<Rule>> _grouped_non_fd_rules {};
+  std::vector<std::shared_ptr<FDRule>> _dirty_fd_rules {};
+  std::vector<std::shared_ptr<Rule>> _dirty_non_fd_rules {};
+  // swapped with the dirty lists while they are gone through, so neither is reallocated each time
+  std::vector<std::shared_ptr<FDRule>> _evaluating_fd_rules {};
+  std::vector<std::shared_ptr<Rule>> _evaluating_non_fd_rules {};
+  size_t _interested_grouped_fd_rules { 0 };
+
+  //! Edge-triggered rules that are ready and interested: they run without waiting for epoll to say so again
+  std::vector<std::shared_ptr<FDRule>> _ready_fd_rules {};
+  //! How many times in a row the loop has run ready rules without looking at epoll
+  unsigned _ready_passes { 0 };
+  static constexpr unsigned MAX_READY_PASSES = 16;
+
+  struct GroupState
+  {
+    EventLoop* loop;
+    std::vector<std::weak_ptr<BasicRule>> rules {};
+
+    void notify();
+  };
+
+  //! Moves rules added since the last call out of the pending lists
+  void place_pending_rules();
+  //! Queues a grouped rule to have its interest evaluated before the loop next sleeps
+  void mark_dirty( const std::shared_ptr<BasicRule>& rule );
+  //! After one of a group's rules has fired: the others may have something to do now, and so may it
+  static void fired( BasicRule& rule );
+
+  void run_non_fd_rule( Rule& rule, unsigned int iterations );
+  //! Asks an fd rule what it is interested in, and tells epoll if that changed
+  void update_interest( const std::shared_ptr<FDRule>& rule );
+
+  //! \name io_uring backend
+  //!@{
+  enum Op : unsigned
+  {
+    Ignored = 0,
+    Poll = 1,
+    Read = 2,
+    Write = 3,
+  };
+  static constexpr unsigned REGISTERED_SLOTS = 1024; //!< files, and buffers
+
+  std::unique_ptr<IoUring> _uring;
+  //! Rules with operations in flight, kept alive until their completions come in
+  std::unordered_map<FDRule*, std::shared_ptr<FDRule>> _in_flight {};
+  std::vector<unsigned> _free_file_slots {};
+  std::vector<unsigned> _free_buffer_slots {};
+  std::map<const char*, std::pair<size_t, unsigned>> _registered_buffers {}; //!< start -> length, slot
+
+  //! \returns false on timeout
+  bool wait_for_completions( int timeout_ms );
+  void complete( uint64_t user_data, int result );
+  void submit_poll( const std::shared_ptr<FDRule>& rule, uint32_t events );
+  void submit_read( const std::shared_ptr<FDRule>& rule );
+  void submit_write( const std::shared_ptr<FDRule>& rule );
+  //! Keeps the rule alive (in _in_flight) while it has an operation in flight
+  void started( const std::shared_ptr<FDRule>& rule );
+  //! The registered buffer `region` lies in, if any
+  std::optional<unsigned> buffer_slot( std::string_view region ) const;
+  //!@}
+
+  //! \name Timers: a hierarchical timing wheel of WHEEL_LEVELS levels of WHEEL_SLOTS slots, ticking every TICK_NS.
+  //! \details A timer goes in the lowest level that reaches its deadline, in the slot its deadline falls in. As the
+  //! wheel turns, each slot of a higher level is emptied into the levels below when its turn comes ("cascading"),
+  //! so adding and cancelling a timer take constant time, and so does each tick.
+  //!@{
+  struct TimerEntry;
+  using TimerSlot = std::list<std::shared_ptr<TimerEntry>>;
+
+  struct TimerEntry
+  {
+    EventLoop* loop;
+    uint64_t deadline; //!< In Timer::timestamp_ns() time
+    CallbackT callback;
+    TimerSlot* slot { nullptr }; //!< Where it is waiting (nowhere once fired or cancelled)
+    TimerSlot::iterator at {};
+  };
+
+  static constexpr unsigned WHEEL_BITS = 6;
+  static constexpr unsigned WHEEL_SLOTS = 1 << WHEEL_BITS;
+  static constexpr unsigned WHEEL_LEVELS = 4; //!< Reaching 2^24 ticks (4.6 hours); later timers wait at the top
+  static constexpr uint64_t TICK_NS = 1'000'000;
+
+  std::array<std::array<TimerSlot, WHEEL_SLOTS>, WHEEL_LEVELS> _wheel {};
+  //! The tick the wheel has turned to (Timer::timestamp_ns() / TICK_NS)
+  uint64_t _wheel_tick { Timer::timestamp_ns() / TICK_NS };
+  size_t _timer_count { 0 };
+  TimerSlot _firing_timers {}; //!< The slot whose timers are being run
+
+  //! Puts a timer in its slot, at least `min_ticks` ahead of the wheel
+  void place_timer( const std::shared_ptr<TimerEntry>& timer, uint64_t min_ticks );
+  //! Turns the wheel up to now, running the timers that come due; \returns whether there were any
+  bool run_timers();
+  //! What is left of `timeout_ms` (counting from `started`), shortened to wake up for the next timer (or for the
+  //! next cascade, if that comes first)
+  int timer_timeout( int timeout_ms, uint64_t started ) const;
+  //!@}
+
+  //! \name Tasks posted from other threads (see post())
+  //!@{
+  static constexpr size_t POST_QUEUE_CAPACITY = 16384;
+
+  MPSCQueue<CallbackT> _posted { POST_QUEUE_CAPACITY };
+  EventFD _post_wakeup {};
+  //! The eventfd has been written, and the loop has not yet started on the queue since
+  std::atomic<bool> _post_wakeup_pending { false };
+  size_t _post_category {}; //!< The category of the rule that runs the tasks
+  FDRule* _post_rule { nullptr }; //!< That rule, whose poll (with io_uring) is always in flight
+  std::atomic<std::thread::id> _loop_thread {}; //!< The last thread to call wait_next_event()
+
+  //! Makes sure the loop wakes up to look at the queue (unless it is already bound to)
+  void wake_for_posted();
+  //! Runs the posted tasks, up to a queue's worth
+  void run_posted();
+  //! Whether any operations besides the posted task rule's are in flight
+  bool others_in_flight() const { return _in_flight.size() > _in_flight.count( _post_rule ); }
+  //!@}
+
+  uint64_t _system_calls { 0 };
+
+  //! Sets up a rule the loop is about to start looking at
+  void adopt( FDRule& rule );
+  //! Undoes adopt() for a rule the loop is done with
+  void retire( FDRule& rule );
+  //! Handles events (EPOLLIN etc., or their poll(2) equivalents) on a rule's fd
+  void dispatch( FDRule& rule, uint32_t events );
+  //! The part of dispatch() that runs an edge-triggered rule's callbacks
+  void dispatch_edge_triggered( FDRule& rule, uint32_t events );
+  //! Ends a rule because of an error or hangup on its fd
+  void fail( FDRule& rule );
+  simple_string_span read_target( FDRule& rule );
+  void write_sources( FDRule& rule );
+
   std::optional<CallbackT> _fd_failure_callback { std::nullopt };
 
   const uint64_t _beginning_timestamp { Timer::timestamp_ns() };
@@ -131,10 +367,18 @@ public:
              //!< calls to EventLoop::wait_next_event.
   };
 
+  explicit EventLoop( Backend backend = Backend::Epoll );
+  ~EventLoop();
+
+  EventLoop( const EventLoop& ) = delete;
+  EventLoop& operator=( const EventLoop& ) = delete;
+
   size_t add_category( const std::string& name );
 
   class RuleHandle
   {
+    friend class EventLoop;
+
     std::weak_ptr<BasicRule> rule_weak_ptr_;
 
   public:
@@ -146,6 +390,62 @@ public:
     void cancel();
   };
 
+  class TimerHandle
+  {
+    friend class EventLoop;
+
+    std::weak_ptr<TimerEntry> timer_weak_ptr_ {};
+
+    explicit TimerHandle( const std::shared_ptr<TimerEntry>& timer )
+      : timer_weak_ptr_( timer )
+    {}
+
+  public:
+    TimerHandle() = default;
+
+    //! Makes sure the timer won't go off (if it hasn't already)
+    void cancel();
+  };
+
+  //! Calls `callback` from the loop once Timer::timestamp_ns() reaches `deadline_ns` (within a millisecond or so,
+  //! and never before). A deadline already past goes off as soon as the loop next looks.
+  //! \details Timers keep wait_next_event() from returning Exit while they are pending; its `timeout_ms` is cut
+  //! short as needed for them to go off in time, and it returns Success when any have.
+  TimerHandle add_timer( uint64_t deadline_ns, const CallbackT& callback );
+
+  //! Queues `callback` to run on the loop's thread; callable from any thread.
+  //! \details Each thread's tasks run in the order it posted them. The loop is woken up (through an eventfd) only
+  //! if it has not been already since it last started on the queue, and then runs everything queued, so a burst
+  //! of posts costs one wakeup. The queue is bounded: when it is full, post() waits for the loop to make room,
+  //! or throws if called from the loop's own thread. Tasks waiting to run keep wait_next_event() from returning
+  //! Exit.
+  void post( CallbackT callback );
+
+  //! Tasks posted and not yet run (a snapshot, when other threads are posting)
+  size_t posted_tasks() const { return _posted.size(); }
+
+  //! Rules whose interest only changes when the loop is told so.
+  //! \details By default, the loop asks every rule whether it is interested on every iteration. A rule in a group
+  //! is asked only when it is added, after any rule of its group has fired, and after notify(); in between, the
+  //! loop goes by its last answer (and leaves its fd's epoll registration alone). Whatever else changes what a
+  //! grouped rule's interest would say -- typically, code working on the same connection from a task -- must call
+  //! notify(). Everything here is for the loop's own thread only.
+  class InterestGroup
+  {
+    friend class EventLoop;
+
+    std::shared_ptr<GroupState> state_ {};
+
+  public:
+    //! Adds a rule just returned by add_rule (before the loop next runs)
+    void add( const RuleHandle& rule );
+
+    //! The group's rules will be asked about their interest again before the loop next sleeps
+    void notify();
+  };
+
+  InterestGroup make_interest_group();
+
   RuleHandle add_rule(
     const size_t category_id,
     const FileDescriptor& fd,
@@ -153,7 +453,8 @@ public:
     const InterestT& in_interest,
     const CallbackT& out_callback,
     const InterestT& out_interest,
-    const CallbackT& cancel = [] {} );
+    const CallbackT& cancel = [] {},
+    const CallbackT& error_queue = {} );
 
   RuleHandle add_rule(
     const size_t category_id,
@@ -176,6 +477,53 @@ public:
     const CallbackT& callback,
     const InterestT& interest = [] { return true; } );
 
+  //! An edge-triggered rule for `fd`: each callback must read (or write) until the fd has nothing more to give
+  //! (or no more room), i.e. until a read (or write) finds EAGAIN, or else stop being interested.
+  //! \details epoll only reports that `fd` has become readable or writable. The loop remembers that until a
+  //! callback runs into EAGAIN, and runs the callback again whenever its interest comes back in the meantime,
+  //! without waiting for epoll. A callback that returns still interested without having run into EAGAIN would
+  //! never be woken up again, and is reported as a busy wait. With the io_uring backend, the rule is
+  //! level-triggered, but the same goes for its callbacks.
+  RuleHandle add_rule(
+    const size_t category_id,
+    edge_triggered_t,
+    const FileDescriptor& fd,
+    const CallbackT& in_callback,
+    const InterestT& in_interest,
+    const CallbackT& out_callback,
+    const InterestT& out_interest,
+    const CallbackT& cancel = [] {},
+    const CallbackT& error_queue = {} );
+
+  //! A rule for `fd` whose reads and writes the loop does itself, and only tells the rule about.
+  //! \details While `read_interest` holds, the loop reads what it can into `read_target()` and passes how much
+  //! that was to `read_done`. While `write_interest` holds, it writes what `write_sources` puts in its argument
+  //! (gathered, in one go) and passes how much went out to `write_done`. With the io_uring backend, a read or write
+  //! is submitted as soon as there is interest, and can take a while: until its `_done` is called, the target
+  //! (or the sources) must stay where it is. Reads into or writes out of a registered buffer (see
+  //! register_buffer()) use it as such, and the fd is put in the registered file table if there is room.
+  RuleHandle add_rule(
+    const size_t category_id,
+    loop_io_t,
+    const FileDescriptor& fd,
+    const ReadTargetT& read_target,
+    const DoneT& read_done,
+    const InterestT& read_interest,
+    const WriteSourcesT& write_sources,
+    const DoneT& write_done,
+    const InterestT& write_interest,
+    const CallbackT& cancel = [] {} );
+
+  //! Lets the io_uring backend use `region` as a registered buffer (nothing, with epoll), until unregistered
+  void register_buffer( std::string_view region );
+  void unregister_buffer( std::string_view region );
+
+  Backend backend() const { return _uring ? Backend::IoUring : Backend::Epoll; }
+
+  //! System calls the loop itself has made: waiting and changing interest, and the reads and writes of LoopIO
+  //! rules (not what callbacks do)
+  uint64_t system_calls() const;
+
   void set_fd_failure_callback( const CallbackT& callback );
 
   //! Calls [poll(2)](\ref man2::poll) and then executes callback for each ready
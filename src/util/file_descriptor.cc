@@ -69,7 +69,10 @@ size_t FileDescriptor::read( simple_string_span buffer )
 
   const ssize_t bytes_read = ::read( fd_num(), buffer.mutable_data(), buffer.size() );
   if ( bytes_read < 0 ) {
-    if ( _internal_fd->_non_blocking and ( errno == EAGAIN or errno == EINPROGRESS ) ) {
+    if ( would_block() ) {
+      register_blocked_read();
+      return 0;
+    } else if ( _internal_fd->_non_blocking and errno == EINPROGRESS ) {
       return 0;
     } else {
       throw unix_error( "read" );
@@ -91,7 +94,12 @@ size_t FileDescriptor::read( simple_string_span buffer )
 
 size_t FileDescriptor::write( const string_view buffer )
 {
-  const ssize_t bytes_written = CheckSystemCall( "write", ::write( fd_num(), buffer.data(), buffer.size() ) );
+  const ssize_t ret = ::write( fd_num(), buffer.data(), buffer.size() );
+  if ( ret < 0 and would_block() ) {
+    register_blocked_write();
+    return 0;
+  }
+  const ssize_t bytes_written = CheckSystemCall( "write", ret );
   register_write();
 
   if ( bytes_written == 0 and buffer.size() != 0 ) {
@@ -113,7 +121,12 @@ size_t FileDescriptor::write( const vector<string_view>& buffers )
     iovecs.push_back( { const_cast<char*>( x.data() ), x.size() } );
   }
 
-  const ssize_t bytes_written = CheckSystemCall( "writev", ::writev( fd_num(), iovecs.data(), iovecs.size() ) );
+  const ssize_t ret = ::writev( fd_num(), iovecs.data(), iovecs.size() );
+  if ( ret < 0 and would_block() ) {
+    register_blocked_write();
+    return 0;
+  }
+  const ssize_t bytes_written = CheckSystemCall( "writev", ret );
   register_write();
 
   return bytes_written;
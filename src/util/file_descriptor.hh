@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cerrno>
 #include <cstddef>
 #include <limits>
 #include <memory>
@@ -21,6 +22,8 @@ class FileDescriptor
     bool _non_blocking = true; //!< Flag indicating whether FDWrapper::_fd is non-blocking
     unsigned _read_count = 0;  //!< The number of times FDWrapper::_fd has been read
     unsigned _write_count = 0; //!< The numberof times FDWrapper::_fd has been written
+    unsigned _blocked_read_count = 0;  //!< The number of reads that found nothing to read (EAGAIN)
+    unsigned _blocked_write_count = 0; //!< The number of writes that found no room to write (EAGAIN)
 
     //! Construct from a file descriptor number returned by the kernel
     explicit FDWrapper( const int fd );
@@ -53,6 +56,11 @@ protected:
   void set_eof() { _internal_fd->_eof = true; }
   void register_read() { ++_internal_fd->_read_count; }   //!< increment read count
   void register_write() { ++_internal_fd->_write_count; } //!< increment write count
+  void register_blocked_read() { ++_internal_fd->_blocked_read_count; }   //!< increment blocked read count
+  void register_blocked_write() { ++_internal_fd->_blocked_write_count; } //!< increment blocked write count
+
+  //! \returns whether a system call that just failed only would have blocked
+  bool would_block() const { return _internal_fd->_non_blocking and errno == EAGAIN; }
 
   int CheckSystemCall( const std::string_view s_attempt, const int return_value ) const
   {
@@ -79,6 +87,16 @@ public:
 
   void write_all( std::string_view buffer );
 
+  //! Counts a read or write done some other way (e.g. through io_uring) the way read() and write() count theirs
+  void account_read( const size_t bytes_read )
+  {
+    register_read();
+    if ( bytes_read == 0 ) {
+      set_eof();
+    }
+  }
+  void account_write() { register_write(); }
+
   //! Close the underlying file descriptor
   void close() { _internal_fd->close(); }
 
@@ -95,6 +113,8 @@ public:
   bool closed() const { return _internal_fd->_closed; }                   //!< \brief closed flag state
   unsigned int read_count() const { return _internal_fd->_read_count; }   //!< \brief number of reads
   unsigned int write_count() const { return _internal_fd->_write_count; } //!< \brief number of writes
+  unsigned int blocked_read_count() const { return _internal_fd->_blocked_read_count; }   //!< \brief EAGAIN reads
+  unsigned int blocked_write_count() const { return _internal_fd->_blocked_write_count; } //!< \brief EAGAIN writes
   //!@}
 
   //! \name Copy/move constructor/assignment operators
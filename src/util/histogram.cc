@@ -0,0 +1,105 @@
+#include "histogram.hh"
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+size_t LatencyHistogram::index_of( const uint64_t value )
+{
+  // the first two powers of two are counted exactly; above them, each power of two gets SUB_BUCKETS buckets
+  if ( value < 2 * SUB_BUCKETS ) {
+    return value;
+  }
+  const unsigned shift = 63 - __builtin_clzll( value ) - SUB_BUCKET_BITS;
+  return shift * SUB_BUCKETS + ( value >> shift );
+}
+
+uint64_t LatencyHistogram::lowest_in( const size_t index )
+{
+  if ( index < 2 * SUB_BUCKETS ) {
+    return index;
+  }
+  const uint64_t shift = index / SUB_BUCKETS - 1;
+  return ( index - shift * SUB_BUCKETS ) << shift;
+}
+
+uint64_t LatencyHistogram::highest_in( const size_t index )
+{
+  if ( index < 2 * SUB_BUCKETS ) {
+    return index;
+  }
+  const uint64_t shift = index / SUB_BUCKETS - 1;
+  return lowest_in( index ) + ( ( uint64_t { 1 } << shift ) - 1 );
+}
+
+void LatencyHistogram::record( const uint64_t value )
+{
+  const size_t index = index_of( value );
+  if ( index >= counts_.size() ) {
+    counts_.resize( index + 1 );
+  }
+  counts_[index]++;
+  count_++;
+  total_ += value;
+  min_ = std::min( min_, value );
+  max_ = std::max( max_, value );
+}
+
+void LatencyHistogram::merge( const LatencyHistogram& other )
+{
+  if ( other.counts_.size() > counts_.size() ) {
+    counts_.resize( other.counts_.size() );
+  }
+  for ( size_t i = 0; i < other.counts_.size(); i++ ) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  total_ += other.total_;
+  min_ = std::min( min_, other.min_ );
+  max_ = std::max( max_, other.max_ );
+}
+
+uint64_t LatencyHistogram::percentile( const double percent ) const
+{
+  if ( count_ == 0 ) {
+    return 0;
+  }
+  // the rank of the value asked for, counting from 1
+  const uint64_t rank = std::max<uint64_t>( 1, std::min<double>( count_, percent / 100 * count_ + 0.5 ) );
+  uint64_t seen = 0;
+  for ( size_t i = 0; i < counts_.size(); i++ ) {
+    seen += counts_[i];
+    if ( seen >= rank ) {
+      // no more than the largest value actually seen
+      return std::min( highest_in( i ), max_ );
+    }
+  }
+  return max_;
+}
+
+vector<pair<uint64_t, uint64_t>> LatencyHistogram::buckets() const
+{
+  vector<pair<uint64_t, uint64_t>> ret;
+  for ( size_t i = 0; i < counts_.size(); i++ ) {
+    if ( counts_[i] ) {
+      ret.emplace_back( lowest_in( i ), counts_[i] );
+    }
+  }
+  return ret;
+}
+
+string LatencyHistogram::json() const
+{
+  ostringstream out;
+  out << "{\"count\":" << count_ << ",\"min\":" << min() << ",\"mean\":" << uint64_t( mean() )
+      << ",\"p50\":" << percentile( 50 ) << ",\"p90\":" << percentile( 90 ) << ",\"p99\":" << percentile( 99 )
+      << ",\"p999\":" << percentile( 99.9 ) << ",\"max\":" << max_ << ",\"buckets\":[";
+  bool first = true;
+  for ( const auto& [lowest, count] : buckets() ) {
+    out << ( first ? "" : "," ) << "[" << lowest << "," << count << "]";
+    first = false;
+  }
+  out << "]}";
+  return out.str();
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+//! Distribution of latencies (or any other non-negative values), HDR-style.
+//! \details Values are counted in buckets whose width grows with the value: every power of two is split into
+//! 2^SUB_BUCKET_BITS equal buckets, so any value is known to within 1/2^SUB_BUCKET_BITS (about 3%) of itself,
+//! from nanoseconds to hours, in a few kilobytes. Recording a value is a handful of instructions.
+class LatencyHistogram
+{
+public:
+  static constexpr unsigned SUB_BUCKET_BITS = 5;
+  static constexpr uint64_t SUB_BUCKETS = uint64_t { 1 } << SUB_BUCKET_BITS;
+
+private:
+  std::vector<uint64_t> counts_ {}; // by bucket index, as far as the largest value recorded
+  uint64_t count_ {};
+  uint64_t total_ {};
+  uint64_t min_ { UINT64_MAX };
+  uint64_t max_ {};
+
+  static size_t index_of( uint64_t value );
+  // the smallest and largest value in bucket `index`
+  static uint64_t lowest_in( size_t index );
+  static uint64_t highest_in( size_t index );
+
+public:
+  void record( uint64_t value );
+  // adds all of `other`'s values to this one
+  void merge( const LatencyHistogram& other );
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const { return count_ ? double( total_ ) / count_ : 0; }
+
+  //! \returns the value that `percent` percent of the recorded values are at or below (0 if there are none)
+  uint64_t percentile( double percent ) const;
+
+  //! \returns the buckets that have values in them, as (smallest value in the bucket, count)
+  std::vector<std::pair<uint64_t, uint64_t>> buckets() const;
+
+  //! \returns count, min, mean, max, p50/p90/p99/p999 and the non-empty buckets as a JSON object
+  std::string json() const;
+};
@@ -0,0 +1,162 @@
+#include "io_uring.hh"
+#include "exception.hh"
+
+#include <cerrno>
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+int setup( const unsigned entries, io_uring_params& params )
+{
+  // completions can pile up for longer than submissions do
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+  params.cq_entries = 4 * entries;
+  const int fd = syscall( __NR_io_uring_setup, entries, &params );
+  if ( fd < 0 ) {
+    throw unix_error( "io_uring_setup" );
+  }
+  if ( not( params.features & IORING_FEAT_SINGLE_MMAP ) or not( params.features & IORING_FEAT_EXT_ARG ) ) {
+    ::close( fd );
+    throw runtime_error( "io_uring: kernel too old" );
+  }
+  return fd;
+}
+
+size_t rings_size( const io_uring_params& params )
+{
+  return max( params.sq_off.array + params.sq_entries * sizeof( unsigned ),
+              params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe ) );
+}
+
+template<class T>
+T* at( const MMap_Region& region, const size_t offset )
+{
+  return reinterpret_cast<T*>( region.addr() + offset );
+}
+
+}
+
+IoUring::IoUring( const unsigned entries )
+  : fd_( setup( entries, params_ ) )
+  , rings_( nullptr, rings_size( params_ ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_.fd_num(),
+            IORING_OFF_SQ_RING )
+  , sqes_region_( nullptr,
+                  params_.sq_entries * sizeof( io_uring_sqe ),
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  fd_.fd_num(),
+                  IORING_OFF_SQES )
+  , sq_head_( at<unsigned>( rings_, params_.sq_off.head ) )
+  , sq_tail_( at<unsigned>( rings_, params_.sq_off.tail ) )
+  , sq_mask_( *at<unsigned>( rings_, params_.sq_off.ring_mask ) )
+  , sqes_( at<io_uring_sqe>( sqes_region_, 0 ) )
+  , cq_head_( at<unsigned>( rings_, params_.cq_off.head ) )
+  , cq_tail_( at<unsigned>( rings_, params_.cq_off.tail ) )
+  , cq_mask_( *at<unsigned>( rings_, params_.cq_off.ring_mask ) )
+  , cqes_( at<io_uring_cqe>( rings_, params_.cq_off.cqes ) )
+{
+  unsigned* const sq_array = at<unsigned>( rings_, params_.sq_off.array );
+  for ( unsigned i = 0; i < params_.sq_entries; i++ ) {
+    sq_array[i] = i;
+  }
+  sqe_tail_ = *sq_tail_;
+}
+
+io_uring_sqe& IoUring::next_sqe()
+{
+  if ( sqe_tail_ - __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE ) == params_.sq_entries ) {
+    // full: hand over what is there first
+    enter( false, 0 );
+    if ( sqe_tail_ - __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE ) == params_.sq_entries ) {
+      throw runtime_error( "io_uring: submission queue full" );
+    }
+  }
+  io_uring_sqe& sqe = sqes_[sqe_tail_ & sq_mask_];
+  memset( &sqe, 0, sizeof( sqe ) );
+  sqe_tail_++;
+  return sqe;
+}
+
+void IoUring::enter( bool wait, const int timeout_ms )
+{
+  __atomic_store_n( sq_tail_, sqe_tail_, __ATOMIC_RELEASE );
+  const unsigned to_submit = sqe_tail_ - __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE );
+  wait = wait and timeout_ms != 0 and not completed();
+  if ( to_submit == 0 and not wait ) {
+    return;
+  }
+
+  __kernel_timespec timeout { timeout_ms / 1000, ( timeout_ms % 1000 ) * 1'000'000L };
+  io_uring_getevents_arg arg {};
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = timeout_ms >= 0 ? reinterpret_cast<uint64_t>( &timeout ) : 0;
+
+  system_calls_++;
+  const int ret = syscall( __NR_io_uring_enter,
+                           fd_.fd_num(),
+                           to_submit,
+                           wait ? 1 : 0,
+                           ( wait ? IORING_ENTER_GETEVENTS : 0 ) | IORING_ENTER_EXT_ARG,
+                           &arg,
+                           sizeof( arg ) );
+  // timed out, interrupted, or out of room for completions until some are drained: all for the caller to see
+  if ( ret < 0 and errno != ETIME and errno != EINTR and errno != EBUSY and errno != EAGAIN ) {
+    throw unix_error( "io_uring_enter" );
+  }
+}
+
+int IoUring::do_register( const unsigned opcode, void* const arg, const unsigned nr_args )
+{
+  system_calls_++;
+  return syscall( __NR_io_uring_register, fd_.fd_num(), opcode, arg, nr_args );
+}
+
+void IoUring::register_sparse_tables( const unsigned count )
+{
+  io_uring_rsrc_register tables {};
+  tables.nr = count;
+  tables.flags = IORING_RSRC_REGISTER_SPARSE;
+  SystemCall( "io_uring_register(FILES2)", do_register( IORING_REGISTER_FILES2, &tables, sizeof( tables ) ) );
+  SystemCall( "io_uring_register(BUFFERS2)", do_register( IORING_REGISTER_BUFFERS2, &tables, sizeof( tables ) ) );
+}
+
+void IoUring::update_file( const unsigned slot, int fd )
+{
+  io_uring_rsrc_update2 update {};
+  update.offset = slot;
+  update.data = reinterpret_cast<uint64_t>( &fd );
+  update.nr = 1;
+  SystemCall( "io_uring_register(FILES_UPDATE2)",
+              do_register( IORING_REGISTER_FILES_UPDATE2, &update, sizeof( update ) ) );
+}
+
+void IoUring::update_buffer( const unsigned slot, iovec buffer )
+{
+  io_uring_rsrc_update2 update {};
+  update.offset = slot;
+  update.data = reinterpret_cast<uint64_t>( &buffer );
+  update.nr = 1;
+  SystemCall( "io_uring_register(BUFFERS_UPDATE)",
+              do_register( IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof( update ) ) );
+}
+
+void IoUring::cancel( const uint64_t user_data )
+{
+  // the kernel only looks at what it has been given
+  enter( false, 0 );
+
+  io_uring_sync_cancel_reg cancel {};
+  cancel.addr = user_data;
+  cancel.fd = -1;
+  cancel.flags = IORING_ASYNC_CANCEL_ALL;
+  cancel.timeout = { -1, -1 };
+  // ENOENT: nothing left to cancel
+  if ( do_register( IORING_REGISTER_SYNC_CANCEL, &cancel, 1 ) < 0 and errno != ENOENT and errno != EALREADY ) {
+    throw unix_error( "io_uring_register(SYNC_CANCEL)" );
+  }
+}
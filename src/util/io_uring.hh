@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include "file_descriptor.hh"
+#include "ring_buffer.hh"
+
+//! An io_uring instance, set up and driven with the raw system calls (see io_uring(7)): no liburing.
+//! \details Submissions are queued with next_sqe() and go to the kernel, all at once, with the next enter(), which
+//! can also wait for completions. Files and buffers can be registered in sparse tables, to be named by slot in
+//! submissions (IOSQE_FIXED_FILE, IORING_OP_READ_FIXED/WRITE_FIXED). Needs Linux 6.0 or later.
+class IoUring
+{
+  io_uring_params params_ {};
+  FileDescriptor fd_;
+  MMap_Region rings_;
+  MMap_Region sqes_region_;
+
+  // the submission ring; sq_array_ maps every slot to the submission entry of the same index, once and for all
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  io_uring_sqe* sqes_;
+  unsigned sqe_tail_ { 0 }; // entries handed out, whether or not the kernel has been told yet
+
+  // the completion ring
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+
+  uint64_t system_calls_ { 0 };
+
+  int do_register( unsigned opcode, void* arg, unsigned nr_args );
+
+public:
+  explicit IoUring( unsigned entries );
+
+  //! \returns a zeroed submission entry to fill in; it goes to the kernel with the next enter()
+  io_uring_sqe& next_sqe();
+
+  //! Submits what has been queued and, if `wait` (and nothing has completed yet), waits for a completion, for up
+  //! to `timeout_ms` milliseconds unless that is negative
+  void enter( bool wait, int timeout_ms );
+
+  //! Calls `handler( user_data, res, flags )` for each completion so far, retiring each before its call
+  template<class F>
+  unsigned drain( F&& handler )
+  {
+    unsigned count = 0;
+    unsigned head = *cq_head_;
+    while ( head != __atomic_load_n( cq_tail_, __ATOMIC_ACQUIRE ) ) {
+      const io_uring_cqe cqe = cqes_[head & cq_mask_];
+      __atomic_store_n( cq_head_, ++head, __ATOMIC_RELEASE );
+      handler( cqe.user_data, cqe.res, cqe.flags );
+      count++;
+    }
+    return count;
+  }
+
+  //! \returns whether there are completions to drain
+  bool completed() const { return *cq_head_ != __atomic_load_n( cq_tail_, __ATOMIC_ACQUIRE ); }
+
+  //! Sets up empty tables of `count` files and `count` buffers
+  void register_sparse_tables( unsigned count );
+  //! Puts `fd` in slot `slot` of the file table (-1 empties it)
+  void update_file( unsigned slot, int fd );
+  //! Puts `buffer` in slot `slot` of the buffer table ({ nullptr, 0 } empties it)
+  void update_buffer( unsigned slot, iovec buffer );
+
+  //! Cancels every submission with this `user_data` and waits until none is running; their completions (-ECANCELED
+  //! if they hadn't completed already) are still to be drained
+  void cancel( uint64_t user_data );
+
+  //! io_uring_enter and io_uring_register calls so far
+  uint64_t system_calls() const { return system_calls_; }
+
+  IoUring( const IoUring& ) = delete;
+  IoUring& operator=( const IoUring& ) = delete;
+};
@@ -0,0 +1,118 @@
+#include "log.hh"
+
+#include <cerrno>
+#include <chrono>
+#include <unistd.h>
+
+using namespace std;
+
+AsyncLogSink::AsyncLogSink()
+  : fd_( STDOUT_FILENO )
+{
+  writer_ = thread( [this] {
+    while ( not stopping_ ) {
+      if ( not drain() ) {
+        this_thread::sleep_for( chrono::milliseconds( 1 ) );
+      }
+    }
+    // whatever came in while stopping
+    drain();
+  } );
+}
+
+AsyncLogSink& AsyncLogSink::instance()
+{
+  static AsyncLogSink sink;
+  return sink;
+}
+
+AsyncLogSink::~AsyncLogSink()
+{
+  stopping_ = true;
+  writer_.join();
+}
+
+AsyncLogSink::Ring& AsyncLogSink::my_ring()
+{
+  static thread_local Ring* ring = [this] {
+    lock_guard<mutex> lock { rings_mutex_ };
+    rings_.push_back( make_unique<Ring>() );
+    return rings_.back().get();
+  }();
+  return *ring;
+}
+
+void AsyncLogSink::submit( const string_view line )
+{
+  Ring& ring = my_ring();
+  const uint64_t head = ring.head.load( memory_order_relaxed );
+  if ( head + line.size() - ring.tail.load( memory_order_acquire ) > RING_SIZE ) {
+    ring.dropped.fetch_add( 1, memory_order_relaxed );
+    return;
+  }
+
+  // the line may wrap around the end of the ring
+  const size_t start = head % RING_SIZE;
+  const size_t first = min( line.size(), RING_SIZE - start );
+  line.copy( ring.data.get() + start, first );
+  line.copy( ring.data.get(), line.size() - first, first );
+  ring.head.store( head + line.size(), memory_order_release );
+}
+
+bool AsyncLogSink::drain()
+{
+  bool any = false;
+  lock_guard<mutex> lock { rings_mutex_ };
+  for ( auto& ring : rings_ ) {
+    const uint64_t dropped = ring->dropped.exchange( 0, memory_order_relaxed );
+    if ( dropped ) {
+      dropped_ += dropped;
+      write_out( "W [" + to_string( dropped ) + " log lines dropped]\n" );
+    }
+
+    // only whole lines are ever published, so this ends at the end of a line
+    const uint64_t tail = ring->tail.load( memory_order_relaxed );
+    const uint64_t head = ring->head.load( memory_order_acquire );
+    if ( head == tail ) {
+      continue;
+    }
+    any = true;
+    const size_t start = tail % RING_SIZE;
+    const size_t first = min<uint64_t>( head - tail, RING_SIZE - start );
+    write_out( { ring->data.get() + start, first } );
+    write_out( { ring->data.get(), head - tail - first } );
+    ring->tail.store( head, memory_order_release );
+  }
+  return any;
+}
+
+void AsyncLogSink::write_out( string_view text )
+{
+  while ( not text.empty() ) {
+    const ssize_t written = ::write( fd_, text.data(), text.size() );
+    if ( written < 0 ) {
+      if ( errno == EINTR or errno == EAGAIN ) {
+        continue;
+      }
+      // nowhere to report it
+      return;
+    }
+    text.remove_prefix( written );
+  }
+}
+
+void AsyncLogSink::flush()
+{
+  vector<pair<Ring*, uint64_t>> heads;
+  {
+    lock_guard<mutex> lock { rings_mutex_ };
+    for ( auto& ring : rings_ ) {
+      heads.emplace_back( ring.get(), ring->head.load( memory_order_acquire ) );
+    }
+  }
+  for ( const auto& [ring, head] : heads ) {
+    while ( ring->tail.load( memory_order_acquire ) < head ) {
+      this_thread::sleep_for( chrono::microseconds( 100 ) );
+    }
+  }
+}
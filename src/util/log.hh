@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// leveled logging:
+//
+//   LOG( Debug ) << "looking up " << name;
+//
+// statements below LOG_LEVEL are compiled out, arguments and all, so they cost nothing. LOG_LEVEL is fixed at
+// build time (Info unless the build defines it, e.g. -DLOG_LEVEL=LOG_LEVEL_DEBUG). the rest are formatted on the
+// calling thread and handed to AsyncLogSink, which writes them out from a thread of its own: a log statement
+// never waits for the terminal or the disk.
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+enum class LogLevel : int
+{
+  Trace = LOG_LEVEL_TRACE,
+  Debug = LOG_LEVEL_DEBUG,
+  Info = LOG_LEVEL_INFO,
+  Warn = LOG_LEVEL_WARN,
+  Error = LOG_LEVEL_ERROR,
+};
+
+#define LOG( level )                                                                                              \
+  if constexpr ( static_cast<int>( LogLevel::level ) < LOG_LEVEL ) {                                               \
+  } else                                                                                                           \
+    LogLine( LogLevel::level )
+
+// takes finished log lines from any number of threads and writes them to a file descriptor (standard output
+// unless told otherwise) from a background thread. each thread gets its own ring of lines, written only by that
+// thread and read only by the sink's, so handing over a line takes no lock and never blocks: when a thread's
+// ring is full, its lines are dropped (and counted) until the sink catches up.
+// lines from one thread come out in order; lines from different threads may come out of order with each other.
+class AsyncLogSink
+{
+public:
+  static constexpr size_t RING_SIZE = 1 << 20; // per thread
+
+private:
+  struct Ring
+  {
+    std::unique_ptr<char[]> data { new char[RING_SIZE] };
+    std::atomic<uint64_t> head { 0 }; // bytes ever written, advanced by the producing thread only
+    std::atomic<uint64_t> tail { 0 }; // bytes ever written out, advanced by the sink's thread only
+    std::atomic<uint64_t> dropped { 0 };
+  };
+
+  std::mutex rings_mutex_ {}; // held to add a ring (once per thread), or to go through them
+  std::vector<std::unique_ptr<Ring>> rings_ {};
+  std::atomic<int> fd_;
+  std::atomic<uint64_t> dropped_ { 0 }; // lines, ever
+  std::atomic<bool> stopping_ { false };
+  std::thread writer_ {};
+
+  AsyncLogSink();
+  Ring& my_ring();
+  // writes out what is in the rings; returns whether there was anything
+  bool drain();
+  void write_out( std::string_view text );
+
+public:
+  static AsyncLogSink& instance();
+  ~AsyncLogSink();
+
+  // queues `line` (ending in a newline) to be written out. callable from any thread.
+  void submit( std::string_view line );
+  // returns once everything submitted so far has been written out
+  void flush();
+  // where lines go from now on (the caller keeps `fd` open)
+  void set_output( int fd ) { fd_ = fd; }
+  // lines that didn't fit in their thread's ring
+  uint64_t dropped() const { return dropped_; }
+
+  AsyncLogSink( const AsyncLogSink& ) = delete;
+  AsyncLogSink& operator=( const AsyncLogSink& ) = delete;
+};
+
+// one log statement: collects what is streamed into it and submits it as a line once the statement is over
+class LogLine
+{
+private:
+  std::string& line_;
+
+  static std::string& buffer()
+  {
+    // reused for every line from this thread, so formatting doesn't allocate
+    static thread_local std::string line;
+    return line;
+  }
+
+public:
+  explicit LogLine( LogLevel level )
+    : line_( buffer() )
+  {
+    static constexpr char letters[] = { 'T', 'D', 'I', 'W', 'E' };
+    line_.clear();
+    line_.push_back( letters[static_cast<int>( level )] );
+    line_.push_back( ' ' );
+  }
+
+  ~LogLine()
+  {
+    line_.push_back( '\n' );
+    AsyncLogSink::instance().submit( line_ );
+  }
+
+  template<class T>
+  LogLine& operator<<( const T& value )
+  {
+    if constexpr ( std::is_same_v<T, bool> ) {
+      line_.append( value ? "true" : "false" );
+    } else if constexpr ( std::is_same_v<T, char> ) {
+      line_.push_back( value );
+    } else if constexpr ( std::is_floating_point_v<T> ) {
+      // like an ostream's default formatting
+      char digits[32];
+      const auto end = std::to_chars( digits, digits + sizeof( digits ), value, std::chars_format::general, 6 ).ptr;
+      line_.append( digits, end );
+    } else if constexpr ( std::is_arithmetic_v<T> ) {
+      char digits[24];
+      line_.append( digits, std::to_chars( digits, digits + sizeof( digits ), value ).ptr );
+    } else {
+      line_.append( std::string_view { value } );
+    }
+    return *this;
+  }
+
+  LogLine( const LogLine& ) = delete;
+  LogLine& operator=( const LogLine& ) = delete;
+};
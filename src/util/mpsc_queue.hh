@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+//! A bounded queue that any number of threads can push to and one thread pops from, without locks.
+//! \details Each slot carries a sequence number saying whose turn it is (after D. Vyukov's bounded queue): a
+//! producer claims the slot at the tail with a compare-and-swap, fills it, and hands it on by bumping its sequence;
+//! the consumer takes it and bumps the sequence again, a lap ahead, for the producer that comes round next.
+//! Items from one producer come out in the order they went in.
+template<class T>
+class MPSCQueue
+{
+  struct Slot
+  {
+    std::atomic<uint64_t> sequence { 0 };
+    T value {};
+  };
+
+  const uint64_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  alignas( 64 ) std::atomic<uint64_t> tail_ { 0 }; //!< Next position to claim (producers)
+  alignas( 64 ) std::atomic<uint64_t> head_ { 0 }; //!< Next position to pop (only written by the consumer)
+
+public:
+  //! \param capacity is rounded up to a power of two
+  explicit MPSCQueue( const size_t capacity )
+    : mask_( [capacity] {
+      if ( capacity == 0 ) {
+        throw std::invalid_argument( "MPSCQueue: capacity must be positive" );
+      }
+      uint64_t size = 1;
+      while ( size < capacity ) {
+        size <<= 1;
+      }
+      return size - 1;
+    }() )
+    , slots_( std::make_unique<Slot[]>( mask_ + 1 ) )
+  {
+    for ( uint64_t i = 0; i <= mask_; i++ ) {
+      slots_[i].sequence.store( i, std::memory_order_relaxed );
+    }
+  }
+
+  //! Queues `value` unless the queue is full (callable from any thread)
+  //! \returns false, leaving `value` alone, if it is
+  bool try_push( T&& value )
+  {
+    uint64_t position = tail_.load( std::memory_order_relaxed );
+    while ( true ) {
+      Slot& slot = slots_[position & mask_];
+      const int64_t lag = static_cast<int64_t>( slot.sequence.load( std::memory_order_acquire ) - position );
+      if ( lag == 0 ) {
+        // the slot is free for this lap: claim it
+        if ( tail_.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) ) {
+          slot.value = std::move( value );
+          slot.sequence.store( position + 1, std::memory_order_release );
+          return true;
+        }
+      } else if ( lag < 0 ) {
+        // still holding what was pushed a lap ago
+        return false;
+      } else {
+        // another producer got there first
+        position = tail_.load( std::memory_order_relaxed );
+      }
+    }
+  }
+
+  //! Takes the oldest item, if there is one and its producer has finished pushing it (consumer only)
+  bool try_pop( T& value )
+  {
+    const uint64_t position = head_.load( std::memory_order_relaxed );
+    Slot& slot = slots_[position & mask_];
+    if ( slot.sequence.load( std::memory_order_acquire ) != position + 1 ) {
+      return false;
+    }
+    value = std::move( slot.value );
+    slot.value = T {};
+    slot.sequence.store( position + mask_ + 1, std::memory_order_release );
+    head_.store( position + 1, std::memory_order_relaxed );
+    return true;
+  }
+
+  //! Items pushed and not yet popped; only a snapshot when other threads are at work
+  size_t size() const
+  {
+    const uint64_t head = head_.load( std::memory_order_relaxed );
+    const uint64_t tail = tail_.load( std::memory_order_relaxed );
+    return tail > head ? tail - head : 0;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  MPSCQueue( const MPSCQueue& ) = delete;
+  MPSCQueue& operator=( const MPSCQueue& ) = delete;
+};
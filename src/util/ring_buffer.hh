@@ -60,6 +60,9 @@ public:
 
   size_t capacity() const { return first_mapping_.length(); }
 
+  // both mappings of the buffer: every readable or writable region lies within it
+  std::string_view mapped_region() const { return { virtual_address_space_.addr(), 2 * capacity() }; }
+
   simple_string_span writable_region();
   std::string_view writable_region() const;
   void push( const size_t num_bytes );